@@ -8,27 +8,103 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <getopt.h>
-// #include <pthread.h>
+#include <pthread.h>
 // #ifdef _WIN32
 // #include <windows.h>
 // #else
 #include <dirent.h>
 // #endif
+#include <fcntl.h>
+
+// d_type and fd-relative stat are POSIX-only; MinGW's dirent has neither
+#if !defined(_WIN32) && defined(_DIRENT_HAVE_D_TYPE)
+#define WINDEX_HAVE_D_TYPE 1
+#endif
 
 #include "sqlite3.h"
 #include <ilogg.h>
 
+// Change notifications for `windex watch`
+#ifdef _WIN32
+#include <windows.h>
+#undef MAX_PATH     // windows.h's 260 is too short for index paths
+#elif defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#define WINDEX_HAVE_INOTIFY 1
+#endif
+#include <signal.h>
+
+// Local search server (`windex serve`): a Unix domain socket, or a named pipe on Windows
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#endif
+
+// Name index sidecar (--engine names) is memory-mapped
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include <utime.h>      // bench churn
+
+// Vector substring scanners; AVX2 is compiled in separately and picked at runtime
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define WINDEX_HAVE_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WINDEX_HAVE_AVX2 1
+#endif
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WINDEX_HAVE_NEON 1
+#endif
+
 
 #define DB_D "%s/.windex"
 #define MAX_PATH 4096
 #define MAX_NAME 256
 
+// Long-only command-line options
+enum {
+    OPT_DIFF = 256,
+    OPT_FAST_META,
+    OPT_NO_DIR_META,
+    OPT_BATCH_SIZE,
+    OPT_COMMIT_INTERVAL,
+    OPT_PROFILE,
+    OPT_DIR_MTIME,
+    OPT_TRUST_DIR_MTIME,
+    OPT_SHARDS,
+    OPT_WARM,
+    OPT_LOCAL,
+    OPT_ENGINE,
+    OPT_LIMIT,
+    OPT_SORT,
+    OPT_FORMAT,
+    OPT_EPOCH,
+    OPT_FANOUT,
+    OPT_DEPTH,
+    OPT_FILES,
+    OPT_NAME_LEN,
+    OPT_SEED,
+    OPT_ROUNDS,
+    OPT_STATS,
+    OPT_HASH,
+    OPT_HASH_MIN,
+    OPT_IO,
+    OPT_FUZZY,
+    OPT_FUZZY_BUDGET,
+    OPT_NO_MAINTAIN
+};
+
 // // Excluded directories
 // const char *default_excluded_dirs[] = { "/Windows", "/Program Files", "/Program Files (x86)", "/ProgramData", NULL };
 // char **excluded_dirs = NULL;
@@ -46,23 +122,833 @@ static const char *default_excluded_dirs[] = {
 static char **excluded_dirs = NULL;
 static int num_excluded_dirs = 0;
 
+// Roots to index (--root, repeatable); each one's last scan is kept in the roots table
+#define MAX_ROOTS 16
+static const char *roots[MAX_ROOTS];
+static int num_roots = 0;
+
+// Compiled from excluded_dirs: whole-component names in a hash set, plus path prefixes
+typedef struct {
+    uint64_t hash;
+    const char *name;
+    size_t len;
+} exclude_slot;
+static exclude_slot *exclude_set = NULL;
+static size_t exclude_mask = 0;
+static char **exclude_prefixes = NULL;
+static int num_exclude_prefixes = 0;
+
+// Walk metadata options (--fast-meta, --no-dir-meta)
+static int fast_meta = 0;       // use d_type and fstatat() relative to the open directory
+static int skip_dir_meta = 0;   // don't stat directories at all; size/mtime stored as 0
+
+// Directories whose mtime matches the index can skip readdir() and file stats
+enum {
+    DIR_MTIME_OFF,      // list and stat every directory
+    DIR_MTIME_LIST,     // list unchanged directories from the index, still visit subdirectories
+    DIR_MTIME_TREE      // skip unchanged subtrees entirely
+};
+static int dir_mtime_mode = DIR_MTIME_OFF;
+
+// Directory listing backends (--io), beneath both walkers
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#define WINDEX_HAVE_IO_URING 1
+#endif
+#endif
+
+enum {
+    IO_AUTO,
+    IO_POSIX,       // readdir() and one stat() per entry
+    IO_URING,       // Linux: readdir(), then the entries' statx requests in flight together
+    IO_FIND         // Windows: FindFirstFileExW, whose listing carries size, mtime and attributes
+};
+static const char *io_names[] = { "auto", "posix", "uring", "find", NULL };
+static int io_backend = IO_AUTO;
+#ifdef _WIN32
+#define IO_DEFAULT IO_FIND
+#else
+#define IO_DEFAULT IO_POSIX
+#endif
+
+#define DIR_READ_BATCH 256          // statx requests per io_uring submission
+
+#ifdef WINDEX_HAVE_IO_URING
+// One ring per walker thread, mapped by hand: liburing isn't a dependency
+typedef struct {
+    int fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_size;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} io_ring;
+#endif
+
+// An open directory; entries come back one at a time whatever the backend
+typedef struct {
+    int backend;            // IO_POSIX, IO_URING or IO_FIND once opened
+    DIR *dir;
+    struct dirent *entry;   // IO_POSIX: the entry _dir_next returned
+#ifdef WINDEX_HAVE_IO_URING
+    io_ring *ring;
+    int ring_failed;
+    int count;              // entries read ahead and stat'ed as one batch
+    int next;
+    char names[DIR_READ_BATCH][MAX_NAME];
+    struct statx stx[DIR_READ_BATCH];
+    int errs[DIR_READ_BATCH];
+    int skipped[DIR_READ_BATCH];    // --no-dir-meta directories, never stat'ed
+#endif
+#ifdef _WIN32
+    HANDLE find;
+    WIN32_FIND_DATAW data;
+    int unread;             // data holds an entry _dir_next hasn't returned yet
+    char name[MAX_NAME];
+#endif
+} dir_reader;
+
+int _dir_open(dir_reader *dr, const char *path);
+const char *_dir_next(dir_reader *dr);
+int _dir_stat(dir_reader *dr, const char *path, struct stat *st);
+void _dir_close(dir_reader *dr);
+void _dir_reader_free(dir_reader *dr);
+
+// Buffered writes (--batch-size) and periodic commits (--commit-interval)
+#define DEFAULT_BATCH_SIZE 256
+#define MAX_BATCH_SIZE 4096         // 7 parameters per row stays under SQLite's 32766 variables
+#define DEFAULT_COMMIT_ROWS 50000
+
+static int batch_size = DEFAULT_BATCH_SIZE;
+static long commit_rows = DEFAULT_COMMIT_ROWS;  // 0 = commit only at the end of the run
+static long commit_ms = 0;                      // 0 = no time-based commits
+
+// Performance profiles (--profile), persisted in the meta table
+enum {
+    PROFILE_SAFE,   // rollback journal, synchronous=FULL, SQLite default caches
+    PROFILE_FAST    // WAL, synchronous=NORMAL, large cache, mmap, in-memory temp store
+};
+static const char *profile_names[] = { "safe", "fast", NULL };
+static int profile_override = -1;               // -1 = keep the profile stored in the database
+
+// Prepared statement cache (one per open connection, built by _init_db)
+#define MAX_DB_CONNS 64
+
+// Sharded index: a directory's entries live in <db>.<k>, k = hash(directory) % shards (shard 0 is <db>)
+#define MAX_SHARDS 16
+
+enum {
+    STMT_GET_MTIME,
+    STMT_PRUNE,
+    STMT_PRUNE_DIRS,
+    STMT_DIR_LOOKUP,
+    STMT_DIR_INSERT,
+    STMT_DELETE_ID,
+    STMT_DELETE_ENTRY,
+    STMT_DELETE_SUBTREE,
+    STMT_DELETE_SUBTREE_DIRS,
+    STMT_SEARCH_PREFIX,
+    STMT_SEARCH_PREFIX_OPEN,
+    STMT_SEARCH_FTS,
+    STMT_SEARCH_LIKE,
+    STMT_SEARCH_LIKE_MTIME,
+    STMT_DIR_CHILDREN,
+    STMT_TOUCH_SUBTREE,
+    STMT_BUMP_CHANGES,
+    STMT_SEARCH_ID,
+    STMT_RECORD_ROOT,
+    STMT_ROOT_SCANNED,
+    STMT_COUNT
+};
+
+typedef struct {
+    sqlite3_stmt *stmt;
+    long prepares;      // times the SQL was compiled
+    long executions;    // times the statement was handed out for reuse
+    long long one_off_steps;    // VM steps of finalized partial-batch variants, for --stats
+} cached_stmt;
+
+// In-memory (path hash -> row) map for --diff; stale rows are the unseen slots
+typedef struct {
+    uint64_t hash;          // FNV-1a of full_path, 0 marks an empty slot
+    sqlite3_int64 id;
+    sqlite3_int64 mtime;
+    sqlite3_int64 size;
+    size_t dir_off;         // directory and name in path_map.text, to confirm a hash match
+    size_t name_off;
+    int root;               // index into path_map.roots of the root it was loaded under
+} path_map_slot;
+
+typedef struct {
+    path_map_slot *slots;
+    uint8_t *seen;          // one bit per slot
+    size_t mask;            // capacity - 1, capacity is a power of two
+    size_t count;
+    char *text;             // NUL-terminated directories (each stored once per run of rows) and names
+    size_t text_len;
+    size_t text_cap;
+    const char *roots[MAX_ROOTS];   // the roots it was loaded for; only walked ones are pruned
+    int nroots;
+} path_map;
+
+// Direct-mapped directory path -> dirs.id cache; entries of one directory arrive together
+#define DIR_CACHE_SIZE 256
+
+typedef struct {
+    uint64_t hash;          // _path_hash of the directory path, 0 = empty
+    char *path;             // owned copy, compared on a hit so colliding paths miss
+    sqlite3_int64 id;
+} dir_cache_slot;
+
+// Rows waiting for the next multi-row upsert
+typedef struct {
+    sqlite3_int64 dir_id;
+    const char *type;
+    sqlite3_int64 size;
+    sqlite3_int64 mtime;
+    char name[MAX_NAME];
+    char name_lc[MAX_NAME];
+} pending_row;
+
+typedef struct {
+    pending_row *rows;
+    int nrows;
+    sqlite3_int64 *touch_ids;   // unchanged rows waiting for their generation stamp
+    int ntouch;
+    cached_stmt upsert;         // prepared for exactly batch_size rows
+    cached_stmt touch;
+    long since_commit;          // entries since the last COMMIT
+    long long commit_started;   // _now_ms() at the last BEGIN
+    long commits;
+    long long logged_at;        // _now_ms() of the last "Indexed entry" line
+    long unlogged;              // entries indexed since then
+} write_batch;
+
+// Suffix array over every lowercased name, mapped from <db>.names
+#define NAME_INDEX_MAGIC "WXNAMES1"
+
+typedef struct {
+    char magic[8];
+    uint64_t changes;       // meta "changes" when built; any other value means stale
+    uint64_t nrows;
+    uint64_t text_len;
+    uint64_t nsuffixes;
+} name_index_header;        // followed by ids, mtimes, starts, text, sa; each padded to 8 bytes
+
+typedef struct {
+    void *map;
+    size_t map_len;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+    const name_index_header *header;
+    const int64_t *ids;         // files.id per row
+    const int64_t *mtimes;      // files.mtime per row, for ranking without SQLite
+    const uint32_t *starts;     // offset of each row's name in text
+    const char *text;           // NUL-terminated names, in row order
+    const uint32_t *sa;         // every name byte's offset, sorted by the suffix starting there
+} name_index;
+
+typedef struct {
+    sqlite3 *db;
+    cached_stmt stmts[STMT_COUNT];
+    write_batch *writes;        // created on first _index_entry
+    dir_cache_slot dir_cache[DIR_CACHE_SIZE];
+    path_map *diff_map;     // set by _load_path_map, consulted by _get_db_mtime
+    sqlite3_int64 scan_gen; // generation stamped on rows visited by the current run
+    sqlite3_int64 dir_trust_before; // --dir-mtime only trusts directory mtimes older than this
+    sqlite3 *shards[MAX_SHARDS];    // primary connection of a sharded index: every shard, itself first
+    int nshards;
+    name_index *names;      // mapped on first --engine names search
+} stmt_cache;
+
+static stmt_cache stmt_caches[MAX_DB_CONNS];
+
+// --shards: created with the index, then read from its meta table
+static int shard_request = 0;
+
+// Parallel walker (--jobs N): workers stat, a single writer owns the DB
+#define MAX_JOBS 64
+#define WALK_BATCH_SIZE 256
+#define WALK_QUEUE_DEPTH 4   // batches in flight per worker
+
+typedef struct walk_batch {
+    int count;
+    char *paths[WALK_BATCH_SIZE];
+    struct stat sts[WALK_BATCH_SIZE];
+} walk_batch;
+
+// Per-worker deque: owner pushes/pops at the tail, thieves take from the head
+typedef struct {
+    pthread_mutex_t lock;
+    char **items;
+    int head;
+    int tail;
+    int capacity;
+} walk_deque;
+
+// Batches from every root's walkers, drained by the thread that owns the database
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    walk_batch **queue;
+    int cap;
+    int head;
+    int len;
+    int producers;      // workers still running, across all pools
+} walk_sink;
+
+// One pool per root, so a slow root's directories never tie up another root's walkers
+typedef struct {
+    walk_deque deques[MAX_JOBS];
+    int nworkers;
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    long pending;       // directories queued or being read
+    long pushes;        // bumped on every push so idle workers don't miss work
+
+    walk_sink *sink;
+    const char *root;
+    int running;        // this pool's workers still walking
+    long entries;       // entries stat'ed below root
+    time_t scanned_at;
+    long long started_ms;
+    long long finished_ms;
+} walk_pool;
+
+typedef struct {
+    walk_pool *pool;
+    int id;
+} walk_worker;
+
+// With --jobs on a sharded index, each shard has a writer thread on its own connection
+typedef struct {
+    sqlite3 *db;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    walk_batch *queue[WALK_QUEUE_DEPTH];
+    int head;
+    int len;
+    int closed;
+    walk_batch *filling;    // being filled by the routing thread
+    long count;
+} shard_writer;
+
+// Serial walk: directories are arena nodes naming their parent; a full path is
+// rebuilt into one reusable buffer only when the directory is opened
+#define WALK_ARENA_CHUNK (64 * 1024)
+
+typedef struct walk_node {
+    struct walk_node *parent;   // NULL for root, whose name is the whole root path
+    uint32_t name_len;
+    int cached;                 // list from the index instead of readdir() (--dir-mtime)
+    char name[];
+} walk_node;
+
+typedef struct walk_chunk {
+    struct walk_chunk *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} walk_chunk;
+
+typedef struct {
+    walk_node *node;
+    walk_chunk *chunk;  // arena position right after node, restored when it is popped
+    size_t mark;
+} walk_item;
+
+typedef struct {
+    walk_item *items;
+    int top;
+    int capacity;
+    walk_chunk *head;
+    walk_chunk *cur;
+    char *names;        // scratch lists for _replay_dir
+    size_t names_cap;
+    sqlite3_int64 *ids;
+    size_t ids_cap;
+} walk_stack;
+
+// Watch mode: changed paths are queued, deduplicated and applied once events settle
+#define WATCH_SETTLE_MS 200
+#define WATCH_MAX_PENDING 1024
+#define WATCH_SEEN_SLOTS (WATCH_MAX_PENDING * 4)
+
+typedef struct {
+    char *path;
+    int rescan;     // walk it if it turns out to be a directory (created or moved in)
+} watch_change;
+
+typedef struct {
+    uint64_t hash;
+    int item;
+} watch_seen_slot;
+
+typedef struct {
+    watch_change items[WATCH_MAX_PENDING];
+    int count;
+    watch_seen_slot seen[WATCH_SEEN_SLOTS];
+} watch_queue;
+
+// Called for every directory found while walking, e.g. to subscribe to it
+typedef void (*walk_dir_cb)(const char *path, void *ctx);
+
+#ifdef WINDEX_HAVE_INOTIFY
+typedef struct {
+    int fd;
+    char **paths;   // watch descriptor -> directory path
+    int capacity;
+    int full;       // hit fs.inotify.max_user_watches
+} inotify_set;
+#endif
+
 // int _dbp(const char *home_dir, char *db_path);
 int _dbp(const char *home_dir, const char *custom_db, char *db_path);
 int _init_db(const char *db_path, sqlite3 **db);
+int _migrate_db(sqlite3 *db);
+sqlite3_int64 _get_meta_int(sqlite3 *db, const char *key, sqlite3_int64 fallback);
+int _set_meta_int(sqlite3 *db, const char *key, sqlite3_int64 value);
+int _get_meta_text(sqlite3 *db, const char *key, char *buf, size_t size);
+int _set_meta_text(sqlite3 *db, const char *key, const char *value);
+int _apply_profile(sqlite3 *db);
+sqlite3_int64 _begin_scan(sqlite3 *db);
+void _close_db(sqlite3 *db);
+int _open_shards(sqlite3 *db, const char *db_path, int requested);
+int _shard_count(sqlite3 *db);
+sqlite3 *_shard_db(sqlite3 *db, int k);
+int _shard_index(sqlite3 *db, const char *dir_path);
+sqlite3 *_shard_for_dir(sqlite3 *db, const char *dir_path);
+int _exec_shards(sqlite3 *db, const char *sql);
+
+int _init_stmt_cache(sqlite3 *db);
+sqlite3_stmt *_get_stmt(sqlite3 *db, int id);
+void _log_stmt_stats(sqlite3 *db);
+void _free_stmt_cache(sqlite3 *db);
+void _clear_dir_cache(stmt_cache *cache);
 
 void _init_excluded_dirs(void);
 void _add_exclude_dir(const char *dir);
 void _free_excluded_dirs(void);
+int _compile_excluded_dirs(void);
 int _is_excluded(const char *path);
+int _is_excluded_entry(const char *path, const char *name);
 
 long _get_db_mtime(sqlite3 *db, const char *path);
+sqlite3_int64 _resolve_dir_id(sqlite3 *db, const char *dir_path, int create);
+
+int _load_path_map(sqlite3 *db, const char **roots, int nroots);
+void _free_path_map(sqlite3 *db);
 
-void _index_entry(sqlite3 *db, const char *path, struct stat *st);
-void _prune_stale_entries(sqlite3 *db, const char *root);
-void _index_files_dynamic(sqlite3 *db, const char *root);
+int _index_entry(sqlite3 *db, const char *path, struct stat *st);
+int _flush_writes(sqlite3 *db);
+void _maybe_commit(sqlite3 *db);
+long long _now_ms(void);
+long long _now_us(void);
+long long _now_ns(void);
+void _prune_stale_entries(sqlite3 *db, const char **roots, int nroots);
+int _walk_tree(sqlite3 *db, const char *root, walk_dir_cb on_dir, void *ctx);
+void _index_files_dynamic(sqlite3 *db, const char **roots, int nroots);
+void _index_files_parallel(sqlite3 *db, const char **roots, int nroots, int jobs);
+int _add_root(const char *root);
+void _record_root(sqlite3 *db, const char *root, time_t scanned_at, long long duration_ms, long entries);
+int _print_roots(sqlite3 *db);
 
+int _remove_entry(sqlite3 *db, const char *path);
+int _apply_change(sqlite3 *db, const char *path, int rescan, walk_dir_cb on_dir, void *ctx);
+int _watch_files(sqlite3 *db, const char *root);
+
+// Search results: each shard keeps its best rows in a bounded heap, then they are merged
+#define SEARCH_LIMIT 100            // default --limit
+#define MAX_SEARCH_LIMIT 100000
+
+// --sort: newest, largest, or by name (case-insensitive); ties go to the lower files.id
+enum {
+    SORT_MTIME,
+    SORT_SIZE,
+    SORT_NAME,
+    SORT_SCORE      // --fuzzy: best subsequence match first
+};
+static const char *sort_names[] = { "mtime", "size", "name", "score", NULL };
+static int search_limit = SEARCH_LIMIT;
+static int search_sort = SORT_MTIME;
+
+// --fuzzy: fzf-style subsequence scoring. Candidates sharing a trigram with the pattern
+// come first, then a subsequence scan of the rest, until the time budget runs out
+#define FUZZY_BUDGET_MS 30          // default --fuzzy-budget
+#define MAX_SEARCH_TASKS 64         // shards x --jobs slices of a fuzzy search
+#define FUZZY_MATCH 16              // per matched character
+#define FUZZY_GAP_START (-3)        // first skipped character inside the match
+#define FUZZY_GAP_EXTEND (-1)       // each further one
+#define FUZZY_BOUNDARY 8            // match right after / \ _ - . or space
+#define FUZZY_CAMEL 7               // match on a lower-to-upper case change
+#define FUZZY_CONSECUTIVE 4         // least bonus for extending a run
+#define FUZZY_FIRST_MULT 2          // the pattern's first character counts double
+#define FUZZY_BASENAME 2            // per pattern character, when the match fits in the name
+static int fuzzy_budget_ms = FUZZY_BUDGET_MS;
+static int search_jobs = 1;         // fuzzy scoring threads per shard (--jobs)
+
+typedef struct {
+    char *path;
+    char type[8];
+    sqlite3_int64 size;
+    sqlite3_int64 mtime;
+    sqlite3_int64 id;       // files.id, the final tie-break
+    int score;              // SORT_SCORE only
+} search_hit;
+
+// Structured filters in a search query (ext:dll size>10M mtime<7d type:file foo). A
+// filtered search is one statement per shard, driven from whichever index range is
+// narrowest; the other predicates, and the substring last, are checked on its rows
+#define QUERY_PROBE_ROWS 1000   // index entries counted per candidate range when planning
+
+enum {
+    FILTER_EXT = 1,
+    FILTER_TYPE = 2,
+    FILTER_SIZE = 4,
+    FILTER_MTIME = 8
+};
+
+// How the words left over after the filters are matched
+enum {
+    QUERY_TEXT_NONE,
+    QUERY_TEXT_PREFIX,      // "prefix*": name_lc range
+    QUERY_TEXT_FTS,         // 3+ characters: trigram phrase
+    QUERY_TEXT_LIKE         // shorter: only checked against rows found another way
+};
+
+// Access paths a filtered search can be driven from, in tie-break order
+enum {
+    DRIVE_TEXT,
+    DRIVE_EXT,
+    DRIVE_SIZE,
+    DRIVE_MTIME,
+    DRIVE_SCAN
+};
+
+// Fixed parameter numbers in filtered search and probe statements
+enum {
+    QP_MATCH = 1,
+    QP_LIKE,
+    QP_LOW,
+    QP_HIGH,
+    QP_EXT,
+    QP_TYPE,
+    QP_SIZE_MIN,
+    QP_SIZE_MAX,
+    QP_MTIME_MIN,
+    QP_MTIME_MAX,
+    QP_ID_MIN,      // a fuzzy search slice's rowid range
+    QP_ID_MAX
+};
+
+typedef struct {
+    int filters;                // FILTER_* present; 0 means a plain pattern
+    int text_mode;
+    char *text;                 // the leftover words, lowercased and joined by single spaces
+    char *match;                // FTS5 phrase for text; for --fuzzy, an OR of its trigrams
+    char *phrase;               // --fuzzy: text as one phrase, whose matches score best
+    char *like;                 // escaped LIKE pattern for text anywhere in the path; NULL for
+                                // non-ASCII trigram text, which LIKE would not fold
+    char *low;                  // name_lc range for a prefix; high is NULL when unbounded
+    char *high;
+    char ext[64];               // lowercased, without the dot
+    char type[8];
+    sqlite3_int64 size_min;     // inclusive bounds
+    sqlite3_int64 size_max;
+    sqlite3_int64 mtime_min;
+    sqlite3_int64 mtime_max;
+} search_query;
+
+typedef struct {
+    sqlite3 *db;
+    int stmt_id;
+    const search_query *filter; // set for a filtered search, which builds its own statement
+    const char *query;
+    const char *upper;
+    const char *names_pattern;  // set when the name index may answer instead
+    int names_prefix;           // names_pattern must match at the start of the name
+    int limit;
+    int sort;
+    search_hit *hits;           // limit slots: a heap while collecting, then sorted best first
+    int count;
+    int next;       // merge cursor
+    const char *slice_path;     // fuzzy slices past the first read through their own connection
+    sqlite3_int64 id_min;       // fuzzy: the slice of files.id this task scores
+    sqlite3_int64 id_max;
+    long long deadline;         // fuzzy: _now_ms() past which no more rows are scored
+    int truncated;              // fuzzy: stopped by the deadline
+} search_task;
+
+typedef int (*search_emit_cb)(const search_hit *hit, void *ctx);
+
+// Search engines (--engine)
+enum {
+    ENGINE_FTS,     // SQLite: trigram FTS over full paths, name_lc range scans
+    ENGINE_NAMES    // suffix array sidecar over names, SQLite only for the hits' metadata
+};
+static const char *engine_names[] = { "fts", "names", NULL };
+static int search_engine = ENGINE_FTS;
+
+// Suffix-array hits per byte of names above which a linear scan is cheaper
+#define NAME_SCAN_RATIO 64
+
+typedef const char *(*find_ci_fn)(const char *hay, size_t len, const char *needle, size_t nlen);
+const char *_find_ci(const char *hay, size_t len, const char *needle, size_t nlen);
+
+int _build_name_index(sqlite3 *db);
+int _build_name_indexes(sqlite3 *db);
+int _has_name_index(sqlite3 *db);
+void _unload_name_index(sqlite3 *db);
+
+int _parse_search_query(const char *input, search_query *q);
+void _free_search_query(search_query *q);
+int _search_run(sqlite3 *db, const char *pattern, int limit, int sort, search_emit_cb emit, void *ctx);
+// Search output (--format, --epoch), formatted into one large buffer
+#define PRINT_BUF_SIZE (1 << 16)
+
+enum {
+    FORMAT_PLAIN,   // Path:/Type:/Size:/Modified: blocks
+    FORMAT_NULL,    // paths only, each followed by NUL
+    FORMAT_JSON,    // one object per line
+    FORMAT_TSV      // path, type, size, modified
+};
+static const char *format_names[] = { "plain", "null", "json", "tsv", NULL };
+static int output_format = FORMAT_PLAIN;
+static int epoch_times = 0;     // print mtimes as Unix seconds
+
+typedef struct {
+    FILE *fp;
+    char buf[PRINT_BUF_SIZE];
+    size_t len;
+    int failed;
+} print_out;
+
+int _print_hit(const search_hit *hit, void *ctx);
 void _search_files(sqlite3 *db, const char *pattern);
 
+// --hash: content hashes for files whose size matches another file's, for `windex dupes`
+#define HASH_EDGE 4096                  // bytes from each end in the partial hash
+#define HASH_READ_SIZE (1 << 20)        // read size for full hashes
+static int hash_files = 0;
+static sqlite3_int64 hash_min_size = 1;
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t total_len;
+    unsigned char mem[32];
+    size_t memsize;
+} hash_state;
+
+// A file whose size collides with another's; head and full are valid when flagged
+typedef struct {
+    sqlite3 *shard;
+    sqlite3_int64 id;
+    sqlite3_int64 size;
+    sqlite3_int64 mtime;    // as indexed; the hash is only kept while size and mtime still match
+    uint64_t head;          // XXH64 of the first and last HASH_EDGE bytes, seeded with the size
+    uint64_t full;
+    int has_head;
+    int has_full;
+    int dirty;              // computed by this run, to be written back
+    char *path;
+} hash_job;
+
+typedef struct {
+    hash_job *jobs;
+    size_t *todo;           // indexes into jobs
+    size_t ntodo;
+    size_t next;            // next todo entry to claim, under lock
+    int full;               // computing full hashes rather than partial ones
+    pthread_mutex_t lock;
+} hash_pool;
+
+void _hash_init(hash_state *hs, uint64_t seed);
+void _hash_update(hash_state *hs, const void *data, size_t len);
+uint64_t _hash_digest(const hash_state *hs);
+int _hash_files(sqlite3 *db, int jobs);
+int _print_dupes(sqlite3 *db);
+
+// `windex export`/`import` snapshot: SNAPSHOT_MAGIC, a varint count of (key, zigzag varint)
+// metadata pairs, then entries sorted by directory and name:
+//   varint bytes shared with the previous path, varint suffix length, suffix,
+//   flags byte (SNAP_*), varint size, zigzag varint mtime, [u64 head_hash], [u64 hash]
+// and finally the XXH64 of everything before it. Integers are little-endian.
+#define SNAPSHOT_MAGIC "WXSNAP1"
+#define SNAPSHOT_MIN_SCHEMA 6   // the "schema" key of the oldest windex that exports; newer than ours is refused
+enum {
+    SNAP_DIR = 1,
+    SNAP_HEAD_HASH = 2,
+    SNAP_HASH = 4
+};
+
+typedef struct {
+    FILE *fp;
+    unsigned char buf[PRINT_BUF_SIZE];
+    size_t len;
+    hash_state hs;
+    int failed;
+} snapshot_writer;
+
+typedef struct {
+    FILE *fp;
+    unsigned char buf[PRINT_BUF_SIZE];
+    size_t pos;
+    size_t len;
+    size_t hashed;      // buf[0, hashed) is already in hs
+    hash_state hs;
+    int failed;
+} snapshot_reader;
+
+// One shard's part of _bulk_rebuild
+typedef struct {
+    sqlite3 *db;
+    int rc;
+} bulk_shard;
+
+int _bulk_rebuild(sqlite3 *db);
+int _bulk_interrupted(sqlite3 *db);
+int _repair_bulk_load(sqlite3 *db);
+int _begin_bulk_load(sqlite3 *db);
+void _end_bulk_load(sqlite3 *db);
+int _export_snapshot(sqlite3 *db, const char *path);
+int _import_snapshot(sqlite3 *db, const char *path);
+
+// Search server: one request line in, hit lines and an empty line out. Clients are
+// answered one at a time, so one that goes quiet is dropped after SERVE_IDLE_MS
+#define SERVE_BUF_SIZE 16384
+#define SERVE_IDLE_MS 2000
+
+#ifdef _WIN32
+typedef HANDLE serve_fd;
+#define SERVE_FD_INVALID INVALID_HANDLE_VALUE
+#else
+typedef int serve_fd;
+#define SERVE_FD_INVALID (-1)
+#endif
+
+typedef struct {
+    serve_fd fd;
+    char buf[SERVE_BUF_SIZE];
+    size_t len;
+    int failed;
+} serve_out;
+
+static int serve_warm = 0;      // --warm: preload the search indexes when serving
+
+// `serve --engine names` rebuilds stale name indexes on a background thread
+#define NAME_REBUILD_MS 5000    // minimum gap between rebuilds while the index keeps changing
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int running;
+    int done;       // set by the thread under lock
+    int rc;
+    int nshards;
+    char paths[MAX_SHARDS][MAX_PATH];   // shard database files
+    long long finished;             // _now_ms() when the last rebuild was swapped in
+} name_builder;
+
+int _serve(sqlite3 *db, const char *db_path, int warm);
+int _search_forward(const char *db_path, const char *pattern, int limit, int sort);
+
+// windex maintain, and automatically after index once a pass is due (--no-maintain skips it)
+#define MAINTAIN_INTERVAL (6 * 3600)    // seconds between automatic passes, at least
+#define MAINTAIN_CHANGES 64             // change batches since the last pass that make one due
+#define MAINTAIN_FREE_PERCENT 10        // free pages, in percent of the file, that make one due
+#define MAINTAIN_ANALYSIS_ROWS 1000     // PRAGMA analysis_limit for ANALYZE
+#define MAINTAIN_STEP_PAGES 256         // pages per FTS merge or incremental vacuum step
+#define MAINTAIN_PAUSE_MS 100           // between steps while a search server is running
+static int auto_maintain = 1;
+
+int _maintain_due(sqlite3 *db);
+int _maintain(sqlite3 *db, const char *db_path, int forced);
+
+// Per-phase timers for --stats; each walker thread accumulates into its own index_stats
+enum {
+    STAT_OPENDIR,
+    STAT_READDIR,
+    STAT_STAT,
+    STAT_EXCLUDE,
+    STAT_LOOKUP,        // stored mtime for the entry
+    STAT_UPSERT,        // multi-row insert/update batches
+    STAT_STAMP,         // generation stamps for unchanged rows
+    STAT_PRUNE,
+    STAT_COMMIT,
+    STAT_REBUILD,       // indexes deferred by a bulk load
+    STAT_HASH,          // --hash: files read by the hashing stage
+    STAT_COUNT
+};
+
+static const char *stat_names[] = { "opendir", "readdir", "stat", "exclude", "lookup", "upsert", "stamp", "prune", "commit", "rebuild", "hash", NULL };
+
+enum { STATS_OFF, STATS_TEXT, STATS_JSON };
+static const char *stats_modes[] = { "off", "text", "json", NULL };
+static int stats_mode = STATS_OFF;
+
+typedef struct index_stats {
+    long long ns[STAT_COUNT];
+    long long calls[STAT_COUNT];
+    struct index_stats *next;
+} index_stats;
+
+// Free when --stats is off: one branch, no clock read
+#define STATS_START(var) long long var = stats_mode ? _now_ns() : 0
+#define STATS_STOP(var, id) do { if (stats_mode) _stats_add((id), _now_ns() - (var)); } while (0)
+
+#define ENTRY_LOG_MS 1000       // "Indexed entry" lines at most this often per writer, unless WINDEX_LOG_ENTRIES
+#define ENTRY_LOG_CHECK 256     // written entries between clock reads for those lines
+
+void _stats_add(int id, long long ns);
+void _print_stats(sqlite3 *db, long long total_us);
+
+// `windex bench`: synthetic tree shape (--fanout, --depth, --files, --name-len, --seed)
+#define BENCH_DIR "windex-bench"
+#define BENCH_MARKER ".windex-bench"    // tree contents may be deleted only where this exists
+#define BENCH_FANOUT 6
+#define BENCH_DEPTH 4
+#define BENCH_FILES 30
+#define BENCH_NAME_MIN 4
+#define BENCH_NAME_MAX 20
+#define BENCH_ROUNDS 5
+#define BENCH_SAMPLES 8                 // names drawn from the tree for the query mix
+
+static int bench_fanout = BENCH_FANOUT;
+static int bench_depth = BENCH_DEPTH;
+static int bench_files = BENCH_FILES;
+static int bench_name_min = BENCH_NAME_MIN;
+static int bench_name_max = BENCH_NAME_MAX;
+static uint64_t bench_seed = 1;
+static int bench_rounds = BENCH_ROUNDS;
+
+typedef struct {
+    long long us;
+    long long entries;      // rows in the index after the run
+} bench_phase;
+
+typedef struct {
+    long dirs;
+    long files;
+    char samples[BENCH_SAMPLES][MAX_NAME];
+    bench_phase cold;       // empty database
+    bench_phase warm;       // nothing changed
+    bench_phase churn;      // after touching, deleting or adding next to ~1% of files
+} bench_run;
+
+int _bench(const char *dir, int jobs);
+
 // int init_db(const char *db_path, sqlite3 **db);
 // int is_excluded(const char *path);
 // long get_db_mtime(sqlite3 *db, const char *path);
@@ -74,4 +960,4 @@ void _search_files(sqlite3 *db, const char *pattern);
 /*
  frankly, I am not sure if this header file is necessary for such a small project.
     But I am keeping it for future expansion and it's 'good' practice.
-*/
\ No newline at end of file
+*/
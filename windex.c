@@ -15,7 +15,8 @@
  *   - Configurable root directory and excludes via command-line options.
  *   - Removes stale entries during indexing.
  *   
- * Usage: windex [--root <path>] [--exclude <dir>] [--db <path>] index | search <pattern> | --help
+ * Usage: windex [--root <path>] [--exclude <dir>] [--db <path>] [--jobs <n>] [--diff] [--fast-meta] index | watch | search <query> | serve | --help
+ *     watch keeps an existing index current from filesystem change notifications.
  *     The database is stored in the user's home directory under .windex/.winindex.db by default
  *     with appropriate indexes for fast searching.
  *     
@@ -24,6 +25,8 @@
 
 #include "3rds/includes/windex.h"
 
+static stmt_cache *_find_stmt_cache(sqlite3 *db);
+
 // Initialize excluded dirs
 void _init_excluded_dirs(void) {
     int i;
@@ -66,16 +69,114 @@ void _free_excluded_dirs(void) {
         free(excluded_dirs[i]);
     }
     free(excluded_dirs);
+    free(exclude_set);
+    free(exclude_prefixes);
+    exclude_set = NULL;
+    exclude_prefixes = NULL;
+}
+
+// Hash a path component, folding ASCII case (Windows names are case-insensitive)
+static uint64_t _exclude_hash(const char *name, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static int _exclude_name_eq(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return 0;
+    }
+    return 1;
+}
+
+// Compile the exclude list: bare names go into a component hash set, anything with a separator is a path prefix
+int _compile_excluded_dirs(void) {
+    size_t slots = 16;
+    while (slots < (size_t)num_excluded_dirs * 2) slots *= 2;
+    free(exclude_set);
+    free(exclude_prefixes);
+    exclude_set = calloc(slots, sizeof(exclude_slot));
+    exclude_prefixes = calloc(num_excluded_dirs + 1, sizeof(char *));
+    if (!exclude_set || !exclude_prefixes) {
+        LOG_ERROR("Failed to allocate exclusion matcher");
+        return 1;
+    }
+    exclude_mask = slots - 1;
+    num_exclude_prefixes = 0;
+
+    for (int i = 0; i < num_excluded_dirs; i++) {
+        char *pattern = excluded_dirs[i];
+        size_t len = strlen(pattern);
+        while (len > 1 && (pattern[len - 1] == '/' || pattern[len - 1] == '\\')) pattern[--len] = '\0';
+        if (len == 0) continue;
+        if (strpbrk(pattern, "/\\")) {
+            exclude_prefixes[num_exclude_prefixes++] = pattern;
+            continue;
+        }
+        uint64_t hash = _exclude_hash(pattern, len);
+        size_t j = hash & exclude_mask;
+        while (exclude_set[j].hash &&
+               !(exclude_set[j].hash == hash && exclude_set[j].len == len &&
+                 _exclude_name_eq(exclude_set[j].name, pattern, len))) {
+            j = (j + 1) & exclude_mask;
+        }
+        exclude_set[j].hash = hash;
+        exclude_set[j].name = pattern;
+        exclude_set[j].len = len;
+    }
+    return 0;
+}
+
+// Is this single path component on the exclude list?
+static int _is_excluded_component(const char *name, size_t len) {
+    if (!exclude_set || len == 0) return 0;
+    uint64_t hash = _exclude_hash(name, len);
+    for (size_t j = hash & exclude_mask; exclude_set[j].hash; j = (j + 1) & exclude_mask) {
+        if (exclude_set[j].hash == hash && exclude_set[j].len == len &&
+            _exclude_name_eq(exclude_set[j].name, name, len)) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-// Check if path contains an excluded directory
+// Is path at or below one of the excluded path prefixes?
+static int _is_excluded_prefix(const char *path) {
+    for (int i = 0; i < num_exclude_prefixes; i++) {
+        size_t len = strlen(exclude_prefixes[i]);
+        if (strncmp(path, exclude_prefixes[i], len) == 0 &&
+            (path[len] == '\0' || path[len] == '/' || path[len] == '\\')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Check whether any component of path is excluded
 int _is_excluded(const char *path) {
-    for (int i = 0; excluded_dirs[i]; i++) {
-        if (strstr(path, excluded_dirs[i])) return 1;
+    if (_is_excluded_prefix(path)) return 1;
+    const char *start = path;
+    for (const char *p = path;; p++) {
+        if (*p == '/' || *p == '\\' || *p == '\0') {
+            if (_is_excluded_component(start, p - start)) return 1;
+            if (*p == '\0') break;
+            start = p + 1;
+        }
     }
     return 0;
 }
 
+// Check a new entry whose parent directory already passed: only its own name is looked up
+int _is_excluded_entry(const char *path, const char *name) {
+    STATS_START(started);
+    int excluded = _is_excluded_component(name, strlen(name)) || (num_exclude_prefixes > 0 && _is_excluded_prefix(path));
+    STATS_STOP(started, STAT_EXCLUDE);
+    return excluded;
+}
+
 // Construct database path
 int _dbp(const char *home_dir, const char *custom_db, char *db_path) {
     char db_dir_path[MAX_PATH];
@@ -116,12 +217,36 @@ int _dbp(const char *home_dir, const char *custom_db, char *db_path) {
     return 0;
 }
 
+// Run a single-value pragma (or query) and return the integer result
+static sqlite3_int64 _pragma_int(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 value = 0;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return value;
+}
+
+// Read PRAGMA user_version
+static int _schema_version(sqlite3 *db) {
+    return (int)_pragma_int(db, "PRAGMA user_version;");
+}
+
 // Initialize SQLite database
 int _init_db(const char *db_path, sqlite3 **db) {
     if (sqlite3_open(db_path, db) != SQLITE_OK) {
         LOG_ERROR("Cannot open database %s: %s", db_path, sqlite3_errmsg(*db));
         return 1;
     }
+    // page_size and auto_vacuum only take effect before the first table is created;
+    // incremental auto-vacuum lets maintain hand free pages back in steps
+    if (_schema_version(*db) == 0) {
+        if (profile_override == PROFILE_FAST) sqlite3_exec(*db, "PRAGMA page_size = 8192;", NULL, NULL, NULL);
+        sqlite3_exec(*db, "PRAGMA auto_vacuum = INCREMENTAL;", NULL, NULL, NULL);
+    }
+
+    // Version 0 schema; everything newer is built by _migrate_db
     char *err_msg = NULL;
     const char *sql = 
         "CREATE TABLE IF NOT EXISTS files ("
@@ -133,318 +258,7005 @@ int _init_db(const char *db_path, sqlite3 **db) {
         "mtime INTEGER);"
         "CREATE INDEX IF NOT EXISTS idx_name ON files(name);"
         "CREATE INDEX IF NOT EXISTS idx_path ON files(full_path);";
-    if (sqlite3_exec(*db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+    if (_schema_version(*db) == 0 && sqlite3_exec(*db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
         LOG_ERROR("SQL error: %s", err_msg);
         sqlite3_free(err_msg);
         sqlite3_close(*db);
         return 1;
     }
+    if (_migrate_db(*db) != 0 || _apply_profile(*db) != 0) {
+        sqlite3_close(*db);
+        return 1;
+    }
+    if (_init_stmt_cache(*db) != 0) {
+        sqlite3_close(*db);
+        return 1;
+    }
     LOG_INFO("Database initialized successfully");
     return 0;
 }
 
-// Get existing mtime from database
-long _get_db_mtime(sqlite3 *db, const char *path) {
-    sqlite3_stmt *stmt;
-    long mtime = 0;
-    const char *sql = "SELECT mtime FROM files WHERE full_path = ?;";
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            mtime = sqlite3_column_int64(stmt, 0);
+// Schema migrations, applied in order from PRAGMA user_version
+static const char *schema_migrations[] = {
+    // 1: key/value metadata and per-run generation stamps for pruning
+    "CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value);"
+    "ALTER TABLE files ADD COLUMN scan_gen INTEGER NOT NULL DEFAULT 0;",
+    // 2: trigram full-text index over full_path, kept in sync by triggers
+    "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("
+    "full_path, content='files', content_rowid='id', tokenize='trigram');"
+    "CREATE TRIGGER IF NOT EXISTS files_fts_ai AFTER INSERT ON files BEGIN "
+    "INSERT INTO files_fts(rowid, full_path) VALUES (new.id, new.full_path); END;"
+    "CREATE TRIGGER IF NOT EXISTS files_fts_ad AFTER DELETE ON files BEGIN "
+    "INSERT INTO files_fts(files_fts, rowid, full_path) VALUES ('delete', old.id, old.full_path); END;"
+    "CREATE TRIGGER IF NOT EXISTS files_fts_au AFTER UPDATE OF full_path ON files BEGIN "
+    "INSERT INTO files_fts(files_fts, rowid, full_path) VALUES ('delete', old.id, old.full_path);"
+    "INSERT INTO files_fts(rowid, full_path) VALUES (new.id, new.full_path); END;"
+    "INSERT INTO files_fts(files_fts) VALUES ('rebuild');",
+    // 3: pre-folded name, indexed with the sort keys for prefix searches (the rows and
+    //    their dirs are still read for each hit's path)
+    "ALTER TABLE files ADD COLUMN name_lc TEXT;"
+    "UPDATE files SET name_lc = lower(name);"
+    "CREATE INDEX IF NOT EXISTS idx_name_lc ON files(name_lc, mtime, size, type);",
+    // 4: normalize paths: files keep (dir_id, name), each directory path is stored once.
+    //    Drops the full_path column with its UNIQUE and idx_path copies, and idx_name
+    //    (superseded by idx_name_lc). The FTS index reads paths through a view.
+    "DROP TRIGGER IF EXISTS files_fts_ai;"
+    "DROP TRIGGER IF EXISTS files_fts_ad;"
+    "DROP TRIGGER IF EXISTS files_fts_au;"
+    "DROP TABLE IF EXISTS files_fts;"
+    "CREATE TABLE dirs ("
+    "id INTEGER PRIMARY KEY,"
+    "parent_id INTEGER NOT NULL,"
+    "name TEXT NOT NULL,"
+    "path TEXT NOT NULL UNIQUE);"
+    // rtrim(p, replace(p, '/', '')) strips the last component, leaving "dir/"
+    "INSERT OR IGNORE INTO dirs (parent_id, name, path) "
+    "SELECT 0, '', substr(full_path, 1, length(rtrim(full_path, replace(full_path, '/', ''))) - 1) "
+    "FROM files WHERE instr(full_path, '/') > 0;"
+    "UPDATE dirs SET name = substr(path, length(rtrim(path, replace(path, '/', ''))) + 1),"
+    "parent_id = coalesce((SELECT p.id FROM dirs p WHERE p.path = "
+    "substr(dirs.path, 1, length(rtrim(dirs.path, replace(dirs.path, '/', ''))) - 1)), 0);"
+    "CREATE TABLE files_v4 ("
+    "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "dir_id INTEGER NOT NULL,"
+    "name TEXT NOT NULL,"
+    "type TEXT NOT NULL,"
+    "size INTEGER,"
+    "mtime INTEGER,"
+    "scan_gen INTEGER NOT NULL DEFAULT 0,"
+    "name_lc TEXT,"
+    "UNIQUE(dir_id, name));"
+    "INSERT OR IGNORE INTO files_v4 (id, dir_id, name, type, size, mtime, scan_gen, name_lc) "
+    "SELECT f.id, d.id, substr(f.full_path, length(d.path) + 2), f.type, f.size, f.mtime, f.scan_gen, f.name_lc "
+    "FROM files f JOIN dirs d ON d.path = "
+    "substr(f.full_path, 1, length(rtrim(f.full_path, replace(f.full_path, '/', ''))) - 1);"
+    "DROP TABLE files;"
+    "ALTER TABLE files_v4 RENAME TO files;"
+    "CREATE INDEX IF NOT EXISTS idx_name_lc ON files(name_lc, mtime, size, type);"
+    "CREATE VIEW files_paths AS "
+    "SELECT f.id AS id, d.path || '/' || f.name AS full_path FROM files f JOIN dirs d ON d.id = f.dir_id;"
+    "CREATE VIRTUAL TABLE files_fts USING fts5("
+    "full_path, content='files_paths', content_rowid='id', tokenize='trigram');"
+    "CREATE TRIGGER files_fts_ai AFTER INSERT ON files BEGIN "
+    "INSERT INTO files_fts(rowid, full_path) VALUES "
+    "(new.id, (SELECT path FROM dirs WHERE id = new.dir_id) || '/' || new.name); END;"
+    "CREATE TRIGGER files_fts_ad AFTER DELETE ON files BEGIN "
+    "INSERT INTO files_fts(files_fts, rowid, full_path) VALUES "
+    "('delete', old.id, (SELECT path FROM dirs WHERE id = old.dir_id) || '/' || old.name); END;"
+    "INSERT INTO files_fts(files_fts) VALUES ('rebuild');",
+    // 5: newest-first scans for short patterns, which can stop after --limit rows
+    "CREATE INDEX IF NOT EXISTS idx_files_mtime ON files(mtime);",
+    // 6: --hash content hashes, cleared whenever an upsert records a change
+    "ALTER TABLE files ADD COLUMN head_hash INTEGER;"
+    "ALTER TABLE files ADD COLUMN hash INTEGER;"
+    "CREATE INDEX IF NOT EXISTS idx_files_hash ON files(size, hash) WHERE hash IS NOT NULL;",
+    // 7: per-root scan state for repeated --root; only the main database's copy is used
+    "CREATE TABLE IF NOT EXISTS roots ("
+    "path TEXT PRIMARY KEY,"
+    "scan_gen INTEGER NOT NULL DEFAULT 0,"
+    "scanned_at INTEGER,"       // Unix time the root's last walk started
+    "duration_ms INTEGER,"
+    "entries INTEGER);",
+    // 8: ext: and size filters. ext is the name after its last dot (a leading dot alone
+    //    doesn't count), generated from name_lc so upserts and imports never supply it;
+    //    (ext, mtime) serves ext: with an mtime range, or newest first
+    "ALTER TABLE files ADD COLUMN ext TEXT GENERATED ALWAYS AS ("
+    "CASE WHEN length(rtrim(name_lc, replace(name_lc, '.', ''))) > 1 "
+    "THEN nullif(substr(name_lc, length(rtrim(name_lc, replace(name_lc, '.', ''))) + 1), '') END) VIRTUAL;"
+    "CREATE INDEX IF NOT EXISTS idx_files_ext ON files(ext, mtime);"
+    "CREATE INDEX IF NOT EXISTS idx_files_size ON files(size);",
+};
+#define SCHEMA_VERSION ((int)(sizeof(schema_migrations) / sizeof(schema_migrations[0])))
+
+// Secondary indexes and FTS triggers as the migrations leave them; bulk loads drop them,
+// fill files, then build everything once instead of maintaining it row by row. FTS is
+// refilled in rowid order, which appends to its segments where 'rebuild' would not
+static const char *bulk_drop_sql =
+    "DROP TRIGGER IF EXISTS files_fts_ai;"
+    "DROP TRIGGER IF EXISTS files_fts_ad;"
+    "DROP INDEX IF EXISTS idx_name_lc;"
+    "DROP INDEX IF EXISTS idx_files_mtime;"
+    "DROP INDEX IF EXISTS idx_files_hash;"
+    "DROP INDEX IF EXISTS idx_files_ext;"
+    "DROP INDEX IF EXISTS idx_files_size;";
+
+static const char *bulk_create_sql =
+    "CREATE INDEX IF NOT EXISTS idx_name_lc ON files(name_lc, mtime, size, type);"
+    "CREATE INDEX IF NOT EXISTS idx_files_mtime ON files(mtime);"
+    "CREATE INDEX IF NOT EXISTS idx_files_hash ON files(size, hash) WHERE hash IS NOT NULL;"
+    "CREATE INDEX IF NOT EXISTS idx_files_ext ON files(ext, mtime);"
+    "CREATE INDEX IF NOT EXISTS idx_files_size ON files(size);";
+
+// Only run while files_fts_ai is missing, i.e. FTS holds nothing the triggers didn't see
+static const char *bulk_fts_sql =
+    "INSERT INTO files_fts(files_fts) VALUES ('delete-all');"
+    "INSERT INTO files_fts(files_fts, rank) VALUES ('hashsize', 67108864);"  // fewer, larger segments
+    "INSERT INTO files_fts(rowid, full_path) "
+    "SELECT f.id, d.path || '/' || f.name FROM files f JOIN dirs d ON d.id = f.dir_id ORDER BY f.id;"
+    "INSERT INTO files_fts(files_fts, rank) VALUES ('hashsize', 1048576);"   // the FTS5 default
+    "CREATE TRIGGER IF NOT EXISTS files_fts_ai AFTER INSERT ON files BEGIN "
+    "INSERT INTO files_fts(rowid, full_path) VALUES "
+    "(new.id, (SELECT path FROM dirs WHERE id = new.dir_id) || '/' || new.name); END;"
+    "CREATE TRIGGER IF NOT EXISTS files_fts_ad AFTER DELETE ON files BEGIN "
+    "INSERT INTO files_fts(files_fts, rowid, full_path) VALUES "
+    "('delete', old.id, (SELECT path FROM dirs WHERE id = old.dir_id) || '/' || old.name); END;";
+
+// Bring an existing (or freshly created) database up to SCHEMA_VERSION
+int _migrate_db(sqlite3 *db) {
+    int version = _schema_version(db);
+    if (version > SCHEMA_VERSION) {
+        LOG_ERROR("Database schema version %d is newer than supported version %d", version, SCHEMA_VERSION);
+        return 1;
+    }
+
+    for (; version < SCHEMA_VERSION; version++) {
+        char *err_msg = NULL;
+        char pragma[64];
+        snprintf(pragma, sizeof(pragma), "PRAGMA user_version = %d;", version + 1);
+        if (sqlite3_exec(db, "BEGIN;", NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, schema_migrations[version], NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, pragma, NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, "COMMIT;", NULL, NULL, &err_msg) != SQLITE_OK) {
+            LOG_ERROR("Schema migration to version %d failed: %s", version + 1, err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            return 1;
         }
-        sqlite3_finalize(stmt);
-    } else {
-        LOG_ERROR("Failed to prepare mtime query: %s", sqlite3_errmsg(db));
+        LOG_INFO("Migrated database schema to version %d", version + 1);
     }
-    return mtime;
+    return 0;
 }
 
-// Index a single file or directory
-void _index_entry(sqlite3 *db, const char *path, struct stat *st) {
-    char name[MAX_NAME];
-    snprintf(name, MAX_NAME, "%s", strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
-    const char *type = S_ISDIR(st->st_mode) ? "dir" : "file";
-    long mtime = (long)st->st_mtime;
-    long db_mtime = _get_db_mtime(db, path);
+// Was a bulk load into this shard cut short, leaving rows without their secondary indexes
+// or FTS entries?
+int _bulk_interrupted(sqlite3 *db) {
+    return _pragma_int(db, "SELECT count(*) FROM sqlite_master WHERE name IN ('idx_name_lc', 'idx_files_mtime', "
+                           "'idx_files_hash', 'idx_files_ext', 'idx_files_size', 'files_fts_ai');") < 6;
+}
 
-    if (db_mtime == mtime) return; // Skip unchanged entries
+// Build what an interrupted bulk load left out. Only commands that write run this; the
+// rest warn, since the FTS refill costs as much as the load itself
+int _repair_bulk_load(sqlite3 *db) {
+    LOG_INFO("%s: finishing an interrupted bulk load", sqlite3_db_filename(db, "main"));
+    char *err_msg = NULL;
+    if (sqlite3_exec(db, bulk_create_sql, NULL, NULL, &err_msg) != SQLITE_OK ||
+        (!_pragma_int(db, "SELECT count(*) FROM sqlite_master WHERE type = 'trigger' AND name = 'files_fts_ai';") &&
+         sqlite3_exec(db, bulk_fts_sql, NULL, NULL, &err_msg) != SQLITE_OK)) {
+        LOG_ERROR("Failed to restore secondary indexes: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    return 0;
+}
 
+// Read an integer from the meta table
+sqlite3_int64 _get_meta_int(sqlite3 *db, const char *key, sqlite3_int64 fallback) {
     sqlite3_stmt *stmt;
-    const char *sql = db_mtime == 0
-        ? "INSERT OR IGNORE INTO files (full_path, name, type, size, mtime) VALUES (?, ?, ?, ?, ?);"
-        : "UPDATE files SET name = ?, type = ?, size = ?, mtime = ? WHERE full_path = ?;";
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        if (db_mtime == 0) {
-            sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 3, type, -1, SQLITE_STATIC);
-            sqlite3_bind_int64(stmt, 4, (sqlite3_int64)st->st_size);
-            sqlite3_bind_int64(stmt, 5, (sqlite3_int64)mtime);
-        } else {
-            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, type, -1, SQLITE_STATIC);
-            sqlite3_bind_int64(stmt, 3, (sqlite3_int64)st->st_size);
-            sqlite3_bind_int64(stmt, 4, (sqlite3_int64)mtime);
-            sqlite3_bind_text(stmt, 5, path, -1, SQLITE_STATIC);
-        }
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            LOG_ERROR("Failed to execute index statement for %s: %s", path, sqlite3_errmsg(db));
-        }
+    sqlite3_int64 value = fallback;
+    if (sqlite3_prepare_v2(db, "SELECT value FROM meta WHERE key = ?;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
         sqlite3_finalize(stmt);
-        LOG_INFO("Indexed entry: %s", path);
-    } else {
-        LOG_ERROR("Failed to prepare index statement: %s", sqlite3_errmsg(db));
     }
+    return value;
 }
 
-// Prune stale entries
-void _prune_stale_entries(sqlite3 *db, const char *root) {
+// Write an integer to the meta table
+int _set_meta_int(sqlite3 *db, const char *key, sqlite3_int64 value) {
     sqlite3_stmt *stmt;
-    const char *sql = "SELECT full_path FROM files WHERE full_path LIKE ?;";
-    char pattern[MAX_PATH];
-    snprintf(pattern, MAX_PATH, "%s%%", root);
-    int deleted = 0;
+    int rc = 1;
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO meta (key, value) VALUES (?, ?);", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, value);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? 0 : 1;
+        sqlite3_finalize(stmt);
+    }
+    if (rc) LOG_ERROR("Failed to store meta %s: %s", key, sqlite3_errmsg(db));
+    return rc;
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_STATIC);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *path = (const char *)sqlite3_column_text(stmt, 0);
-            struct stat st;
-            if (stat(path, &st) != 0) {
-                sqlite3_stmt *del_stmt;
-                const char *del_sql = "DELETE FROM files WHERE full_path = ?;";
-                if (sqlite3_prepare_v2(db, del_sql, -1, &del_stmt, NULL) == SQLITE_OK) {
-                    sqlite3_bind_text(del_stmt, 1, path, -1, SQLITE_STATIC);
-                    if (sqlite3_step(del_stmt) == SQLITE_DONE) {
-                        deleted++;
-                        LOG_INFO("Deleted stale entry: %s", path);
-                    }
-                    sqlite3_finalize(del_stmt);
-                }
-            }
+// Read a text value from the meta table; returns 0 if the key exists
+int _get_meta_text(sqlite3 *db, const char *key, char *buf, size_t size) {
+    sqlite3_stmt *stmt;
+    int rc = 1;
+    if (sqlite3_prepare_v2(db, "SELECT value FROM meta WHERE key = ?;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+            snprintf(buf, size, "%s", (const char *)sqlite3_column_text(stmt, 0));
+            rc = 0;
         }
         sqlite3_finalize(stmt);
     }
-    LOG_INFO("Pruned %d stale entries", deleted);
+    return rc;
 }
 
-// Iterative indexing with transactions
-void _index_files_dynamic(sqlite3 *db, const char *root) {
-    char **stack = malloc(1000 * sizeof(char *));
-    if (!stack) {
-        LOG_ERROR("Failed to allocate stack for indexing");
-        return;
+// Write a text value to the meta table
+int _set_meta_text(sqlite3 *db, const char *key, const char *value) {
+    sqlite3_stmt *stmt;
+    int rc = 1;
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO meta (key, value) VALUES (?, ?);", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? 0 : 1;
+        sqlite3_finalize(stmt);
     }
-    int top = 0;
-    int capacity = 1000;
-    int total_count = 0;
-    
-    stack[top++] = strdup(root);
-    if (!stack[0]) {
-        LOG_ERROR("Failed to allocate memory for root path");
-        free(stack);
-        return;
+    if (rc) LOG_ERROR("Failed to store meta %s: %s", key, sqlite3_errmsg(db));
+    return rc;
+}
+
+// Apply the --profile pragmas (or the one stored in the database) and persist the choice
+int _apply_profile(sqlite3 *db) {
+    int profile = PROFILE_SAFE;
+    char stored[16];
+    int have_stored = _get_meta_text(db, "profile", stored, sizeof(stored)) == 0;
+    if (profile_override >= 0) {
+        profile = profile_override;
+        // Only a change is written, so a read-only command naming the current profile stays one
+        if ((!have_stored || strcmp(stored, profile_names[profile]) != 0) &&
+            _set_meta_text(db, "profile", profile_names[profile]) != 0) return 1;
+    } else if (have_stored && strcmp(stored, "fast") == 0) {
+        profile = PROFILE_FAST;
     }
 
-    sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-    
-    while (top > 0) {
-        char *current = stack[--top];
-        DIR *dir = opendir(current);
-        
-        if (!dir) {
-            LOG_ERROR("Failed to open directory %s: %s", current, strerror(errno));
-            free(current);
-            continue;
-        }
-        
-        struct dirent *entry;
-        char path[MAX_PATH];
-        struct stat st;
-        
-        while ((entry = readdir(dir))) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) 
-                continue;
-            
-            snprintf(path, MAX_PATH, "%s/%s", current, entry->d_name);
-            if (_is_excluded(path)) continue;
-            
-            if (stat(path, &st) == 0) {
-                _index_entry(db, path, &st);
-                total_count++;
-                
-                if (S_ISDIR(st.st_mode)) {
-                    if (top >= capacity) {
-                        capacity *= 2;
-                        char **new_stack = realloc(stack, capacity * sizeof(char *));
-                        if (!new_stack) {
-                            LOG_ERROR("Failed to reallocate stack");
-                            closedir(dir);
-                            free(current);
-                            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-                            for (int i = 0; i < top; i++) free(stack[i]);
-                            free(stack);
-                            return;
-                        }
-                        stack = new_stack;
-                    }
-                    stack[top] = strdup(path);
-                    if (!stack[top]) {
-                        LOG_ERROR("Failed to allocate memory for path %s", path);
-                        continue;
-                    }
-                    top++;
-                }
-            } else {
-                LOG_ERROR("Failed to stat %s: %s", path, strerror(errno));
-            }
+    // The journal mode is persistent and switching it takes an exclusive lock: ask first
+    const char *journal = profile == PROFILE_FAST ? "wal" : "delete";
+    int journal_ok = 0;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+            journal_ok = strcmp((const char *)sqlite3_column_text(stmt, 0), journal) == 0;
         }
-        
-        closedir(dir);
-        free(current);
+        sqlite3_finalize(stmt);
     }
-    
-    _prune_stale_entries(db, root);
-    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
-    free(stack);
-    LOG_INFO("Indexed %d new or modified entries", total_count);
-    // printf("Indexed %d new or modified entries.\n", total_count);
+
+    char *err_msg = NULL;
+    char sql[256];
+    if (profile == PROFILE_FAST) {
+        // Map the whole file plus room to grow; SQLite clamps this to its compile-time maximum
+        sqlite3_int64 db_size = _pragma_int(db, "PRAGMA page_count;") * _pragma_int(db, "PRAGMA page_size;");
+        sqlite3_int64 mmap_size = db_size * 2 > 256LL << 20 ? db_size * 2 : 256LL << 20;
+        snprintf(sql, sizeof(sql),
+                 "%s"
+                 "PRAGMA synchronous = NORMAL;"
+                 "PRAGMA cache_size = -65536;"
+                 "PRAGMA temp_store = MEMORY;"
+                 "PRAGMA mmap_size = %lld;", journal_ok ? "" : "PRAGMA journal_mode = WAL;", (long long)mmap_size);
+    } else {
+        snprintf(sql, sizeof(sql),
+                 "%s"
+                 "PRAGMA synchronous = FULL;", journal_ok ? "" : "PRAGMA journal_mode = DELETE;");
+    }
+    if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("Failed to apply %s profile: %s", profile_names[profile], err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    LOG_INFO("Using %s performance profile (page size %lld)", profile_names[profile],
+             (long long)_pragma_int(db, "PRAGMA page_size;"));
+    return 0;
 }
 
-// Convert string to lowercase
-char *_to_lower(const char *str) {
-    char *lower = strdup(str);
-    if (!lower) {
-        LOG_ERROR("Failed to allocate memory for lowercase pattern");
-        return NULL;
+// Start a new scan generation; rows not stamped with it by the end of the run are stale
+sqlite3_int64 _begin_scan(sqlite3 *db) {
+    // One generation across shards, above anything a shard has seen before
+    sqlite3_int64 gen = 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3_int64 shard_gen = _get_meta_int(_shard_db(db, k), "scan_gen", 0);
+        if (shard_gen > gen) gen = shard_gen;
     }
-    for (char *p = lower; *p; p++) *p = tolower(*p);
-    return lower;
+    gen++;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        stmt_cache *cache = _find_stmt_cache(shard);
+        _set_meta_int(shard, "scan_gen", gen);
+        if (cache) {
+            cache->scan_gen = gen;
+            // A directory changed in the same second the last scan read it may look unchanged
+            cache->dir_trust_before = _get_meta_int(shard, "scan_started", 0);
+        }
+        _set_meta_int(shard, "scan_started", (sqlite3_int64)time(NULL));
+    }
+    return gen;
 }
 
-// Search the index
-void _search_files(sqlite3 *db, const char *pattern) {
-    char *lower_pattern = _to_lower(pattern);
-    if (!lower_pattern) return;
+// Release cached statements and close the database
+void _close_db(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (cache && cache->nshards > 1) {
+        for (int k = 1; k < cache->nshards; k++) _close_db(cache->shards[k]);
+    }
+    _free_path_map(db);
+    _free_stmt_cache(db);
+    sqlite3_close(db);
+}
 
-    sqlite3_stmt *stmt;
-    char sql[512];
-    snprintf(sql, sizeof(sql),
-        "SELECT full_path, type, size, mtime FROM files "
-        "WHERE lower(name) LIKE '%%%s%%' OR lower(full_path) LIKE '%%%s%%' "
-        "ORDER BY mtime DESC LIMIT 100;", lower_pattern, lower_pattern);
+// Open the shard files next to the primary database; the count is fixed when the index is created
+int _open_shards(sqlite3 *db, const char *db_path, int requested) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache) return 1;
+    int stored = (int)_get_meta_int(db, "shards", 0);
+    int count = stored ? stored : 1;
+    if (requested > 0 && requested != count) {
+        // Re-sharding would strand rows in the wrong file; only a new index may pick a count
+        if (stored || _pragma_int(db, "SELECT EXISTS (SELECT 1 FROM files);")) {
+            LOG_ERROR("Index %s has %d shard(s); delete it and its shard files to use %d", db_path, count, requested);
+            return 1;
+        }
+        count = requested;
+    }
+    if (requested > 0 && !stored && _set_meta_int(db, "shards", count) != 0) return 1;
+    if (count < 1 || count > MAX_SHARDS) {
+        LOG_ERROR("Index %s records %d shards (max %d)", db_path, count, MAX_SHARDS);
+        return 1;
+    }
+    if (count == 1) return 0;
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *path = (const char *)sqlite3_column_text(stmt, 0);
-            const char *type = (const char *)sqlite3_column_text(stmt, 1);
-            sqlite3_int64 size = sqlite3_column_int64(stmt, 2);
-            sqlite3_int64 mtime = sqlite3_column_int64(stmt, 3);
-            char mtime_str[32];
-            time_t t = (time_t)mtime;
-            strftime(mtime_str, sizeof(mtime_str), "%Y-%m-%d %H:%M:%S", localtime(&t));
-            printf("Path: %s\nType: %s\nSize: %lld bytes\nModified: %s\n\n", path, type, size, mtime_str);
+    cache->shards[0] = db;
+    for (int k = 1; k < count; k++) {
+        char shard_path[MAX_PATH];
+        if (snprintf(shard_path, MAX_PATH, "%s.%d", db_path, k) >= MAX_PATH ||
+            _init_db(shard_path, &cache->shards[k]) != 0) {
+            LOG_ERROR("Failed to open shard %d of %s", k, db_path);
+            for (int j = 1; j < k; j++) _close_db(cache->shards[j]);
+            memset(cache->shards, 0, sizeof(cache->shards));
+            return 1;
         }
-        sqlite3_finalize(stmt);
-    } else {
-        LOG_ERROR("Failed to prepare search query: %s", sqlite3_errmsg(db));
     }
-    free(lower_pattern);
+    cache->nshards = count;
+    LOG_INFO("Opened %d shards of %s", count, db_path);
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (logger_init("logs/windex.log", LOG_DEBUG, 1) != 0) {
-        fprintf(stderr, "Logger initialization failed. Exiting.\n");
-        return 1;
-    }
+// Number of connections making up db's index (1 unless it is sharded)
+int _shard_count(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    return cache && cache->nshards > 1 ? cache->nshards : 1;
+}
 
-    const char *hommy = getenv("HOME") ? getenv("HOME") : ".";
-    const char *root = access("/mnt/", F_OK) == 0 ? "/mnt/" : "C:\\";
-    const char *custom_db = NULL;
+// Connection for shard k; db itself when it isn't sharded
+sqlite3 *_shard_db(sqlite3 *db, int k) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    return cache && cache->nshards > 1 ? cache->shards[k] : db;
+}
 
-    // Parse command-line options
-    struct option long_options[] = {
-        {"root", required_argument, 0, 'r'},
-        {"exclude", required_argument, 0, 'e'},
-        {"db", required_argument, 0, 'd'},
-        {"help", no_argument, 0, 'h'},
-        {0, 0, 0, 0}
-    };
-    int opt;
-    _init_excluded_dirs();
-    while ((opt = getopt_long(argc, argv, "r:e:d:h", long_options, NULL)) != -1) {
-        switch (opt) {
-            case 'r':
-                root = optarg;
-                break;
-            case 'e':
-                _add_exclude_dir(optarg);
-                break;
-            case 'd':
-                custom_db = optarg;
-                break;
-            case 'h':
-                printf("Usage: %s [--root <path>] [--exclude <dir>] [--db <path>] index | search <pattern> | --help\n", argv[0]);
-                printf("Options:\n");
-                printf("  --root <path>    Set root directory to index (default: %s)\n", root);
-                printf("  --exclude <dir>  Add directory to exclude from indexing\n");
-                printf("  --db <path>      Set custom database file path (default: ~/.windex/.winindex.db)\n");
-                printf("  --help           Show this help message\n");
-                printf("Commands:\n");
-                printf("  index            Index files from the root directory\n");
-                printf("  search <pattern> Search for files matching the pattern\n");
-                printf("Description:\n");
-                printf("  Indexes files/folders from Windows drives. Stores in SQLite DB at %s\n",
-                       custom_db ? custom_db : "~/.windex/.winindex.db");
-                printf("  Incremental indexing: only new/modified entries are indexed.\n");
-                printf("  Search is case-insensitive with partial matching, limited to 100 results.\n");
-                _free_excluded_dirs();
-                return 0;
-            default:
-                fprintf(stderr, "Invalid option. Use --help for usage.\n");
-                _free_excluded_dirs();
-                return 1;
+// Run a statement such as BEGIN or COMMIT on every shard
+int _exec_shards(sqlite3 *db, const char *sql) {
+    int rc = 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        char *err_msg = NULL;
+        if (sqlite3_exec(_shard_db(db, k), sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+            LOG_ERROR("%s failed on shard %d: %s", sql, k, err_msg ? err_msg : "unknown error");
+            sqlite3_free(err_msg);
+            rc = 1;
         }
     }
+    return rc;
+}
 
-    char db_path[MAX_PATH];
-    if (_dbp(hommy, custom_db, db_path) != 0) {
-        _free_excluded_dirs();
-        return 1;
-    }
+// SQL and labels for the statement cache, indexed by STMT_* id
+static const struct {
+    const char *label;
+    const char *sql;
+} stmt_defs[STMT_COUNT] = {
+    [STMT_GET_MTIME] = { "mtime lookup", "SELECT id, mtime, size FROM files WHERE dir_id = ? AND name = ?;" },
+    // Subtree statements find the subtree's dirs.id values with one range scan of the unique
+    // dirs.path index, then reach files by integer dir_id through UNIQUE(dir_id, name). dirs
+    // ids are handed out in creation order, so a subtree is no contiguous id range, and a
+    // parent_id walk would take a recursive CTE plus a parent_id index, one level per step
+    [STMT_PRUNE]     = { "prune", "DELETE FROM files WHERE dir_id IN (SELECT id FROM dirs WHERE path = ?1 OR (path >= ?2 AND path < ?3)) AND scan_gen < ?4;" },
+    [STMT_PRUNE_DIRS] = { "prune dirs", "DELETE FROM dirs WHERE (path = ?1 OR (path >= ?2 AND path < ?3)) AND NOT EXISTS (SELECT 1 FROM files WHERE dir_id = dirs.id);" },
+    [STMT_DIR_LOOKUP] = { "dir lookup", "SELECT id FROM dirs WHERE path = ?;" },
+    [STMT_DIR_INSERT] = { "dir insert", "INSERT INTO dirs (parent_id, name, path) VALUES (?, ?, ?);" },
+    [STMT_DELETE_ID] = { "delete by id", "DELETE FROM files WHERE id = ?;" },
+    [STMT_DELETE_ENTRY] = { "delete entry", "DELETE FROM files WHERE dir_id = ? AND name = ?;" },
+    [STMT_DELETE_SUBTREE] = { "delete subtree", "DELETE FROM files WHERE dir_id IN (SELECT id FROM dirs WHERE path = ?1 OR (path >= ?2 AND path < ?3));" },
+    [STMT_DIR_CHILDREN] = { "dir children", "SELECT id, name, type FROM files WHERE dir_id = ?;" },
+    [STMT_TOUCH_SUBTREE] = { "touch subtree", "UPDATE files SET scan_gen = ?4 WHERE scan_gen <> ?4 AND dir_id IN (SELECT id FROM dirs WHERE path = ?1 OR (path >= ?2 AND path < ?3));" },
+    [STMT_SEARCH_PREFIX] = { "search prefix",
+        "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM files f "
+        "JOIN dirs d ON d.id = f.dir_id "
+        "WHERE f.name_lc >= ? AND f.name_lc < ?;" },
+    [STMT_SEARCH_PREFIX_OPEN] = { "search open prefix",
+        "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM files f "
+        "JOIN dirs d ON d.id = f.dir_id "
+        "WHERE f.name_lc >= ?;" },
+    [STMT_SEARCH_FTS] = { "search trigram",
+        "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM files_fts "
+        "JOIN files f ON f.id = files_fts.rowid JOIN dirs d ON d.id = f.dir_id "
+        "WHERE files_fts MATCH ?;" },
+    [STMT_SEARCH_LIKE] = { "search scan",
+        "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM files f "
+        "JOIN dirs d ON d.id = f.dir_id "
+        "WHERE d.path || '/' || f.name LIKE ?;" },
+    [STMT_SEARCH_LIKE_MTIME] = { "search scan by mtime",
+        "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM files f INDEXED BY idx_files_mtime "
+        "JOIN dirs d ON d.id = f.dir_id "
+        "WHERE d.path || '/' || f.name LIKE ? ORDER BY f.mtime DESC;" },
+    [STMT_DELETE_SUBTREE_DIRS] = { "delete subtree dirs", "DELETE FROM dirs WHERE path = ?1 OR (path >= ?2 AND path < ?3);" },
+    [STMT_BUMP_CHANGES] = { "bump changes",
+        "INSERT INTO meta (key, value) VALUES ('changes', 1) ON CONFLICT(key) DO UPDATE SET value = value + 1;" },
+    [STMT_SEARCH_ID] = { "search by id",
+        "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM files f "
+        "JOIN dirs d ON d.id = f.dir_id WHERE f.id = ?;" },
+    [STMT_RECORD_ROOT] = { "record root",
+        "INSERT INTO roots (path, scan_gen, scanned_at, duration_ms, entries) VALUES (?, ?, ?, ?, ?) "
+        "ON CONFLICT(path) DO UPDATE SET scan_gen = excluded.scan_gen, scanned_at = excluded.scanned_at, "
+        "duration_ms = excluded.duration_ms, entries = excluded.entries;" },
+    [STMT_ROOT_SCANNED] = { "root scanned at", "SELECT scanned_at FROM roots WHERE path = ?;" },
+};
 
-    sqlite3 *db;
-    if (_init_db(db_path, &db)) {
-        _free_excluded_dirs();
-        return 1;
+// Find the statement cache slot owned by a connection
+static stmt_cache *_find_stmt_cache(sqlite3 *db) {
+    for (int i = 0; i < MAX_DB_CONNS; i++) {
+        if (stmt_caches[i].db == db) return &stmt_caches[i];
     }
+    return NULL;
+}
 
-    if (optind >= argc) {
-        fprintf(stderr, "Usage: %s [--root <path>] [--exclude <dir>] [--db <path>] index | search <pattern> | --help\n", argv[0]);
-        sqlite3_close(db);
-        _free_excluded_dirs();
+// Prepare all hot-path statements once per connection
+int _init_stmt_cache(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(NULL);
+    if (!cache) {
+        LOG_ERROR("Too many open database connections (max %d)", MAX_DB_CONNS);
         return 1;
     }
-
-    if (strcmp(argv[optind], "index") == 0) {
-        LOG_EXECUTION(_index_files_dynamic(db, root));
-    } else if (strcmp(argv[optind], "search") == 0) {
-        if (optind + 1 >= argc) {
-            fprintf(stderr, "Error: Search pattern required.\n");
-            sqlite3_close(db);
-            _free_excluded_dirs();
+    memset(cache, 0, sizeof(*cache));
+    cache->db = db;
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (sqlite3_prepare_v3(db, stmt_defs[i].sql, -1, SQLITE_PREPARE_PERSISTENT,
+                               &cache->stmts[i].stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare %s statement: %s", stmt_defs[i].label, sqlite3_errmsg(db));
+            _free_stmt_cache(db);
             return 1;
         }
-        _search_files(db, argv[optind + 1]);
-    } else {
-        fprintf(stderr, "Invalid command. Use --help for usage.\n");
-        sqlite3_close(db);
-        _free_excluded_dirs();
-        return 1;
+        cache->stmts[i].prepares++;
     }
+    return 0;
+}
 
-    sqlite3_close(db);
+// Get a cached statement, reset and with cleared bindings
+sqlite3_stmt *_get_stmt(sqlite3 *db, int id) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache || id < 0 || id >= STMT_COUNT) return NULL;
+    cached_stmt *cs = &cache->stmts[id];
+    if (!cs->stmt) {
+        if (sqlite3_prepare_v3(db, stmt_defs[id].sql, -1, SQLITE_PREPARE_PERSISTENT,
+                               &cs->stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare %s statement: %s", stmt_defs[id].label, sqlite3_errmsg(db));
+            cs->stmt = NULL;
+            return NULL;
+        }
+        cs->prepares++;
+    }
+    sqlite3_reset(cs->stmt);
+    sqlite3_clear_bindings(cs->stmt);
+    cs->executions++;
+    return cs->stmt;
+}
+
+// Report how often each cached statement was compiled and reused
+void _log_stmt_stats(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache) return;
+    if (cache->nshards > 1) {
+        for (int k = 1; k < cache->nshards; k++) _log_stmt_stats(cache->shards[k]);
+    }
+    for (int i = 0; i < STMT_COUNT; i++) {
+        LOG_INFO("Statement %s: %ld prepares, %ld executions",
+                 stmt_defs[i].label, cache->stmts[i].prepares, cache->stmts[i].executions);
+    }
+    if (cache->writes) {
+        write_batch *wb = cache->writes;
+        LOG_INFO("Statement batch upsert: %ld prepares, %ld executions", wb->upsert.prepares, wb->upsert.executions);
+        LOG_INFO("Statement batch generation stamp: %ld prepares, %ld executions", wb->touch.prepares, wb->touch.executions);
+        LOG_INFO("Committed %ld times (batch size %d)", wb->commits, batch_size);
+    }
+}
+
+// Finalize cached statements for a connection
+void _free_stmt_cache(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache) return;
+    _unload_name_index(db);
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(cache->stmts[i].stmt);
+    }
+    if (cache->writes) {
+        sqlite3_finalize(cache->writes->upsert.stmt);
+        sqlite3_finalize(cache->writes->touch.stmt);
+        free(cache->writes->rows);
+        free(cache->writes->touch_ids);
+        free(cache->writes);
+    }
+    _clear_dir_cache(cache);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Forget every cached directory id, e.g. after directories were deleted
+void _clear_dir_cache(stmt_cache *cache) {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) free(cache->dir_cache[i].path);
+    memset(cache->dir_cache, 0, sizeof(cache->dir_cache));
+}
+
+// Monotonic milliseconds
+long long _now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic microseconds
+long long _now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Monotonic nanoseconds, for --stats accumulators
+long long _now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Each thread counts into its own block; blocks are only summed when reporting
+static __thread index_stats *thread_stats = NULL;
+static index_stats *all_stats = NULL;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void _stats_add(int id, long long ns) {
+    if (!thread_stats) {
+        index_stats *mine = calloc(1, sizeof(index_stats));
+        if (!mine) return;
+        pthread_mutex_lock(&all_stats_lock);
+        mine->next = all_stats;
+        all_stats = mine;
+        pthread_mutex_unlock(&all_stats_lock);
+        thread_stats = mine;
+    }
+    thread_stats->ns[id] += ns;
+    thread_stats->calls[id]++;
+}
+
+// readdir() and opendir(), timed under --stats
+static DIR *_timed_opendir(const char *path) {
+    STATS_START(started);
+    DIR *dir = opendir(path);
+    STATS_STOP(started, STAT_OPENDIR);
+    return dir;
+}
+
+static struct dirent *_timed_readdir(DIR *dir) {
+    STATS_START(started);
+    struct dirent *entry = readdir(dir);
+    STATS_STOP(started, STAT_READDIR);
+    return entry;
+}
+
+// Statement runs and VM steps of one connection's cached statements
+static void _sum_stmt_stats(sqlite3 *db, long long *runs, long long *steps) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache) return;
+    for (int i = 0; i < STMT_COUNT; i++) {
+        *runs += cache->stmts[i].executions;
+        if (cache->stmts[i].stmt) *steps += sqlite3_stmt_status(cache->stmts[i].stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    }
+    if (cache->writes) {
+        cached_stmt *batch[] = { &cache->writes->upsert, &cache->writes->touch };
+        for (int i = 0; i < 2; i++) {
+            *runs += batch[i]->executions;
+            *steps += batch[i]->one_off_steps;
+            if (batch[i]->stmt) *steps += sqlite3_stmt_status(batch[i]->stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+        }
+    }
+}
+
+// --stats report: per-phase calls and time summed over threads, plus SQLite work
+void _print_stats(sqlite3 *db, long long total_us) {
+    long long ns[STAT_COUNT] = {0};
+    long long calls[STAT_COUNT] = {0};
+    pthread_mutex_lock(&all_stats_lock);
+    for (index_stats *st = all_stats; st; st = st->next) {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            ns[i] += st->ns[i];
+            calls[i] += st->calls[i];
+        }
+    }
+    pthread_mutex_unlock(&all_stats_lock);
+
+    long long runs = 0, steps = 0;
+    for (int k = 0; k < _shard_count(db); k++) _sum_stmt_stats(_shard_db(db, k), &runs, &steps);
+    long long fs_calls = calls[STAT_OPENDIR] + calls[STAT_READDIR] + calls[STAT_STAT];
+
+    if (stats_mode == STATS_JSON) {
+        printf("{\"wall_ms\": %.3f, \"phases\": {", total_us / 1000.0);
+        for (int i = 0; i < STAT_COUNT; i++) {
+            printf("%s\"%s\": {\"calls\": %lld, \"ms\": %.3f}", i ? ", " : "", stat_names[i], calls[i], ns[i] / 1e6);
+        }
+        printf("}, \"fs_calls\": %lld, \"sqlite\": {\"statement_runs\": %lld, \"vm_steps\": %lld}}\n",
+               fs_calls, runs, steps);
+        return;
+    }
+    printf("%-10s %12s %12s %10s\n", "phase", "calls", "ms", "ns/call");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        printf("%-10s %12lld %12.3f %10lld\n", stat_names[i], calls[i], ns[i] / 1e6, calls[i] ? ns[i] / calls[i] : 0);
+    }
+    printf("filesystem calls: %lld (opendir + readdir + stat)\n", fs_calls);
+    printf("sqlite: %lld statement runs, %lld VM steps\n", runs, steps);
+    printf("wall: %.3f ms (phase times are summed over walker threads)\n", total_us / 1000.0);
+}
+
+// Multi-row upsert for n pending rows
+static char *_build_upsert_sql(int n) {
+    const char *head = "INSERT INTO files (dir_id, name, type, size, mtime, scan_gen, name_lc) VALUES ";
+    const char *row = "(?,?,?,?,?,?,?),";
+    const char *tail = " ON CONFLICT(dir_id, name) DO UPDATE SET type = excluded.type, size = excluded.size, "
+                       "mtime = excluded.mtime, scan_gen = excluded.scan_gen, head_hash = NULL, hash = NULL;";
+    size_t len = strlen(head) + (size_t)n * strlen(row) + strlen(tail) + 1;
+    char *sql = malloc(len);
+    if (!sql) return NULL;
+    char *p = sql + sprintf(sql, "%s", head);
+    for (int i = 0; i < n; i++) p += sprintf(p, "%s", row);
+    p[-1] = ' ';    // drop the trailing comma
+    strcpy(p, tail);
+    return sql;
+}
+
+// Generation stamp for n unchanged rows
+static char *_build_touch_sql(int n) {
+    const char *head = "UPDATE files SET scan_gen = ? WHERE id IN (";
+    size_t len = strlen(head) + (size_t)n * 2 + 3;
+    char *sql = malloc(len);
+    if (!sql) return NULL;
+    char *p = sql + sprintf(sql, "%s", head);
+    for (int i = 0; i < n; i++) p += sprintf(p, i ? ",?" : "?");
+    strcpy(p, ");");
+    return sql;
+}
+
+// Get a statement for n rows: the cached full-batch one, or a one-off for a partial batch
+static sqlite3_stmt *_batch_stmt(sqlite3 *db, cached_stmt *full, int n, char *(*build)(int)) {
+    sqlite3_stmt *stmt = NULL;
+    if (n == batch_size && full->stmt) {
+        sqlite3_reset(full->stmt);
+        sqlite3_clear_bindings(full->stmt);
+        full->executions++;
+        return full->stmt;
+    }
+    char *sql = build(n);
+    if (!sql) {
+        LOG_ERROR("Failed to allocate batch statement");
+        return NULL;
+    }
+    int rc = n == batch_size
+        ? sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL)
+        : sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    free(sql);
+    if (rc != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare batch statement: %s", sqlite3_errmsg(db));
+        return NULL;
+    }
+    if (n == batch_size) {
+        full->stmt = stmt;
+        full->prepares++;
+        full->executions++;
+    }
+    return stmt;
+}
+
+// Release a statement from _batch_stmt
+static void _batch_stmt_done(cached_stmt *full, sqlite3_stmt *stmt) {
+    if (stmt == full->stmt) {
+        sqlite3_reset(stmt);
+    } else {
+        if (stats_mode) full->one_off_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+        sqlite3_finalize(stmt);
+    }
+}
+
+// Get (creating on first use) the write buffer for a connection
+static write_batch *_get_write_batch(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache) return NULL;
+    if (!cache->writes) {
+        write_batch *wb = calloc(1, sizeof(write_batch));
+        if (wb) {
+            wb->rows = malloc(batch_size * sizeof(pending_row));
+            wb->touch_ids = malloc(batch_size * sizeof(sqlite3_int64));
+        }
+        if (!wb || !wb->rows || !wb->touch_ids) {
+            LOG_ERROR("Failed to allocate write batch of %d rows", batch_size);
+            if (wb) {
+                free(wb->rows);
+                free(wb->touch_ids);
+                free(wb);
+            }
+            return NULL;
+        }
+        wb->commit_started = _now_ms();
+        cache->writes = wb;
+    }
+    return cache->writes;
+}
+
+// Count a change to the files table; name index sidecars built before it are stale
+static void _bump_changes(sqlite3 *db) {
+    sqlite3_stmt *stmt = _get_stmt(db, STMT_BUMP_CHANGES);
+    if (!stmt) return;
+    if (sqlite3_step(stmt) != SQLITE_DONE) LOG_ERROR("Failed to count index changes: %s", sqlite3_errmsg(db));
+    sqlite3_reset(stmt);
+}
+
+// Build one shard's secondary indexes and FTS entries after a bulk load
+static void *_bulk_rebuild_shard(void *arg) {
+    bulk_shard *bs = arg;
+    char *err_msg = NULL;
+    if (sqlite3_exec(bs->db, bulk_create_sql, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(bs->db, bulk_fts_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("Failed to rebuild indexes after bulk load: %s", err_msg);
+        sqlite3_free(err_msg);
+        bs->rc = 1;
+    }
+    _bump_changes(bs->db);
+    return NULL;
+}
+
+// Rebuild every shard in parallel: each index build is a CPU-bound sort
+int _bulk_rebuild(sqlite3 *db) {
+    bulk_shard shards[MAX_SHARDS] = {{0}};
+    pthread_t threads[MAX_SHARDS];
+    int threaded[MAX_SHARDS] = {0};
+    int nshards = _shard_count(db);
+    int rc = 0;
+    for (int k = 0; k < nshards; k++) {
+        shards[k].db = _shard_db(db, k);
+        if (nshards > 1 && pthread_create(&threads[k], NULL, _bulk_rebuild_shard, &shards[k]) == 0) {
+            threaded[k] = 1;
+        } else {
+            _bulk_rebuild_shard(&shards[k]);
+        }
+    }
+    for (int k = 0; k < nshards; k++) {
+        if (threaded[k]) pthread_join(threads[k], NULL);
+        rc |= shards[k].rc;
+    }
+    return rc;
+}
+
+// First run on an empty index: defer secondary indexes and FTS, and write without fsyncs.
+// The rollback journal stays, and costs nothing here: pages past the original end aren't journaled
+int _begin_bulk_load(sqlite3 *db) {
+    for (int k = 0; k < _shard_count(db); k++) {
+        if (_pragma_int(_shard_db(db, k), "SELECT EXISTS (SELECT 1 FROM files);")) return 0;
+    }
+    for (int k = 0; k < _shard_count(db); k++) {
+        char *err_msg = NULL;
+        if (sqlite3_exec(_shard_db(db, k),
+                         "PRAGMA locking_mode = EXCLUSIVE;"
+                         "PRAGMA journal_mode = DELETE;"
+                         "PRAGMA synchronous = OFF;", NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(_shard_db(db, k), bulk_drop_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+            LOG_ERROR("Failed to start bulk load: %s", err_msg);
+            sqlite3_free(err_msg);
+            _end_bulk_load(db);
+            return 0;
+        }
+    }
+    LOG_INFO("Empty index: bulk loading, secondary indexes are built at the end");
+    return 1;
+}
+
+// Build what _begin_bulk_load deferred and go back to the profile's settings
+void _end_bulk_load(sqlite3 *db) {
+    STATS_START(started);
+    _exec_shards(db, "BEGIN TRANSACTION;");
+    // Whatever fails to build here is retried by _repair_bulk_load on the next write command
+    _bulk_rebuild(db);
+    _exec_shards(db, "COMMIT;");
+    STATS_STOP(started, STAT_REBUILD);
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        sqlite3_exec(shard, "PRAGMA locking_mode = NORMAL;", NULL, NULL, NULL);
+        _apply_profile(shard);
+    }
+}
+
+// Write out one connection's buffered upserts and generation stamps
+static int _flush_shard(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache || !cache->writes) return 0;
+    write_batch *wb = cache->writes;
+    sqlite3_int64 gen = cache->scan_gen;
+    int rc = 0;
+
+    if (wb->nrows > 0) {
+        STATS_START(upsert_started);
+        sqlite3_stmt *stmt = _batch_stmt(db, &wb->upsert, wb->nrows, _build_upsert_sql);
+        if (stmt) {
+            for (int i = 0, col = 1; i < wb->nrows; i++) {
+                pending_row *row = &wb->rows[i];
+                sqlite3_bind_int64(stmt, col++, row->dir_id);
+                sqlite3_bind_text(stmt, col++, row->name, -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, col++, row->type, -1, SQLITE_STATIC);
+                sqlite3_bind_int64(stmt, col++, row->size);
+                sqlite3_bind_int64(stmt, col++, row->mtime);
+                sqlite3_bind_int64(stmt, col++, gen);
+                sqlite3_bind_text(stmt, col++, row->name_lc, -1, SQLITE_STATIC);
+            }
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                LOG_ERROR("Failed to write batch of %d entries: %s", wb->nrows, sqlite3_errmsg(db));
+                rc = 1;
+            }
+            _batch_stmt_done(&wb->upsert, stmt);
+            _bump_changes(db);
+        } else {
+            rc = 1;
+        }
+        wb->nrows = 0;
+        STATS_STOP(upsert_started, STAT_UPSERT);
+    }
+
+    if (wb->ntouch > 0) {
+        STATS_START(stamp_started);
+        sqlite3_stmt *stmt = _batch_stmt(db, &wb->touch, wb->ntouch, _build_touch_sql);
+        if (stmt) {
+            sqlite3_bind_int64(stmt, 1, gen);
+            for (int i = 0; i < wb->ntouch; i++) sqlite3_bind_int64(stmt, i + 2, wb->touch_ids[i]);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                LOG_ERROR("Failed to stamp scan generation for %d entries: %s", wb->ntouch, sqlite3_errmsg(db));
+                rc = 1;
+            }
+            _batch_stmt_done(&wb->touch, stmt);
+        } else {
+            rc = 1;
+        }
+        wb->ntouch = 0;
+        STATS_STOP(stamp_started, STAT_STAMP);
+    }
+    return rc;
+}
+
+// Write out every buffered upsert and generation stamp
+int _flush_writes(sqlite3 *db) {
+    int rc = 0;
+    for (int k = 0; k < _shard_count(db); k++) rc |= _flush_shard(_shard_db(db, k));
+    return rc;
+}
+
+// Commit and reopen the transaction once --commit-interval rows or milliseconds have passed;
+// a shard writer thread passes all_shards = 0 to touch only its own connection
+static void _maybe_commit_shard(sqlite3 *db, int all_shards) {
+    write_batch *wb = _get_write_batch(db);
+    if (!wb) return;
+    wb->since_commit++;
+    int due = commit_rows > 0 && wb->since_commit >= commit_rows;
+    if (!due && commit_ms > 0 && (wb->since_commit & 255) == 0) {
+        due = _now_ms() - wb->commit_started >= commit_ms;
+    }
+    if (!due) return;
+
+    if (all_shards) {
+        _flush_writes(db);
+        STATS_START(commit_started);
+        _exec_shards(db, "COMMIT;");
+        _exec_shards(db, "BEGIN TRANSACTION;");
+        STATS_STOP(commit_started, STAT_COMMIT);
+    } else {
+        _flush_shard(db);
+        STATS_START(commit_started);
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+        sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+        STATS_STOP(commit_started, STAT_COMMIT);
+    }
+    wb->commits++;
+    wb->since_commit = 0;
+    wb->commit_started = _now_ms();
+}
+
+// Count a visited entry towards --commit-interval, committing every shard when due
+void _maybe_commit(sqlite3 *db) {
+    _maybe_commit_shard(db, 1);
+}
+
+// Lowercase into a caller buffer (ASCII folding, same as SQLite's lower())
+static void _lower_copy(char *dst, const char *src, size_t size) {
+    size_t i = 0;
+    for (; src[i] && i + 1 < size; i++) dst[i] = (char)tolower((unsigned char)src[i]);
+    dst[i] = '\0';
+}
+
+// Exclusive upper bound for a prefix range scan: the prefix with its last byte bumped
+static int _prefix_upper_bound(const char *prefix, char *upper, size_t size) {
+    size_t len = strlen(prefix);
+    if (len == 0 || len >= size) return -1;
+    memcpy(upper, prefix, len + 1);
+    while (len > 0 && (unsigned char)upper[len - 1] == 0xFF) upper[--len] = '\0';
+    if (len == 0) return -1;
+    upper[len - 1]++;
+    return 0;
+}
+
+// Descendants of path live in dirs whose path is path itself or in [path + "/", path + "0")
+static int _subtree_bounds(const char *path, char *lower, char *upper) {
+    if (snprintf(lower, MAX_PATH, "%s/", path) >= MAX_PATH) return 1;
+    if (snprintf(upper, MAX_PATH, "%s0", path) >= MAX_PATH) return 1;
+    return 0;
+}
+
+// 64-bit FNV-1a over more bytes of a path
+#define PATH_HASH_SEED 1469598103934665603ULL
+static uint64_t _path_hash_update(uint64_t h, const char *str) {
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Hash of a full path; never returns 0 so 0 can mark empty map slots
+static uint64_t _path_hash(const char *path) {
+    uint64_t h = _path_hash_update(PATH_HASH_SEED, path);
+    return h ? h : 1;
+}
+
+// Index of the shard that holds a directory's entries
+int _shard_index(sqlite3 *db, const char *dir_path) {
+    int count = _shard_count(db);
+    return count > 1 ? (int)(_path_hash(dir_path) % (uint64_t)count) : 0;
+}
+
+// Connection holding a directory's entries
+sqlite3 *_shard_for_dir(sqlite3 *db, const char *dir_path) {
+    return _shard_count(db) > 1 ? _shard_db(db, _shard_index(db, dir_path)) : db;
+}
+
+// Find the slot for dir/name (linear probing); returns an empty slot if absent. A hash
+// match only counts once the stored directory and name agree too
+static size_t _path_map_slot(path_map *map, uint64_t hash, const char *dir, size_t dir_len, const char *name) {
+    size_t i = (size_t)hash & map->mask;
+    while (map->slots[i].hash) {
+        const path_map_slot *slot = &map->slots[i];
+        if (slot->hash == hash) {
+            const char *stored = map->text + slot->dir_off;
+            if (strncmp(stored, dir, dir_len) == 0 && stored[dir_len] == '\0' &&
+                strcmp(map->text + slot->name_off, name) == 0) break;
+        }
+        i = (i + 1) & map->mask;
+    }
+    return i;
+}
+
+// Append a string to the map's text; returns its offset, or (size_t)-1 if it can't grow
+static size_t _path_map_text(path_map *map, const char *str) {
+    size_t n = strlen(str) + 1;
+    if (map->text_len + n > map->text_cap) {
+        size_t cap = map->text_cap ? map->text_cap * 2 : 1 << 20;
+        while (cap < map->text_len + n) cap *= 2;
+        char *grown = realloc(map->text, cap);
+        if (!grown) return (size_t)-1;
+        map->text = grown;
+        map->text_cap = cap;
+    }
+    memcpy(map->text + map->text_len, str, n);
+    map->text_len += n;
+    return map->text_len - n;
+}
+
+// Double the map capacity and reinsert every slot
+static int _path_map_grow(path_map *map) {
+    size_t capacity = map->slots ? (map->mask + 1) * 2 : 1 << 16;
+    path_map_slot *old = map->slots;
+    size_t old_capacity = old ? map->mask + 1 : 0;
+
+    map->slots = calloc(capacity, sizeof(path_map_slot));
+    uint8_t *seen = calloc(capacity / 8, 1);
+    if (!map->slots || !seen) {
+        free(map->slots);
+        free(seen);
+        map->slots = old;
+        return -1;
+    }
+    free(map->seen);
+    map->seen = seen;
+    map->mask = capacity - 1;
+    // Every entry is distinct, so each goes to the first free slot of its probe sequence
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i].hash) continue;
+        size_t j = (size_t)old[i].hash & map->mask;
+        while (map->slots[j].hash) j = (j + 1) & map->mask;
+        map->slots[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Stream one connection's rows under the roots into an in-memory map (one range scan per root)
+static int _load_shard_map(sqlite3 *db, const char **roots, int nroots) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache) return 1;
+    _free_path_map(db);
+
+    path_map *map = calloc(1, sizeof(path_map));
+    if (!map || _path_map_grow(map) != 0) {
+        LOG_ERROR("Failed to allocate path map");
+        free(map);
+        return 1;
+    }
+
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT f.id, d.path, f.name, f.mtime, f.size FROM files f JOIN dirs d ON d.id = f.dir_id "
+                      "WHERE d.path = ?1 OR (d.path >= ?2 AND d.path < ?3);";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare path map query: %s", sqlite3_errmsg(db));
+        free(map->slots);
+        free(map->seen);
+        free(map);
+        return 1;
+    }
+    int full = 0;
+    size_t last_dir = (size_t)-1;   // rows arrive grouped by directory: store each once
+    for (int r = 0; r < nroots && r < MAX_ROOTS; r++) map->roots[map->nroots++] = roots[r];
+    for (int r = 0; r < map->nroots && !full; r++) {
+        char lower[MAX_PATH], upper[MAX_PATH];
+        if (_subtree_bounds(roots[r], lower, upper) != 0) {
+            LOG_ERROR("Cannot compute path range for root %s", roots[r]);
+            continue;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, roots[r], -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_STATIC);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *dir = (const char *)sqlite3_column_text(stmt, 1);
+            const char *name = (const char *)sqlite3_column_text(stmt, 2);
+            if (!dir || !name) continue;
+            if ((map->count + 1) * 10 > (map->mask + 1) * 7 && _path_map_grow(map) != 0) {
+                LOG_ERROR("Failed to grow path map at %zu entries", map->count);
+                full = 1;
+                break;
+            }
+            // Same hash as _path_hash("dir/name") without building the string
+            uint64_t hash = _path_hash_update(_path_hash_update(_path_hash_update(PATH_HASH_SEED, dir), "/"), name);
+            if (!hash) hash = 1;
+            path_map_slot *slot = &map->slots[_path_map_slot(map, hash, dir, strlen(dir), name)];
+            if (!slot->hash) {
+                if (last_dir == (size_t)-1 || strcmp(map->text + last_dir, dir) != 0) last_dir = _path_map_text(map, dir);
+                size_t name_off = last_dir == (size_t)-1 ? last_dir : _path_map_text(map, name);
+                if (name_off == (size_t)-1) {
+                    LOG_ERROR("Failed to grow path map at %zu entries", map->count);
+                    full = 1;
+                    break;
+                }
+                slot->dir_off = last_dir;
+                slot->name_off = name_off;
+                map->count++;
+            }
+            slot->hash = hash;
+            slot->id = sqlite3_column_int64(stmt, 0);
+            slot->mtime = sqlite3_column_int64(stmt, 3);
+            slot->size = sqlite3_column_int64(stmt, 4);
+            slot->root = r;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    cache->diff_map = map;
+    LOG_INFO("Loaded %zu existing entries into path map (%zu slots)", map->count, map->mask + 1);
+    return 0;
+}
+
+// Load the --diff map of every shard
+int _load_path_map(sqlite3 *db, const char **roots, int nroots) {
+    for (int k = 0; k < _shard_count(db); k++) {
+        if (_load_shard_map(_shard_db(db, k), roots, nroots) != 0) return 1;
+    }
+    return 0;
+}
+
+// Drop the --diff map for a connection
+void _free_path_map(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache || !cache->diff_map) return;
+    free(cache->diff_map->slots);
+    free(cache->diff_map->seen);
+    free(cache->diff_map->text);
+    free(cache->diff_map);
+    cache->diff_map = NULL;
+}
+
+// Split "dir/name": copies the directory part, returns a pointer to the name
+static const char *_split_path(const char *path, char *dir, size_t size) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        dir[0] = '\0';
+        return path;
+    }
+    size_t len = (size_t)(slash - path);
+    if (len >= size) len = size - 1;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    return slash + 1;
+}
+
+// Map a directory path to its dirs.id, optionally creating it (and missing parents)
+sqlite3_int64 _resolve_dir_id(sqlite3 *db, const char *dir_path, int create) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    uint64_t hash = _path_hash(dir_path);
+    dir_cache_slot *slot = cache ? &cache->dir_cache[hash % DIR_CACHE_SIZE] : NULL;
+    if (slot && slot->hash == hash && strcmp(slot->path, dir_path) == 0) return slot->id;
+
+    sqlite3_int64 id = 0;
+    sqlite3_stmt *stmt = _get_stmt(db, STMT_DIR_LOOKUP);
+    if (!stmt) return 0;
+    sqlite3_bind_text(stmt, 1, dir_path, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+
+    if (!id && create) {
+        char parent[MAX_PATH];
+        const char *name = _split_path(dir_path, parent, MAX_PATH);
+        sqlite3_int64 parent_id = parent[0] ? _resolve_dir_id(db, parent, 1) : 0;
+        if (!(stmt = _get_stmt(db, STMT_DIR_INSERT))) return 0;
+        sqlite3_bind_int64(stmt, 1, parent_id);
+        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, dir_path, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            id = sqlite3_last_insert_rowid(db);
+        } else {
+            LOG_ERROR("Failed to insert directory %s: %s", dir_path, sqlite3_errmsg(db));
+        }
+        sqlite3_reset(stmt);
+    }
+    if (id && slot) {
+        char *copy = strdup(dir_path);
+        free(slot->path);
+        slot->hash = copy ? hash : 0;
+        slot->path = copy;
+        slot->id = id;
+    }
+    return id;
+}
+
+// Look up an entry in the --diff map and mark it seen; id 0 means absent. size may be NULL
+static long _lookup_path_map(path_map *map, const char *path, sqlite3_int64 *id, sqlite3_int64 *size) {
+    const char *slash = strrchr(path, '/');
+    *id = 0;
+    if (!slash) return 0;
+    size_t i = _path_map_slot(map, _path_hash(path), path, (size_t)(slash - path), slash + 1);
+    if (!map->slots[i].hash) return 0;
+    map->seen[i / 8] |= (uint8_t)(1 << (i % 8));
+    *id = map->slots[i].id;
+    if (size) *size = map->slots[i].size;
+    return (long)map->slots[i].mtime;
+}
+
+// Look up an entry's id, mtime and size by directory and name; id 0 means absent. size may be NULL
+static long _lookup_entry(sqlite3 *db, sqlite3_int64 dir_id, const char *name, sqlite3_int64 *id, sqlite3_int64 *size) {
+    long mtime = 0;
+    *id = 0;
+    if (!dir_id) return mtime;
+    sqlite3_stmt *stmt = _get_stmt(db, STMT_GET_MTIME);
+    if (!stmt) return mtime;
+    sqlite3_bind_int64(stmt, 1, dir_id);
+    sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        *id = sqlite3_column_int64(stmt, 0);
+        mtime = sqlite3_column_int64(stmt, 1);
+        if (size) *size = sqlite3_column_int64(stmt, 2);
+    }
+    sqlite3_reset(stmt);
+    return mtime;
+}
+
+// Get existing mtime from database
+long _get_db_mtime(sqlite3 *db, const char *path) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    sqlite3_int64 id;
+    if (cache && cache->diff_map) return _lookup_path_map(cache->diff_map, path, &id, NULL);
+    char dir[MAX_PATH];
+    const char *name = _split_path(path, dir, MAX_PATH);
+    return _lookup_entry(db, _resolve_dir_id(db, dir, 0), name, &id, NULL);
+}
+
+// Stamp an unchanged row with the current scan generation
+static void _touch_entry(sqlite3 *db, sqlite3_int64 id) {
+    write_batch *wb = _get_write_batch(db);
+    if (!wb) return;
+    wb->touch_ids[wb->ntouch++] = id;
+    if (wb->ntouch == batch_size) _flush_shard(db);
+}
+
+// Index a single file or directory; returns 0 if it was already up to date, 1 if written, -1 on error
+int _index_entry(sqlite3 *db, const char *path, struct stat *st) {
+    char dir[MAX_PATH];
+    char name[MAX_NAME];
+    char name_lc[MAX_NAME];
+    snprintf(name, MAX_NAME, "%s", _split_path(path, dir, MAX_PATH));
+    _lower_copy(name_lc, name, MAX_NAME);
+    db = _shard_for_dir(db, dir);
+    const char *type = S_ISDIR(st->st_mode) ? "dir" : "file";
+    long mtime = (long)st->st_mtime;
+    stmt_cache *cache = _find_stmt_cache(db);
+    sqlite3_int64 id;
+    sqlite3_int64 dir_id = 0;
+    long db_mtime;
+    sqlite3_int64 db_size = 0;
+
+    STATS_START(lookup_started);
+    if (cache && cache->diff_map) {
+        db_mtime = _lookup_path_map(cache->diff_map, path, &id, &db_size);
+    } else {
+        dir_id = _resolve_dir_id(db, dir, 1);
+        db_mtime = _lookup_entry(db, dir_id, name, &id, &db_size);
+    }
+    STATS_STOP(lookup_started, STAT_LOOKUP);
+
+    write_batch *wb = _get_write_batch(db);
+    if (!wb) return -1;
+
+    if (id && db_mtime == mtime && db_size == (sqlite3_int64)st->st_size) {
+        // Unchanged: only stamp the generation so pruning keeps it (--diff tracks this in memory)
+        if (!(cache && cache->diff_map)) _touch_entry(db, id);
+        return 0;
+    }
+
+    if (!dir_id && !(dir_id = _resolve_dir_id(db, dir, 1))) return -1;
+    pending_row *row = &wb->rows[wb->nrows++];
+    row->dir_id = dir_id;
+    row->type = type;
+    row->size = (sqlite3_int64)st->st_size;
+    row->mtime = (sqlite3_int64)mtime;
+    memcpy(row->name, name, MAX_NAME);
+    memcpy(row->name_lc, name_lc, MAX_NAME);
+    if (wb->nrows == batch_size) _flush_shard(db);
+#ifdef WINDEX_LOG_ENTRIES
+    LOG_INFO("Indexed entry: %s", path);
+#else
+    // One line per ENTRY_LOG_MS: per-entry logging would cost more than the indexing. The
+    // clock is only read every ENTRY_LOG_CHECK entries, so the rest pay for a counter
+    if (++wb->unlogged % ENTRY_LOG_CHECK == 0) {
+        long long now = _now_ms();
+        if (now - wb->logged_at >= ENTRY_LOG_MS) {
+            LOG_INFO("Indexed entry: %s (and %ld more since the last one shown)", path, wb->unlogged - 1);
+            wb->logged_at = now;
+            wb->unlogged = 0;
+        }
+    }
+#endif
+    return 1;
+}
+
+// Stat a directory entry: fd-relative with --fast-meta, skipped for dirs with --no-dir-meta
+static int _stat_entry_untimed(DIR *dir, const struct dirent *entry, const char *path, struct stat *st) {
+#ifdef WINDEX_HAVE_D_TYPE
+    if (fast_meta) {
+        if (skip_dir_meta && entry->d_type == DT_DIR) {
+            memset(st, 0, sizeof(*st));
+            st->st_mode = S_IFDIR;
+            return 0;
+        }
+        // DT_LNK and DT_UNKNOWN still need the stat to match stat()'s link following
+        return fstatat(dirfd(dir), entry->d_name, st, 0);
+    }
+#else
+    (void)dir;
+    (void)entry;
+#endif
+    return stat(path, st);
+}
+
+// _stat_entry_untimed, timed under --stats
+static int _stat_entry(DIR *dir, const struct dirent *entry, const char *path, struct stat *st) {
+    STATS_START(started);
+    int rc = _stat_entry_untimed(dir, entry, path, st);
+    STATS_STOP(started, STAT_STAT);
+    return rc;
+}
+
+#ifdef WINDEX_HAVE_IO_URING
+// Map a ring with room for one full batch of statx requests; NULL when io_uring is unavailable
+static io_ring *_ring_open(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, DIR_READ_BATCH, &params);
+    if (fd < 0) return NULL;
+    io_ring *ring = calloc(1, sizeof(io_ring));
+    if (!ring) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_size);
+        if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+static void _ring_close(io_ring *ring) {
+    if (!ring) return;
+    munmap(ring->sq_ring, ring->sq_size);
+    munmap(ring->cq_ring, ring->cq_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+    free(ring);
+}
+
+// statx every name in dr's batch relative to the open directory, all requests in flight at once
+static int _ring_stat_batch(dir_reader *dr) {
+    io_ring *ring = dr->ring;
+    unsigned tail = *ring->sq_tail;
+    int queued = 0;
+    for (int i = 0; i < dr->count; i++) {
+        if (dr->skipped[i]) continue;
+        unsigned idx = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd(dr->dir);
+        sqe->addr = (uint64_t)(uintptr_t)dr->names[i];
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&dr->stx[i];
+        sqe->statx_flags = 0;       // follow links and sync as stat() does
+        sqe->user_data = (uint64_t)i;
+        ring->sq_array[idx] = idx;
+        tail++;
+        queued++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0, done = 0;
+    while (done < queued) {
+        int rc = (int)syscall(__NR_io_uring_enter, ring->fd, queued - submitted, queued - done,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR) return -1;
+        if (rc > 0) submitted += rc;
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            dr->errs[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Read the next batch of names, then stat them together; 0 at the end of the directory
+static int _ring_fill(dir_reader *dr) {
+    dr->count = dr->next = 0;
+    struct dirent *entry;
+    while (dr->count < DIR_READ_BATCH && (entry = _timed_readdir(dr->dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(dr->names[dr->count], MAX_NAME, "%s", entry->d_name);
+        dr->skipped[dr->count] = fast_meta && skip_dir_meta && entry->d_type == DT_DIR;
+        dr->errs[dr->count] = 0;
+        dr->count++;
+    }
+    if (dr->count == 0) return 0;
+    STATS_START(started);
+    if (_ring_stat_batch(dr) != 0) {
+        // The ring is broken for this thread; stat the batch one by one and stop using it
+        LOG_ERROR("io_uring submission failed: %s; falling back to stat()", strerror(errno));
+        _ring_close(dr->ring);
+        dr->ring = NULL;
+        dr->ring_failed = 1;
+        for (int i = 0; i < dr->count; i++) {
+            if (!dr->skipped[i] && syscall(__NR_statx, dirfd(dr->dir), dr->names[i], 0,
+                                           STATX_BASIC_STATS, &dr->stx[i]) != 0) {
+                dr->errs[i] = errno;
+            }
+        }
+    }
+    STATS_STOP(started, STAT_STAT);
+    return dr->count;
+}
+
+static void _statx_to_stat(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_ino = stx->stx_ino;
+    st->st_size = (off_t)stx->stx_size;
+    st->st_atime = stx->stx_atime.tv_sec;
+    st->st_mtime = stx->stx_mtime.tv_sec;
+    st->st_ctime = stx->stx_ctime.tv_sec;
+}
+#endif
+
+#ifdef _WIN32
+// FILETIME (100 ns ticks since 1601) to a Unix timestamp
+static time_t _filetime_to_unix(FILETIME ft) {
+    uint64_t ticks = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (time_t)((ticks - 116444736000000000ULL) / 10000000ULL);
+}
+#endif
+
+// Open path for listing with the --io backend; -1 with errno set on failure
+int _dir_open(dir_reader *dr, const char *path) {
+    dr->backend = io_backend;
+#ifdef _WIN32
+    if (dr->backend == IO_FIND) {
+        wchar_t wpath[MAX_PATH];
+        int len = MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH - 2) - 1;
+        if (len < 0) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (len > 0 && wpath[len - 1] != L'\\' && wpath[len - 1] != L'/') wpath[len++] = L'\\';
+        wpath[len++] = L'*';
+        wpath[len] = 0;
+        STATS_START(started);
+        // Basic info skips the 8.3 short name; large fetch asks for bigger directory reads
+        dr->find = FindFirstFileExW(wpath, FindExInfoBasic, &dr->data, FindExSearchNameMatch, NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+        STATS_STOP(started, STAT_OPENDIR);
+        if (dr->find == INVALID_HANDLE_VALUE) {
+            DWORD err = GetLastError();
+            if (err == ERROR_FILE_NOT_FOUND) {
+                dr->unread = 0;     // nothing matched *: an empty drive root
+                return 0;
+            }
+            errno = err == ERROR_ACCESS_DENIED ? EACCES : err == ERROR_PATH_NOT_FOUND ? ENOENT : EIO;
+            return -1;
+        }
+        dr->unread = 1;
+        return 0;
+    }
+#endif
+#ifdef WINDEX_HAVE_IO_URING
+    if (dr->backend == IO_URING && !dr->ring && !dr->ring_failed && !(dr->ring = _ring_open())) {
+        LOG_INFO("io_uring is unavailable (%s); listing with --io posix", strerror(errno));
+        dr->ring_failed = 1;
+    }
+    if (dr->backend == IO_URING && !dr->ring) dr->backend = IO_POSIX;
+    dr->count = dr->next = 0;
+#endif
+    dr->dir = _timed_opendir(path);
+    return dr->dir ? 0 : -1;
+}
+
+// Next entry name, without "." and ".."; NULL at the end
+const char *_dir_next(dir_reader *dr) {
+#ifdef _WIN32
+    if (dr->backend == IO_FIND) {
+        for (;;) {
+            if (!dr->unread) {
+                STATS_START(started);
+                BOOL more = dr->find != INVALID_HANDLE_VALUE && FindNextFileW(dr->find, &dr->data);
+                STATS_STOP(started, STAT_READDIR);
+                if (!more) return NULL;
+            }
+            dr->unread = 0;
+            const wchar_t *w = dr->data.cFileName;
+            if (w[0] == L'.' && (w[1] == 0 || (w[1] == L'.' && w[2] == 0))) continue;
+            if (!WideCharToMultiByte(CP_UTF8, 0, w, -1, dr->name, MAX_NAME, NULL, NULL)) continue;
+            return dr->name;
+        }
+    }
+#endif
+#ifdef WINDEX_HAVE_IO_URING
+    if (dr->backend == IO_URING) {
+        if (dr->next == dr->count && !_ring_fill(dr)) return NULL;
+        return dr->names[dr->next++];
+    }
+#endif
+    while ((dr->entry = _timed_readdir(dr->dir))) {
+        if (strcmp(dr->entry->d_name, ".") != 0 && strcmp(dr->entry->d_name, "..") != 0) return dr->entry->d_name;
+    }
+    return NULL;
+}
+
+// Metadata of the entry _dir_next just returned (path is its full path); -1 with errno set
+int _dir_stat(dir_reader *dr, const char *path, struct stat *st) {
+#ifdef _WIN32
+    if (dr->backend == IO_FIND) {
+        // Reparse points report their own attributes here, where stat() would follow them
+        memset(st, 0, sizeof(*st));
+        st->st_mode = (dr->data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? S_IFDIR : S_IFREG;
+        if (!S_ISDIR(st->st_mode)) {
+            st->st_size = (off_t)(((uint64_t)dr->data.nFileSizeHigh << 32) | dr->data.nFileSizeLow);
+        }
+        st->st_mtime = _filetime_to_unix(dr->data.ftLastWriteTime);
+        return 0;
+    }
+#endif
+#ifdef WINDEX_HAVE_IO_URING
+    if (dr->backend == IO_URING) {
+        int i = dr->next - 1;
+        if (dr->skipped[i]) {
+            memset(st, 0, sizeof(*st));
+            st->st_mode = S_IFDIR;
+            return 0;
+        }
+        if (dr->errs[i]) {
+            errno = dr->errs[i];
+            return -1;
+        }
+        _statx_to_stat(&dr->stx[i], st);
+        return 0;
+    }
+#endif
+    return _stat_entry(dr->dir, dr->entry, path, st);
+}
+
+void _dir_close(dir_reader *dr) {
+#ifdef _WIN32
+    if (dr->backend == IO_FIND) {
+        if (dr->find != INVALID_HANDLE_VALUE) FindClose(dr->find);
+        dr->find = INVALID_HANDLE_VALUE;
+        return;
+    }
+#endif
+    if (dr->dir) closedir(dr->dir);
+    dr->dir = NULL;
+}
+
+// Release what outlives single directories (the io_uring ring)
+void _dir_reader_free(dir_reader *dr) {
+    _dir_close(dr);
+#ifdef WINDEX_HAVE_IO_URING
+    _ring_close(dr->ring);
+    dr->ring = NULL;
+#endif
+}
+
+// Delete rows the walk never saw, using the --diff map instead of re-stat'ing; rows under
+// a root that was not walked stay
+static int _prune_unseen_entries(sqlite3 *db, path_map *map, const char **roots, int nroots) {
+    int walked[MAX_ROOTS] = {0};
+    for (int m = 0; m < map->nroots; m++) {
+        for (int r = 0; r < nroots && !walked[m]; r++) walked[m] = strcmp(map->roots[m], roots[r]) == 0;
+    }
+    int deleted = 0;
+    for (size_t i = 0; i <= map->mask; i++) {
+        if (!map->slots[i].hash || (map->seen[i / 8] & (1 << (i % 8))) || !walked[map->slots[i].root]) continue;
+        sqlite3_stmt *del_stmt = _get_stmt(db, STMT_DELETE_ID);
+        if (!del_stmt) break;
+        sqlite3_bind_int64(del_stmt, 1, map->slots[i].id);
+        if (sqlite3_step(del_stmt) == SQLITE_DONE) deleted++;
+        sqlite3_reset(del_stmt);
+    }
+    return deleted;
+}
+
+// Prune one connection's stale entries: everything under a root not stamped by this run's generation
+static void _prune_shard(sqlite3 *db, const char **roots, int nroots) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    int deleted = 0;
+
+    // The --diff map holds exactly the rows under the roots, so the walk's misses are the stale ones
+    if (cache && cache->diff_map) deleted = _prune_unseen_entries(db, cache->diff_map, roots, nroots);
+
+    for (int r = 0; r < nroots; r++) {
+        // The root itself and [root + "/", root + "0"): /mnt/c never reaches into /mnt/cache
+        char lower[MAX_PATH], upper[MAX_PATH];
+        if (_subtree_bounds(roots[r], lower, upper) != 0) {
+            LOG_ERROR("Cannot compute prune range for root %s", roots[r]);
+            continue;
+        }
+        sqlite3_stmt *stmt;
+        if (!(cache && cache->diff_map) && (stmt = _get_stmt(db, STMT_PRUNE))) {
+            sqlite3_bind_text(stmt, 1, roots[r], -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 4, cache ? cache->scan_gen : 0);
+            if (sqlite3_step(stmt) == SQLITE_DONE) {
+                deleted += sqlite3_changes(db);
+            } else {
+                LOG_ERROR("Failed to prune stale entries: %s", sqlite3_errmsg(db));
+            }
+            sqlite3_reset(stmt);
+        }
+
+        // Directories left without entries go last: the FTS delete trigger reads their paths
+        if ((stmt = _get_stmt(db, STMT_PRUNE_DIRS))) {
+            sqlite3_bind_text(stmt, 1, roots[r], -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                LOG_ERROR("Failed to prune stale directories: %s", sqlite3_errmsg(db));
+            }
+            sqlite3_reset(stmt);
+        }
+    }
+    if (cache) _clear_dir_cache(cache);
+    if (deleted) _bump_changes(db);
+    LOG_INFO("Pruned %d stale entries", deleted);
+}
+
+// Prune stale entries in every shard
+void _prune_stale_entries(sqlite3 *db, const char **roots, int nroots) {
+    STATS_START(started);
+    for (int k = 0; k < _shard_count(db); k++) _prune_shard(_shard_db(db, k), roots, nroots);
+    STATS_STOP(started, STAT_PRUNE);
+}
+
+// Bump-allocate from the walk arena, reusing chunks left over from rolled-back subtrees
+static void *_walk_alloc(walk_stack *ws, size_t size) {
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    walk_chunk *chunk = ws->cur;
+    if (chunk && chunk->used + size <= chunk->cap) {
+        void *p = chunk->data + chunk->used;
+        chunk->used += size;
+        return p;
+    }
+    walk_chunk *next = chunk ? chunk->next : ws->head;
+    if (!next || next->cap < size) {
+        size_t cap = size > WALK_ARENA_CHUNK ? size : WALK_ARENA_CHUNK;
+        walk_chunk *fresh = malloc(sizeof(walk_chunk) + cap);
+        if (!fresh) return NULL;
+        fresh->cap = cap;
+        fresh->next = next;
+        if (chunk) chunk->next = fresh;
+        else ws->head = fresh;
+        next = fresh;
+    }
+    next->used = size;
+    ws->cur = next;
+    return next->data;
+}
+
+// Free the arena and the stack
+static void _walk_stack_free(walk_stack *ws) {
+    while (ws->head) {
+        walk_chunk *next = ws->head->next;
+        free(ws->head);
+        ws->head = next;
+    }
+    free(ws->items);
+    free(ws->names);
+    free(ws->ids);
+}
+
+// Push a directory as (parent, name) onto the walk stack; returns -1 if it can't grow
+static int _walk_push(walk_stack *ws, walk_node *parent, const char *name, int cached) {
+    if (ws->top >= ws->capacity) {
+        int capacity = ws->capacity ? ws->capacity * 2 : 1000;
+        walk_item *items = realloc(ws->items, capacity * sizeof(walk_item));
+        if (!items) {
+            LOG_ERROR("Failed to reallocate stack");
+            return -1;
+        }
+        ws->items = items;
+        ws->capacity = capacity;
+    }
+    size_t len = strlen(name);
+    walk_node *node = _walk_alloc(ws, sizeof(walk_node) + len + 1);
+    if (!node) {
+        LOG_ERROR("Failed to allocate walk node for %s", name);
+        return -1;
+    }
+    node->parent = parent;
+    node->name_len = (uint32_t)len;
+    node->cached = cached;
+    memcpy(node->name, name, len + 1);
+
+    // Everything allocated after this node belongs to entries above it on the stack
+    walk_item *item = &ws->items[ws->top++];
+    item->node = node;
+    item->chunk = ws->cur;
+    item->mark = ws->cur->used;
+    return 0;
+}
+
+// Write a node's full path into buf; returns its length, or -1 if it doesn't fit
+static int _walk_node_path(const walk_node *node, char *buf, size_t size) {
+    size_t len = node->name_len;
+    for (const walk_node *n = node->parent; n; n = n->parent) len += n->name_len + 1;
+    if (len >= size) return -1;
+    buf[len] = '\0';
+    size_t end = len;
+    for (const walk_node *n = node; n; n = n->parent) {
+        end -= n->name_len;
+        memcpy(buf + end, n->name, n->name_len);
+        if (n->parent) buf[--end] = '/';
+    }
+    return (int)len;
+}
+
+// Append name to the directory path already in buf[0..dir_len); returns -1 if too long
+static int _walk_child_path(char *buf, size_t dir_len, const char *name) {
+    size_t len = strlen(name);
+    if (dir_len + 1 + len >= MAX_PATH) {
+        buf[dir_len] = '\0';
+        LOG_ERROR("Path too long: %s/%s", buf, name);
+        return -1;
+    }
+    buf[dir_len] = '/';
+    memcpy(buf + dir_len + 1, name, len + 1);
+    return 0;
+}
+
+// Stamp every row below an unchanged directory without visiting it (--trust-dir-mtime)
+static int _touch_subtree(sqlite3 *db, const char *path) {
+    char lower[MAX_PATH];
+    char upper[MAX_PATH];
+    int touched = 0;
+    if (_subtree_bounds(path, lower, upper) != 0) return -1;
+
+    // Descendants hash to any shard
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        stmt_cache *cache = _find_stmt_cache(shard);
+        sqlite3_stmt *stmt = _get_stmt(shard, STMT_TOUCH_SUBTREE);
+        if (!stmt) return -1;
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, cache ? cache->scan_gen : 0);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            touched += sqlite3_changes(shard);
+        } else {
+            LOG_ERROR("Failed to stamp entries below %s: %s", path, sqlite3_errmsg(shard));
+            touched = -1;
+        }
+        sqlite3_reset(stmt);
+        if (touched < 0) return -1;
+    }
+    return touched;
+}
+
+// Queue a subdirectory found by the walk; unchanged ones are replayed from the index
+static int _walk_subdir(sqlite3 *db, walk_stack *ws, walk_node *parent, const char *path, const char *name,
+                        const struct stat *st, int unchanged, walk_dir_cb on_dir, void *ctx) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    int cached = unchanged && dir_mtime_mode != DIR_MTIME_OFF &&
+                 cache && (sqlite3_int64)st->st_mtime < cache->dir_trust_before;
+    // The diff map needs every path marked seen, so it can't skip whole subtrees
+    if (cached && dir_mtime_mode == DIR_MTIME_TREE && !(cache && cache->diff_map)) {
+        if (_touch_subtree(db, path) >= 0) return 0;
+    }
+    if (_walk_push(ws, parent, name, cached) != 0) return -1;
+    if (on_dir) on_dir(path, ctx);
+    return 0;
+}
+
+// List an unchanged directory from the index: stamp its files, stat only its subdirectories
+static int _replay_dir(sqlite3 *db, walk_stack *ws, walk_node *node, char *path, size_t dir_len,
+                       walk_dir_cb on_dir, void *ctx) {
+    sqlite3 *shard = _shard_for_dir(db, path);
+    stmt_cache *cache = _find_stmt_cache(shard);
+    sqlite3_int64 dir_id = _resolve_dir_id(shard, path, 0);
+    if (!dir_id) return 0;  // nothing indexed below it: empty
+
+    // Don't write into files while reading it: unchanged files are stamped once the
+    // listing is done, and anything already batched goes out before it starts
+    _flush_shard(shard);
+
+    size_t len = 0;         // subdirectory names, NUL-separated in ws->names, revisited after the listing
+    size_t nids = 0;        // unchanged file ids in ws->ids, touched after the listing
+    int count = 0;
+    int failed = 0;
+    sqlite3_stmt *stmt = _get_stmt(shard, STMT_DIR_CHILDREN);
+    if (!stmt) return -1;
+    sqlite3_bind_int64(stmt, 1, dir_id);
+    while (!failed && sqlite3_step(stmt) == SQLITE_ROW) {
+        sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+        const char *name = (const char *)sqlite3_column_text(stmt, 1);
+        const char *type = (const char *)sqlite3_column_text(stmt, 2);
+        if (type && strcmp(type, "dir") == 0) {
+            size_t n = strlen(name) + 1;
+            if (len + n > ws->names_cap) {
+                size_t cap = ws->names_cap ? ws->names_cap * 2 : 4096;
+                while (cap < len + n) cap *= 2;
+                char *grown = realloc(ws->names, cap);
+                if (!grown) {
+                    LOG_ERROR("Failed to allocate subdirectory list for %s", path);
+                    failed = 1;
+                    break;
+                }
+                ws->names = grown;
+                ws->names_cap = cap;
+            }
+            memcpy(ws->names + len, name, n);
+            len += n;
+            continue;
+        }
+        if (cache && cache->diff_map) {
+            sqlite3_int64 seen_id;
+            if (_walk_child_path(path, dir_len, name) == 0) _lookup_path_map(cache->diff_map, path, &seen_id, NULL);
+        } else {
+            if (nids == ws->ids_cap) {
+                size_t cap = ws->ids_cap ? ws->ids_cap * 2 : 1024;
+                sqlite3_int64 *grown = realloc(ws->ids, cap * sizeof(sqlite3_int64));
+                if (!grown) {
+                    LOG_ERROR("Failed to allocate entry list for %s", path);
+                    failed = 1;
+                    break;
+                }
+                ws->ids = grown;
+                ws->ids_cap = cap;
+            }
+            ws->ids[nids++] = id;
+        }
+        count++;
+    }
+    sqlite3_reset(stmt);
+    // A directory left half-listed must not let the prune drop what was missed
+    if (failed) return -1;
+    for (size_t i = 0; i < nids; i++) _touch_entry(shard, ws->ids[i]);
+
+    int rc = 0;
+    struct stat st;
+    for (size_t off = 0; off < len && rc == 0; off += strlen(ws->names + off) + 1) {
+        const char *name = ws->names + off;
+        if (_walk_child_path(path, dir_len, name) != 0) continue;
+        if (_is_excluded_entry(path, name)) continue;
+        STATS_START(stat_started);
+        int stat_rc = stat(path, &st);
+        STATS_STOP(stat_started, STAT_STAT);
+        if (stat_rc != 0) {
+            LOG_ERROR("Failed to stat %s: %s", path, strerror(errno));
+            continue;
+        }
+        int status = _index_entry(db, path, &st);
+        _maybe_commit(db);
+        count++;
+        if (S_ISDIR(st.st_mode)) rc = _walk_subdir(db, ws, node, path, name, &st, status == 0, on_dir, ctx);
+    }
+    return rc ? -1 : count;
+}
+
+// Walk everything below root into the index; returns entries visited or -1
+int _walk_tree(sqlite3 *db, const char *root, walk_dir_cb on_dir, void *ctx) {
+    walk_stack ws = {0};
+    int total_count = 0;
+    int failed = 0;
+    char path[MAX_PATH];
+    struct stat st;
+    dir_reader *dr = calloc(1, sizeof(dir_reader));
+
+    if (!dr || _walk_push(&ws, NULL, root, 0) != 0) {
+        LOG_ERROR("Failed to allocate memory for root path");
+        free(dr);
+        _walk_stack_free(&ws);
+        return -1;
+    }
+
+    while (ws.top > 0 && !failed) {
+        walk_item current = ws.items[--ws.top];
+        // Entries pushed after this one are done: their arena space is reused by its children
+        ws.cur = current.chunk;
+        ws.cur->used = current.mark;
+
+        int dir_len = _walk_node_path(current.node, path, MAX_PATH);
+        if (dir_len < 0) {
+            LOG_ERROR("Path too long below %s", root);
+            continue;
+        }
+        if (current.node->cached) {
+            int count = _replay_dir(db, &ws, current.node, path, dir_len, on_dir, ctx);
+            if (count < 0) failed = 1;
+            else total_count += count;
+            continue;
+        }
+
+        if (_dir_open(dr, path) != 0) {
+            LOG_ERROR("Failed to open directory %s: %s", path, strerror(errno));
+            continue;
+        }
+        
+        const char *name;
+        while ((name = _dir_next(dr)) && !failed) {
+            if (_walk_child_path(path, dir_len, name) != 0) continue;
+            if (_is_excluded_entry(path, name)) continue;
+            
+            if (_dir_stat(dr, path, &st) == 0) {
+                int status = _index_entry(db, path, &st);
+                _maybe_commit(db);
+                total_count++;
+                
+                if (S_ISDIR(st.st_mode) &&
+                    _walk_subdir(db, &ws, current.node, path, name, &st, status == 0, on_dir, ctx) != 0) {
+                    failed = 1;
+                }
+            } else {
+                LOG_ERROR("Failed to stat %s: %s", path, strerror(errno));
+            }
+        }
+        
+        _dir_close(dr);
+    }
+    
+    _dir_reader_free(dr);
+    free(dr);
+    _walk_stack_free(&ws);
+    return failed ? -1 : total_count;
+}
+
+// Whether outer is inner or one of its ancestors, going by the path strings
+static int _root_covers(const char *outer, const char *inner) {
+    size_t len = strlen(outer);
+    if (strncmp(outer, inner, len) != 0) return 0;
+    return inner[len] == '\0' || inner[len] == '/' || inner[len] == '\\' ||
+           (len > 0 && (outer[len - 1] == '/' || outer[len - 1] == '\\'));
+}
+
+// Add a --root; repeats and roots inside another one are dropped. 1 when MAX_ROOTS is exceeded
+int _add_root(const char *root) {
+    for (int i = 0; i < num_roots; i++) {
+        if (_root_covers(roots[i], root)) {
+            LOG_INFO("Skipping root %s: already below %s", root, roots[i]);
+            return 0;
+        }
+    }
+    // A new root may swallow earlier ones
+    int kept = 0;
+    for (int i = 0; i < num_roots; i++) {
+        if (_root_covers(root, roots[i])) {
+            LOG_INFO("Skipping root %s: already below %s", roots[i], root);
+        } else {
+            roots[kept++] = roots[i];
+        }
+    }
+    num_roots = kept;
+    if (num_roots == MAX_ROOTS) return 1;
+    roots[num_roots++] = root;
+    return 0;
+}
+
+// Remember a root's walk in the main database's roots table
+void _record_root(sqlite3 *db, const char *root, time_t scanned_at, long long duration_ms, long entries) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    sqlite3_stmt *stmt = _get_stmt(db, STMT_RECORD_ROOT);
+    if (!stmt) return;
+    sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, cache ? cache->scan_gen : 0);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)scanned_at);
+    sqlite3_bind_int64(stmt, 4, duration_ms);
+    sqlite3_bind_int64(stmt, 5, entries);
+    if (sqlite3_step(stmt) != SQLITE_DONE) LOG_ERROR("Failed to record root %s: %s", root, sqlite3_errmsg(db));
+    sqlite3_reset(stmt);
+    LOG_INFO("Walked %ld entries below %s in %lld ms", entries, root, duration_ms);
+}
+
+// When root's last walk started, or -1 if the roots table hasn't seen it
+static sqlite3_int64 _root_scanned_at(sqlite3 *db, const char *root) {
+    sqlite3_stmt *stmt = _get_stmt(db, STMT_ROOT_SCANNED);
+    sqlite3_int64 scanned_at = -1;
+    if (!stmt) return scanned_at;
+    sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        scanned_at = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    return scanned_at;
+}
+
+// `windex roots`: every indexed root with its last walk
+int _print_roots(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT path, scan_gen, scanned_at, duration_ms, entries FROM roots ORDER BY path;",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to read roots: %s", sqlite3_errmsg(db));
+        return 1;
+    }
+    int n = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        char when[32] = "?";
+        time_t scanned_at = (time_t)sqlite3_column_int64(stmt, 2);
+        struct tm *tm = localtime(&scanned_at);
+        if (tm) strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", tm);
+        printf("%s\n  last scan: %s (generation %lld), %lld ms, %lld entries\n",
+               (const char *)sqlite3_column_text(stmt, 0), when, (long long)sqlite3_column_int64(stmt, 1),
+               (long long)sqlite3_column_int64(stmt, 3), (long long)sqlite3_column_int64(stmt, 4));
+        n++;
+    }
+    sqlite3_finalize(stmt);
+    if (n == 0) fprintf(stderr, "No roots indexed yet.\n");
+    return 0;
+}
+
+// Iterative indexing with transactions; roots are walked one after another
+void _index_files_dynamic(sqlite3 *db, const char **roots, int nroots) {
+    int bulk = _begin_bulk_load(db);
+    _exec_shards(db, "BEGIN TRANSACTION;");
+    _begin_scan(db);
+
+    // --dir-mtime trusts directories read before the root's own last walk, not anyone's
+    sqlite3_int64 trust_before[MAX_SHARDS] = {0};
+    for (int k = 0; k < _shard_count(db); k++) {
+        stmt_cache *cache = _find_stmt_cache(_shard_db(db, k));
+        if (cache) trust_before[k] = cache->dir_trust_before;
+    }
+
+    int total_count = 0;
+    for (int r = 0; r < nroots; r++) {
+        sqlite3_int64 scanned_at = _root_scanned_at(db, roots[r]);
+        for (int k = 0; k < _shard_count(db); k++) {
+            stmt_cache *cache = _find_stmt_cache(_shard_db(db, k));
+            if (cache) cache->dir_trust_before = scanned_at >= 0 ? scanned_at : trust_before[k];
+        }
+        time_t walk_started = time(NULL);
+        long long started = _now_ms();
+        int count = _walk_tree(db, roots[r], NULL, NULL);
+        if (count < 0) {
+            _exec_shards(db, "ROLLBACK;");
+            if (bulk) _end_bulk_load(db);
+            return;
+        }
+        _record_root(db, roots[r], walk_started, _now_ms() - started, count);
+        total_count += count;
+    }
+
+    _flush_writes(db);
+    _prune_stale_entries(db, roots, nroots);
+    STATS_START(commit_started);
+    _exec_shards(db, "COMMIT;");
+    STATS_STOP(commit_started, STAT_COMMIT);
+    if (bulk) _end_bulk_load(db);
+    LOG_INFO("Indexed %d new or modified entries", total_count);
+    _log_stmt_stats(db);
+    // printf("Indexed %d new or modified entries.\n", total_count);
+}
+
+// Push a directory onto a worker's deque
+static int _deque_push(walk_deque *dq, char *path) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail >= dq->capacity) {
+        if (dq->head > 0) {
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(char *));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        }
+        if (dq->tail >= dq->capacity) {
+            int capacity = dq->capacity ? dq->capacity * 2 : 1000;
+            char **items = realloc(dq->items, capacity * sizeof(char *));
+            if (!items) {
+                pthread_mutex_unlock(&dq->lock);
+                return -1;
+            }
+            dq->items = items;
+            dq->capacity = capacity;
+        }
+    }
+    dq->items[dq->tail++] = path;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// Pop from the owner's end (depth-first, like the serial stack)
+static char *_deque_pop(walk_deque *dq) {
+    char *path = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        path = dq->items[--dq->tail];
+        if (dq->tail == dq->head) dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return path;
+}
+
+// Steal from the opposite end (oldest, usually the largest subtrees)
+static char *_deque_steal(walk_deque *dq) {
+    char *path = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        path = dq->items[dq->head++];
+        if (dq->tail == dq->head) dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return path;
+}
+
+// Queue a discovered directory and wake an idle worker
+static int _pool_push_dir(walk_pool *pool, int id, const char *path) {
+    char *copy = strdup(path);
+    if (!copy) {
+        LOG_ERROR("Failed to allocate memory for path %s", path);
+        return -1;
+    }
+    // Counted before it is published: a thief could finish it before a later increment,
+    // and pending reaching 0 early would let idle workers exit mid-walk
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->pending++;
+    pthread_mutex_unlock(&pool->idle_lock);
+    if (_deque_push(&pool->deques[id], copy) != 0) {
+        LOG_ERROR("Failed to allocate memory for path %s", path);
+        free(copy);
+        pthread_mutex_lock(&pool->idle_lock);
+        if (--pool->pending == 0) pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+        return -1;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->pushes++;
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    return 0;
+}
+
+// Get the next directory: own deque first, then steal; NULL once the walk is done
+static char *_pool_next_dir(walk_pool *pool, int id) {
+    for (;;) {
+        pthread_mutex_lock(&pool->idle_lock);
+        long seen = pool->pushes;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        char *path = _deque_pop(&pool->deques[id]);
+        for (int i = 1; !path && i < pool->nworkers; i++) {
+            path = _deque_steal(&pool->deques[(id + i) % pool->nworkers]);
+        }
+        if (path) return path;
+
+        pthread_mutex_lock(&pool->idle_lock);
+        if (pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->idle_lock);
+            return NULL;
+        }
+        if (pool->pushes == seen) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+// Mark a directory as fully read
+static void _pool_done_dir(walk_pool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    if (--pool->pending == 0) pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// Hand a filled batch to the writer, blocking while the queue is full
+static void _pool_send_batch(walk_pool *pool, walk_batch *batch) {
+    walk_sink *sink = pool->sink;
+    pthread_mutex_lock(&sink->lock);
+    while (sink->len == sink->cap) {
+        pthread_cond_wait(&sink->not_full, &sink->lock);
+    }
+    sink->queue[(sink->head + sink->len) % sink->cap] = batch;
+    sink->len++;
+    pthread_cond_signal(&sink->not_empty);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+// Writer side: next batch from any root, or NULL once every worker has exited
+static walk_batch *_sink_recv_batch(walk_sink *sink) {
+    walk_batch *batch = NULL;
+    pthread_mutex_lock(&sink->lock);
+    while (sink->len == 0 && sink->producers > 0) {
+        pthread_cond_wait(&sink->not_empty, &sink->lock);
+    }
+    if (sink->len > 0) {
+        batch = sink->queue[sink->head];
+        sink->head = (sink->head + 1) % sink->cap;
+        sink->len--;
+        pthread_cond_signal(&sink->not_full);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return batch;
+}
+
+// A worker is done with its pool; the last one out stamps the root's walk time
+static void _pool_worker_exit(walk_pool *pool, long entries) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->entries += entries;
+    if (--pool->running == 0) pool->finished_ms = _now_ms();
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    walk_sink *sink = pool->sink;
+    pthread_mutex_lock(&sink->lock);
+    sink->producers--;
+    pthread_cond_signal(&sink->not_empty);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+// Worker thread: read directories and stat entries, never touches SQLite
+static void *_walk_worker(void *arg) {
+    walk_worker *self = arg;
+    walk_pool *pool = self->pool;
+    walk_batch *batch = calloc(1, sizeof(walk_batch));
+    dir_reader *dr = calloc(1, sizeof(dir_reader));
+    long entries = 0;
+    char *current;
+
+    while ((current = _pool_next_dir(pool, self->id))) {
+        if (!dr || _dir_open(dr, current) != 0) {
+            LOG_ERROR("Failed to open directory %s: %s", current, dr ? strerror(errno) : "out of memory");
+            free(current);
+            _pool_done_dir(pool);
+            continue;
+        }
+
+        const char *name;
+        char path[MAX_PATH];
+        while ((name = _dir_next(dr))) {
+            snprintf(path, MAX_PATH, "%s/%s", current, name);
+            if (_is_excluded_entry(path, name)) continue;
+
+            if (!batch && !(batch = calloc(1, sizeof(walk_batch)))) {
+                LOG_ERROR("Failed to allocate walk batch");
+                break;
+            }
+            struct stat *st = &batch->sts[batch->count];
+            if (_dir_stat(dr, path, st) != 0) {
+                LOG_ERROR("Failed to stat %s: %s", path, strerror(errno));
+                continue;
+            }
+            if (!(batch->paths[batch->count] = strdup(path))) {
+                LOG_ERROR("Failed to allocate memory for path %s", path);
+                continue;
+            }
+            entries++;
+            if (S_ISDIR(st->st_mode)) _pool_push_dir(pool, self->id, path);
+            if (++batch->count == WALK_BATCH_SIZE) {
+                _pool_send_batch(pool, batch);
+                batch = NULL;
+            }
+        }
+
+        _dir_close(dr);
+        free(current);
+        _pool_done_dir(pool);
+    }
+    if (dr) _dir_reader_free(dr);
+    free(dr);
+
+    if (batch && batch->count > 0) {
+        _pool_send_batch(pool, batch);
+    } else {
+        free(batch);
+    }
+    _pool_worker_exit(pool, entries);
+    return NULL;
+}
+
+// Hand a batch to a shard writer, waiting while its queue is full
+static void _shard_writer_send(shard_writer *w, walk_batch *batch) {
+    pthread_mutex_lock(&w->lock);
+    while (w->len == WALK_QUEUE_DEPTH) pthread_cond_wait(&w->not_full, &w->lock);
+    w->queue[(w->head + w->len) % WALK_QUEUE_DEPTH] = batch;
+    w->len++;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Next batch for a shard writer; NULL once it is closed and drained
+static walk_batch *_shard_writer_recv(shard_writer *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->len == 0 && !w->closed) pthread_cond_wait(&w->not_empty, &w->lock);
+    walk_batch *batch = NULL;
+    if (w->len > 0) {
+        batch = w->queue[w->head];
+        w->head = (w->head + 1) % WALK_QUEUE_DEPTH;
+        w->len--;
+        pthread_cond_signal(&w->not_full);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return batch;
+}
+
+// Index every entry routed to one shard, on that shard's own connection
+static void *_shard_writer_main(void *arg) {
+    shard_writer *w = arg;
+    walk_batch *batch;
+    while ((batch = _shard_writer_recv(w))) {
+        for (int i = 0; i < batch->count; i++) {
+            _index_entry(w->db, batch->paths[i], &batch->sts[i]);
+            _maybe_commit_shard(w->db, 0);
+            w->count++;
+            free(batch->paths[i]);
+        }
+        free(batch);
+    }
+    return NULL;
+}
+
+// Split a walker batch by shard; each shard fills its own batch before it is sent
+static void _shard_writers_route(sqlite3 *db, shard_writer *writers, walk_batch *batch) {
+    char dir[MAX_PATH];
+    for (int i = 0; i < batch->count; i++) {
+        _split_path(batch->paths[i], dir, MAX_PATH);
+        shard_writer *w = &writers[_shard_index(db, dir)];
+        if (!w->filling && !(w->filling = calloc(1, sizeof(walk_batch)))) {
+            LOG_ERROR("Failed to allocate shard batch");
+            free(batch->paths[i]);
+            continue;
+        }
+        w->filling->paths[w->filling->count] = batch->paths[i];
+        w->filling->sts[w->filling->count] = batch->sts[i];
+        if (++w->filling->count == WALK_BATCH_SIZE) {
+            _shard_writer_send(w, w->filling);
+            w->filling = NULL;
+        }
+    }
+    free(batch);
+}
+
+// Parallel indexing: each root gets its own pool of `jobs` walker threads, and all of them
+// feed this thread, which owns the DB and transaction
+void _index_files_parallel(sqlite3 *db, const char **roots, int nroots, int jobs) {
+    if (jobs * nroots > MAX_JOBS) {
+        LOG_INFO("%d roots share at most %d walker threads; using --jobs %d per root", nroots, MAX_JOBS, MAX_JOBS / nroots);
+        jobs = MAX_JOBS / nroots;
+    }
+
+    walk_pool *pools = calloc(nroots, sizeof(walk_pool));
+    walk_sink *sink = calloc(1, sizeof(walk_sink));
+    walk_worker workers[MAX_JOBS];
+    pthread_t threads[MAX_JOBS];
+    if (!pools || !sink || !(sink->queue = malloc(jobs * nroots * WALK_QUEUE_DEPTH * sizeof(walk_batch *)))) {
+        LOG_ERROR("Failed to allocate walker pools");
+        free(pools);
+        free(sink);
+        return;
+    }
+    sink->cap = jobs * nroots * WALK_QUEUE_DEPTH;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->not_empty, NULL);
+    pthread_cond_init(&sink->not_full, NULL);
+
+    int started = 0;
+    int failed = 0;
+    const char *walked[MAX_ROOTS];
+    int nwalked = 0;
+    sink->producers = jobs * nroots;
+    for (int r = 0; r < nroots; r++) {
+        walk_pool *pool = &pools[r];
+        pool->nworkers = jobs;
+        pool->root = roots[r];
+        pool->sink = sink;
+        pool->running = jobs;
+        pool->scanned_at = time(NULL);
+        pool->started_ms = _now_ms();
+        pthread_mutex_init(&pool->idle_lock, NULL);
+        pthread_cond_init(&pool->idle_cond, NULL);
+        for (int i = 0; i < jobs; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+        int pool_started = 0;
+        if (!failed && _pool_push_dir(pool, 0, roots[r]) != 0) {
+            LOG_ERROR("Failed to allocate memory for root path");
+            failed = 1;
+        }
+        for (int i = 0; i < jobs && !failed; i++) {
+            walk_worker *w = &workers[started];
+            w->pool = pool;
+            w->id = i;
+            if (pthread_create(&threads[started], NULL, _walk_worker, w) != 0) {
+                LOG_ERROR("Failed to start walker thread %d for %s", i, roots[r]);
+                failed = 1;
+                break;
+            }
+            started++;
+            pool_started++;
+        }
+        if (pool_started < jobs) {
+            // Threads that never started can't decrement producers or running themselves
+            pthread_mutex_lock(&pool->idle_lock);
+            pool->running -= jobs - pool_started;
+            if (pool->running == 0) pool->finished_ms = _now_ms();
+            pthread_mutex_unlock(&pool->idle_lock);
+            pthread_mutex_lock(&sink->lock);
+            sink->producers -= jobs - pool_started;
+            pthread_mutex_unlock(&sink->lock);
+            // Their deques would be stolen from, but with no workers at all nothing runs
+            if (pool_started == 0) {
+                char *path;
+                while ((path = _deque_pop(&pool->deques[0]))) free(path);
+            }
+        }
+        // A root nobody walked keeps its rows: pruning it would empty it
+        if (pool_started > 0) walked[nwalked++] = roots[r];
+    }
+
+    int total_count = 0;
+    walk_batch *batch;
+    int bulk = _begin_bulk_load(db);
+    _exec_shards(db, "BEGIN TRANSACTION;");
+    _begin_scan(db);
+
+    // A sharded index gets one writer thread per shard; otherwise this thread writes
+    int nwriters = _shard_count(db) > 1 ? _shard_count(db) : 0;
+    shard_writer *writers = nwriters ? calloc(nwriters, sizeof(shard_writer)) : NULL;
+    if (nwriters && !writers) {
+        LOG_ERROR("Failed to allocate shard writers; writing from one thread");
+        nwriters = 0;
+    }
+    int writers_started = 0;
+    int writers_inited = 0;
+    for (int k = 0; k < nwriters; k++) {
+        shard_writer *w = &writers[k];
+        w->db = _shard_db(db, k);
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->not_empty, NULL);
+        pthread_cond_init(&w->not_full, NULL);
+        writers_inited++;
+        if (pthread_create(&w->thread, NULL, _shard_writer_main, w) != 0) {
+            LOG_ERROR("Failed to start writer thread for shard %d", k);
+            break;
+        }
+        writers_started++;
+    }
+    if (writers_started < nwriters) {
+        // Can't route to a shard nobody drains: stop the ones that started and write here
+        for (int k = 0; k < writers_started; k++) {
+            pthread_mutex_lock(&writers[k].lock);
+            writers[k].closed = 1;
+            pthread_cond_signal(&writers[k].not_empty);
+            pthread_mutex_unlock(&writers[k].lock);
+            pthread_join(writers[k].thread, NULL);
+        }
+        nwriters = writers_started = 0;
+    }
+
+    while ((batch = _sink_recv_batch(sink))) {
+        if (nwriters) {
+            _shard_writers_route(db, writers, batch);
+            continue;
+        }
+        for (int i = 0; i < batch->count; i++) {
+            _index_entry(db, batch->paths[i], &batch->sts[i]);
+            _maybe_commit(db);
+            total_count++;
+            free(batch->paths[i]);
+        }
+        free(batch);
+    }
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    for (int k = 0; k < nwriters; k++) {
+        shard_writer *w = &writers[k];
+        if (w->filling) _shard_writer_send(w, w->filling);
+        pthread_mutex_lock(&w->lock);
+        w->closed = 1;
+        pthread_cond_signal(&w->not_empty);
+        pthread_mutex_unlock(&w->lock);
+    }
+    for (int k = 0; k < nwriters; k++) {
+        pthread_join(writers[k].thread, NULL);
+        total_count += writers[k].count;
+    }
+    if (writers) {
+        for (int k = 0; k < writers_inited; k++) {
+            pthread_mutex_destroy(&writers[k].lock);
+            pthread_cond_destroy(&writers[k].not_empty);
+            pthread_cond_destroy(&writers[k].not_full);
+        }
+        free(writers);
+    }
+
+    _flush_writes(db);
+    for (int r = 0; r < nroots; r++) {
+        walk_pool *pool = &pools[r];
+        if (pool->finished_ms) _record_root(db, pool->root, pool->scanned_at, pool->finished_ms - pool->started_ms, pool->entries);
+    }
+    _prune_stale_entries(db, walked, nwalked);
+    STATS_START(commit_started);
+    _exec_shards(db, "COMMIT;");
+    STATS_STOP(commit_started, STAT_COMMIT);
+    if (bulk) _end_bulk_load(db);
+    LOG_INFO("Indexed %d new or modified entries with %d walker threads", total_count, started);
+    _log_stmt_stats(db);
+
+    for (int r = 0; r < nroots; r++) {
+        walk_pool *pool = &pools[r];
+        for (int i = 0; i < pool->nworkers; i++) {
+            free(pool->deques[i].items);
+            pthread_mutex_destroy(&pool->deques[i].lock);
+        }
+        pthread_mutex_destroy(&pool->idle_lock);
+        pthread_cond_destroy(&pool->idle_cond);
+    }
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->not_empty);
+    pthread_cond_destroy(&sink->not_full);
+    free(sink->queue);
+    free(sink);
+    free(pools);
+}
+
+// Drop an entry and, if it was a directory, everything indexed below it
+int _remove_entry(sqlite3 *db, const char *path) {
+    char dir[MAX_PATH];
+    char lower[MAX_PATH];
+    char upper[MAX_PATH];
+    const char *name = _split_path(path, dir, MAX_PATH);
+    int deleted = 0;
+
+    // Queued upserts may still name this path; write them first so the delete wins
+    _flush_writes(db);
+
+    sqlite3_stmt *stmt;
+    sqlite3 *shard = _shard_for_dir(db, dir);
+    sqlite3_int64 dir_id = _resolve_dir_id(shard, dir, 0);
+    if (dir_id && (stmt = _get_stmt(shard, STMT_DELETE_ENTRY))) {
+        sqlite3_bind_int64(stmt, 1, dir_id);
+        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            if (sqlite3_changes(shard) > 0) {
+                deleted += sqlite3_changes(shard);
+                _bump_changes(shard);
+            }
+        } else {
+            LOG_ERROR("Failed to delete %s: %s", path, sqlite3_errmsg(shard));
+        }
+        sqlite3_reset(stmt);
+    }
+
+    if (_subtree_bounds(path, lower, upper) != 0) return deleted;
+    for (int k = 0; k < _shard_count(db); k++) {
+        shard = _shard_db(db, k);
+        stmt_cache *cache = _find_stmt_cache(shard);
+        if ((stmt = _get_stmt(shard, STMT_DELETE_SUBTREE))) {
+            sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) == SQLITE_DONE) {
+                if (sqlite3_changes(shard) > 0) {
+                    deleted += sqlite3_changes(shard);
+                    _bump_changes(shard);
+                }
+            } else {
+                LOG_ERROR("Failed to delete entries below %s: %s", path, sqlite3_errmsg(shard));
+            }
+            sqlite3_reset(stmt);
+        }
+        if ((stmt = _get_stmt(shard, STMT_DELETE_SUBTREE_DIRS))) {
+            sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                LOG_ERROR("Failed to delete directories below %s: %s", path, sqlite3_errmsg(shard));
+            }
+            if (sqlite3_changes(shard) > 0 && cache) _clear_dir_cache(cache);
+            sqlite3_reset(stmt);
+        }
+    }
+    if (deleted) LOG_INFO("Removed entry: %s (%d rows)", path, deleted);
+    return deleted;
+}
+
+// Bring one path in line with the filesystem: upsert it if it exists, remove it if not
+int _apply_change(sqlite3 *db, const char *path, int rescan, walk_dir_cb on_dir, void *ctx) {
+    if (_is_excluded(path)) return 0;
+
+    struct stat st;
+    if (stat(path, &st) != 0) return _remove_entry(db, path);
+
+    _index_entry(db, path, &st);
+    int count = 1;
+    if (rescan && S_ISDIR(st.st_mode)) {
+        // Created or moved in: nothing below it has been seen yet
+        if (on_dir) on_dir(path, ctx);
+        int walked = _walk_tree(db, path, on_dir, ctx);
+        if (walked > 0) count += walked;
+    }
+    return count;
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// SIGINT/SIGTERM: finish the current batch or request and exit
+static void _stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Route SIGINT/SIGTERM to _stop_signal without restarting blocking calls, so loops notice
+static void _catch_stop_signals(void) {
+#ifdef _WIN32
+    signal(SIGINT, _stop_signal);
+    signal(SIGTERM, _stop_signal);
+#else
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+#endif
+}
+
+// Queue a changed path, merging repeated events for the same path
+static void _watch_queue_add(watch_queue *q, const char *path, int rescan) {
+    uint64_t hash = _path_hash(path);
+    size_t i = hash & (WATCH_SEEN_SLOTS - 1);
+    while (q->seen[i].hash) {
+        if (q->seen[i].hash == hash) {
+            q->items[q->seen[i].item].rescan |= rescan;
+            return;
+        }
+        i = (i + 1) & (WATCH_SEEN_SLOTS - 1);
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        LOG_ERROR("Failed to allocate memory for path %s", path);
+        return;
+    }
+    q->seen[i].hash = hash;
+    q->seen[i].item = q->count;
+    q->items[q->count].path = copy;
+    q->items[q->count].rescan = rescan;
+    q->count++;
+}
+
+// Apply every queued change in one transaction
+static void _watch_queue_apply(sqlite3 *db, watch_queue *q, walk_dir_cb on_dir, void *ctx) {
+    if (q->count == 0) return;
+    int applied = 0;
+    _exec_shards(db, "BEGIN TRANSACTION;");
+    for (int i = 0; i < q->count; i++) {
+        applied += _apply_change(db, q->items[i].path, q->items[i].rescan, on_dir, ctx);
+        free(q->items[i].path);
+    }
+    _flush_writes(db);
+    _exec_shards(db, "COMMIT;");
+    LOG_INFO("Applied %d changed paths (%d rows)", q->count, applied);
+    q->count = 0;
+    memset(q->seen, 0, sizeof(q->seen));
+}
+
+// Queue a path, applying the batch first when it is full
+static void _watch_queue_push(sqlite3 *db, watch_queue *q, const char *path, int rescan,
+                              walk_dir_cb on_dir, void *ctx) {
+    if (q->count == WATCH_MAX_PENDING) _watch_queue_apply(db, q, on_dir, ctx);
+    _watch_queue_add(q, path, rescan);
+}
+
+// Make sure root has been indexed and pick up the generation rows are stamped with
+static int _watch_prepare(sqlite3 *db, const char *root) {
+    if (!_resolve_dir_id(_shard_for_dir(db, root), root, 0)) {
+        LOG_INFO("No index for %s yet; running a full index first", root);
+        _index_files_dynamic(db, &root, 1);
+    }
+    for (int k = 0; k < _shard_count(db); k++) {
+        stmt_cache *cache = _find_stmt_cache(_shard_db(db, k));
+        if (cache) cache->scan_gen = _get_meta_int(_shard_db(db, k), "scan_gen", 0);
+    }
+    _catch_stop_signals();
+    return 0;
+}
+
+#if defined(WINDEX_HAVE_INOTIFY)
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// Subscribe to a directory; re-adding a known inode just refreshes its path
+static void _inotify_add_dir(const char *path, void *ctx) {
+    inotify_set *set = ctx;
+    if (_is_excluded(path)) return;
+    int wd = inotify_add_watch(set->fd, path, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            if (!set->full) LOG_ERROR("Out of inotify watches at %s; raise fs.inotify.max_user_watches", path);
+            set->full = 1;
+        } else if (errno != ENOENT) {
+            LOG_ERROR("Failed to watch %s: %s", path, strerror(errno));
+        }
+        return;
+    }
+    if (wd >= set->capacity) {
+        int capacity = set->capacity ? set->capacity : 1024;
+        while (capacity <= wd) capacity *= 2;
+        char **paths = realloc(set->paths, capacity * sizeof(char *));
+        if (!paths) {
+            LOG_ERROR("Failed to grow watch table");
+            inotify_rm_watch(set->fd, wd);
+            return;
+        }
+        memset(paths + set->capacity, 0, (capacity - set->capacity) * sizeof(char *));
+        set->paths = paths;
+        set->capacity = capacity;
+    }
+    free(set->paths[wd]);
+    set->paths[wd] = strdup(path);
+}
+
+// Subscribe to root and every directory the index already knows below it
+static int _inotify_seed(sqlite3 *db, inotify_set *set, const char *root) {
+    char lower[MAX_PATH], upper[MAX_PATH];
+    char path[MAX_PATH];
+    if (_subtree_bounds(root, lower, upper) != 0) {
+        LOG_ERROR("Cannot compute watch range for root %s", root);
+        return 1;
+    }
+    _inotify_add_dir(root, set);
+
+    const char *sql = "SELECT d.path, f.name FROM files f JOIN dirs d ON d.id = f.dir_id "
+                      "WHERE f.type = 'dir' AND (d.path = ?1 OR (d.path >= ?2 AND d.path < ?3));";
+    int watched = 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(shard, sql, -1, &stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare watch seed statement: %s", sqlite3_errmsg(shard));
+            return 1;
+        }
+        sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, lower, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, upper, -1, SQLITE_STATIC);
+        while (sqlite3_step(stmt) == SQLITE_ROW && !set->full) {
+            snprintf(path, MAX_PATH, "%s/%s", (const char *)sqlite3_column_text(stmt, 0),
+                     (const char *)sqlite3_column_text(stmt, 1));
+            _inotify_add_dir(path, set);
+            watched++;
+        }
+        sqlite3_finalize(stmt);
+    }
+    LOG_INFO("Watching %d directories below %s", watched + 1, root);
+    return 0;
+}
+
+// Watch root with inotify and keep the index in step with it
+int _watch_files(sqlite3 *db, const char *root) {
+    inotify_set set = {0};
+    watch_queue *q = calloc(1, sizeof(watch_queue));
+    if (!q) {
+        LOG_ERROR("Failed to allocate watch queue");
+        return 1;
+    }
+    set.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (set.fd < 0) {
+        LOG_ERROR("Failed to initialize inotify: %s", strerror(errno));
+        free(q);
+        return 1;
+    }
+    _watch_prepare(db, root);
+    if (_inotify_seed(db, &set, root) != 0) {
+        close(set.fd);
+        free(q);
+        return 1;
+    }
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[MAX_PATH];
+    struct pollfd pfd = { set.fd, POLLIN, 0 };
+    while (!stop_requested) {
+        int ready = poll(&pfd, 1, q->count ? WATCH_SETTLE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("poll failed: %s", strerror(errno));
+            break;
+        }
+        if (ready == 0) {
+            // Quiet for a moment: the burst is over
+            _watch_queue_apply(db, q, _inotify_add_dir, &set);
+            continue;
+        }
+
+        ssize_t len;
+        while ((len = read(set.fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len;) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    LOG_ERROR("inotify queue overflowed; re-indexing %s", root);
+                    _watch_queue_apply(db, q, _inotify_add_dir, &set);
+                    _index_files_dynamic(db, &root, 1);
+                    _inotify_seed(db, &set, root);
+                    continue;
+                }
+                if (ev->wd < 0 || ev->wd >= set.capacity || !set.paths[ev->wd]) continue;
+                if (ev->mask & IN_IGNORED) {
+                    free(set.paths[ev->wd]);
+                    set.paths[ev->wd] = NULL;
+                    continue;
+                }
+                if (ev->mask & IN_MOVE_SELF) {
+                    // Its path is stale now; the new parent's IN_MOVED_TO subscribes it again
+                    inotify_rm_watch(set.fd, ev->wd);
+                    continue;
+                }
+                if (ev->len == 0) continue;
+
+                snprintf(path, MAX_PATH, "%s/%s", set.paths[ev->wd], ev->name);
+                int rescan = (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO));
+                _watch_queue_push(db, q, path, rescan, _inotify_add_dir, &set);
+            }
+        }
+        if (len < 0 && errno != EAGAIN && errno != EINTR) {
+            LOG_ERROR("Failed to read inotify events: %s", strerror(errno));
+            break;
+        }
+    }
+
+    _watch_queue_apply(db, q, _inotify_add_dir, &set);
+    close(set.fd);
+    for (int i = 0; i < set.capacity; i++) free(set.paths[i]);
+    free(set.paths);
+    free(q);
+    LOG_INFO("Stopped watching %s", root);
+    return 0;
+}
+
+#elif defined(_WIN32)
+
+#define WATCH_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | \
+                      FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+// Watch root with ReadDirectoryChangesW (one recursive handle) and keep the index in step with it
+int _watch_files(sqlite3 *db, const char *root) {
+    wchar_t wroot[MAX_PATH];
+    if (!MultiByteToWideChar(CP_UTF8, 0, root, -1, wroot, MAX_PATH)) {
+        LOG_ERROR("Invalid root path %s", root);
+        return 1;
+    }
+    HANDLE dir = CreateFileW(wroot, FILE_LIST_DIRECTORY,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                             FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (dir == INVALID_HANDLE_VALUE) {
+        LOG_ERROR("Failed to open %s for watching: error %lu", root, GetLastError());
+        return 1;
+    }
+    watch_queue *q = calloc(1, sizeof(watch_queue));
+    OVERLAPPED ov = {0};
+    ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!q || !ov.hEvent) {
+        LOG_ERROR("Failed to set up watch for %s", root);
+        if (ov.hEvent) CloseHandle(ov.hEvent);
+        CloseHandle(dir);
+        free(q);
+        return 1;
+    }
+    _watch_prepare(db, root);
+    LOG_INFO("Watching %s", root);
+
+    static DWORD buf[16 * 1024];    // DWORD-aligned, as the API requires
+    char rel[MAX_PATH];
+    char path[MAX_PATH];
+    int pending_read = 0;
+    while (!stop_requested) {
+        if (!pending_read) {
+            ResetEvent(ov.hEvent);
+            if (!ReadDirectoryChangesW(dir, buf, sizeof(buf), TRUE, WATCH_FILTER, NULL, &ov, NULL)) {
+                LOG_ERROR("ReadDirectoryChangesW failed: error %lu", GetLastError());
+                break;
+            }
+            pending_read = 1;
+        }
+        // Wake periodically so Ctrl+C is noticed even when nothing changes
+        DWORD wait = WaitForSingleObject(ov.hEvent, q->count ? WATCH_SETTLE_MS : 1000);
+        if (wait == WAIT_TIMEOUT) {
+            _watch_queue_apply(db, q, NULL, NULL);
+            continue;
+        }
+        pending_read = 0;
+        DWORD len = 0;
+        if (!GetOverlappedResult(dir, &ov, &len, FALSE)) {
+            LOG_ERROR("Failed to read change notifications: error %lu", GetLastError());
+            break;
+        }
+        if (len == 0) {
+            // The kernel buffer overflowed and the changes are lost
+            LOG_ERROR("Change notifications overflowed; re-indexing %s", root);
+            _watch_queue_apply(db, q, NULL, NULL);
+            _index_files_dynamic(db, &root, 1);
+            continue;
+        }
+
+        for (FILE_NOTIFY_INFORMATION *fni = (FILE_NOTIFY_INFORMATION *)buf;;
+             fni = (FILE_NOTIFY_INFORMATION *)((char *)fni + fni->NextEntryOffset)) {
+            int n = WideCharToMultiByte(CP_UTF8, 0, fni->FileName, fni->FileNameLength / sizeof(WCHAR),
+                                        rel, MAX_PATH - 1, NULL, NULL);
+            if (n > 0) {
+                rel[n] = '\0';
+                for (char *c = rel; *c; c++) if (*c == '\\') *c = '/';
+                snprintf(path, MAX_PATH, "%s/%s", root, rel);
+                int rescan = fni->Action == FILE_ACTION_ADDED || fni->Action == FILE_ACTION_RENAMED_NEW_NAME;
+                _watch_queue_push(db, q, path, rescan, NULL, NULL);
+            }
+            if (!fni->NextEntryOffset) break;
+        }
+    }
+
+    if (pending_read) {
+        CancelIo(dir);
+        GetOverlappedResult(dir, &ov, &(DWORD){0}, TRUE);
+    }
+    _watch_queue_apply(db, q, NULL, NULL);
+    CloseHandle(ov.hEvent);
+    CloseHandle(dir);
+    free(q);
+    LOG_INFO("Stopped watching %s", root);
+    return 0;
+}
+
+#else
+
+int _watch_files(sqlite3 *db, const char *root) {
+    (void)db;
+    LOG_ERROR("watch is not supported on this platform; rerun index to refresh %s", root);
+    return 1;
+}
+
+#endif
+
+// Convert string to lowercase
+char *_to_lower(const char *str) {
+    size_t size = strlen(str) + 1;
+    char *lower = malloc(size);
+    if (!lower) {
+        LOG_ERROR("Failed to allocate memory for lowercase pattern");
+        return NULL;
+    }
+    _lower_copy(lower, str, size);
+    return lower;
+}
+
+// Count UTF-8 characters (the trigram tokenizer works on characters, not bytes)
+static size_t _utf8_len(const char *str) {
+    size_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if ((*p & 0xC0) != 0x80) n++;
+    }
+    return n;
+}
+
+// Sidecar file holding a connection's name index
+static int _name_index_path(sqlite3 *db, char *path, size_t size) {
+    const char *file = sqlite3_db_filename(db, "main");
+    if (!file || !*file) return 1;
+    return snprintf(path, size, "%s.names", file) >= (int)size;
+}
+
+static const char *name_sort_text;  // suffix comparisons read from here while building
+
+static int _name_suffix_cmp(const void *a, const void *b) {
+    return strcmp(name_sort_text + *(const uint32_t *)a, name_sort_text + *(const uint32_t *)b);
+}
+
+// Replace path with tmp, even where rename() won't overwrite
+static int _replace_file(const char *tmp, const char *path) {
+#ifdef _WIN32
+    return MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING) ? 0 : 1;
+#else
+    return rename(tmp, path);
+#endif
+}
+
+static int _write_section(FILE *out, const void *data, size_t len) {
+    static const char pad[8] = {0};
+    if (len && fwrite(data, 1, len, out) != len) return 1;
+    size_t rem = len % 8;
+    return rem && fwrite(pad, 1, 8 - rem, out) != 8 - rem;
+}
+
+// Write a suffix array over one connection's names to path
+static int _write_name_index(sqlite3 *db, const char *path) {
+    long long started = _now_ms();
+    // One read transaction so the change counter matches the rows read
+    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+    name_index_header header = {0};
+    memcpy(header.magic, NAME_INDEX_MAGIC, sizeof(header.magic));
+    header.changes = (uint64_t)_get_meta_int(db, "changes", 0);
+    sqlite3_int64 rows = _pragma_int(db, "SELECT count(*) FROM files;");
+    sqlite3_int64 bytes = _pragma_int(db, "SELECT total(length(CAST(name_lc AS BLOB)) + 1) FROM files;");
+    if (rows < 0 || bytes < 0 || bytes > (sqlite3_int64)UINT32_MAX) {
+        LOG_ERROR("Too many names for the name index (%lld bytes)", (long long)bytes);
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+        return 1;
+    }
+
+    int64_t *ids = malloc((rows + 1) * sizeof(int64_t));
+    int64_t *mtimes = malloc((rows + 1) * sizeof(int64_t));
+    uint32_t *starts = malloc((rows + 1) * sizeof(uint32_t));
+    char *text = malloc(bytes + 1);
+    uint32_t *sa = malloc((bytes + 1) * sizeof(uint32_t));
+    uint32_t *sorted = malloc((bytes + 1) * sizeof(uint32_t));
+    size_t *buckets = calloc(65537, sizeof(size_t));
+    int rc = 1;
+    sqlite3_stmt *stmt = NULL;
+    if (!ids || !mtimes || !starts || !text || !sa || !sorted || !buckets) {
+        LOG_ERROR("Failed to allocate name index for %lld names", (long long)rows);
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+        goto done;
+    }
+
+    // Names back to back, each NUL-terminated; a suffix starts at every other byte
+    if (sqlite3_prepare_v2(db, "SELECT id, name_lc, mtime FROM files;", -1, &stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to read names: %s", sqlite3_errmsg(db));
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+        goto done;
+    }
+    size_t len = 0;
+    size_t nsuffixes = 0;
+    while (header.nrows < (uint64_t)rows && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 1);
+        size_t n = name ? strlen(name) : 0;
+        if (len + n + 1 > (size_t)bytes) break;
+        ids[header.nrows] = sqlite3_column_int64(stmt, 0);
+        mtimes[header.nrows] = sqlite3_column_int64(stmt, 2);
+        starts[header.nrows] = (uint32_t)len;
+        header.nrows++;
+        for (size_t i = 0; i < n; i++) sa[nsuffixes++] = (uint32_t)(len + i);
+        memcpy(text + len, name ? name : "", n + 1);
+        len += n + 1;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    header.text_len = len;
+    header.nsuffixes = nsuffixes;
+
+    // Bucket by the first two bytes, then sort each bucket
+    for (size_t i = 0; i < nsuffixes; i++) {
+        const unsigned char *p = (const unsigned char *)text + sa[i];
+        buckets[((size_t)p[0] << 8 | (p[0] ? p[1] : 0)) + 1]++;
+    }
+    for (size_t b = 1; b <= 65536; b++) buckets[b] += buckets[b - 1];
+    for (size_t i = 0; i < nsuffixes; i++) {
+        const unsigned char *p = (const unsigned char *)text + sa[i];
+        sorted[buckets[(size_t)p[0] << 8 | (p[0] ? p[1] : 0)]++] = sa[i];
+    }
+    name_sort_text = text;
+    for (size_t b = 0, lo = 0; b < 65536; b++) {
+        // buckets[b] now ends bucket b
+        size_t hi = buckets[b];
+        if (hi - lo > 1) qsort(sorted + lo, hi - lo, sizeof(uint32_t), _name_suffix_cmp);
+        lo = hi;
+    }
+    name_sort_text = NULL;
+
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        LOG_ERROR("Failed to create %s: %s", path, strerror(errno));
+        goto done;
+    }
+    int failed = _write_section(out, &header, sizeof(header)) ||
+                 _write_section(out, ids, header.nrows * sizeof(int64_t)) ||
+                 _write_section(out, mtimes, header.nrows * sizeof(int64_t)) ||
+                 _write_section(out, starts, header.nrows * sizeof(uint32_t)) ||
+                 _write_section(out, text, header.text_len) ||
+                 _write_section(out, sorted, header.nsuffixes * sizeof(uint32_t));
+    if (fclose(out) != 0) failed = 1;
+    if (failed) {
+        LOG_ERROR("Failed to write name index %s", path);
+        remove(path);
+        goto done;
+    }
+    LOG_INFO("Built name index %s: %llu names, %llu suffixes in %lld ms", path,
+             (unsigned long long)header.nrows, (unsigned long long)header.nsuffixes, _now_ms() - started);
+    rc = 0;
+
+done:
+    free(ids);
+    free(mtimes);
+    free(starts);
+    free(text);
+    free(sa);
+    free(sorted);
+    free(buckets);
+    return rc;
+}
+
+// Rebuild one connection's name index and swap it in
+int _build_name_index(sqlite3 *db) {
+    char path[MAX_PATH];
+    char tmp[MAX_PATH + 8];
+    if (_name_index_path(db, path, sizeof(path)) != 0) return 1;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (_write_name_index(db, tmp) != 0) return 1;
+    _unload_name_index(db);
+    if (_replace_file(tmp, path) != 0) {
+        LOG_ERROR("Failed to replace name index %s", path);
+        remove(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+// Rebuild the name index of every shard
+int _build_name_indexes(sqlite3 *db) {
+    int rc = 0;
+    for (int k = 0; k < _shard_count(db); k++) rc |= _build_name_index(_shard_db(db, k));
+    return rc;
+}
+
+// Does db have a name index sidecar at all (fresh or not)?
+int _has_name_index(sqlite3 *db) {
+    char path[MAX_PATH];
+    return _name_index_path(db, path, sizeof(path)) == 0 && access(path, F_OK) == 0;
+}
+
+// Unmap a connection's name index so the next search maps the current file
+void _unload_name_index(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache || !cache->names) return;
+    name_index *ni = cache->names;
+#ifdef _WIN32
+    UnmapViewOfFile(ni->map);
+    CloseHandle(ni->mapping);
+#else
+    munmap(ni->map, ni->map_len);
+#endif
+    free(ni);
+    cache->names = NULL;
+}
+
+// Map a name index file and check its layout
+static name_index *_map_name_index(const char *path) {
+    name_index *ni = calloc(1, sizeof(name_index));
+    if (!ni) return NULL;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE) {
+        free(ni);
+        return NULL;
+    }
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < (LONGLONG)sizeof(name_index_header) ||
+        !(ni->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL)) ||
+        !(ni->map = MapViewOfFile(ni->mapping, FILE_MAP_READ, 0, 0, 0))) {
+        if (ni->mapping) CloseHandle(ni->mapping);
+        CloseHandle(file);
+        free(ni);
+        return NULL;
+    }
+    CloseHandle(file);
+    ni->map_len = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        free(ni);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(name_index_header) ||
+        (ni->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        free(ni);
+        return NULL;
+    }
+    close(fd);
+    ni->map_len = (size_t)st.st_size;
+#endif
+
+    // Sections follow the header in file order, each padded to 8 bytes
+    const name_index_header *h = ni->map;
+    size_t off = (sizeof(*h) + 7) & ~(size_t)7;
+    size_t sizes[5] = { h->nrows * sizeof(int64_t), h->nrows * sizeof(int64_t), h->nrows * sizeof(uint32_t),
+                        h->text_len, h->nsuffixes * sizeof(uint32_t) };
+    size_t offsets[5];
+    int valid = memcmp(h->magic, NAME_INDEX_MAGIC, sizeof(h->magic)) == 0;
+    for (int i = 0; i < 5 && valid; i++) {
+        offsets[i] = off;
+        off += (sizes[i] + 7) & ~(size_t)7;
+        valid = off <= ni->map_len;
+    }
+    if (!valid) {
+        LOG_ERROR("Name index %s is corrupt; it will be rebuilt by the next index run", path);
+        ni->header = NULL;
+        return ni;  // caller unmaps via _unload_name_index
+    }
+    const char *base = ni->map;
+    ni->header = h;
+    ni->ids = (const int64_t *)(base + offsets[0]);
+    ni->mtimes = (const int64_t *)(base + offsets[1]);
+    ni->starts = (const uint32_t *)(base + offsets[2]);
+    ni->text = base + offsets[3];
+    ni->sa = (const uint32_t *)(base + offsets[4]);
+    return ni;
+}
+
+// The connection's name index if it matches the current contents, else NULL
+static name_index *_get_name_index(sqlite3 *db) {
+    stmt_cache *cache = _find_stmt_cache(db);
+    if (!cache) return NULL;
+    if (!cache->names) {
+        char path[MAX_PATH];
+        if (_name_index_path(db, path, sizeof(path)) != 0 || !(cache->names = _map_name_index(path))) return NULL;
+        if (!cache->names->header) {
+            _unload_name_index(db);
+            return NULL;
+        }
+    }
+    if (cache->names->header->changes != (uint64_t)_get_meta_int(db, "changes", 0)) return NULL;
+    return cache->names;
+}
+
+// Row whose name contains text position pos
+static size_t _name_index_row(const name_index *ni, uint32_t pos) {
+    size_t lo = 0;
+    size_t hi = ni->header->nrows;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ni->starts[mid] <= pos) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Does row a rank before row b? The name index only knows mtimes and names
+static int _name_row_before(const name_index *ni, size_t a, size_t b, int sort) {
+    if (sort == SORT_NAME) {
+        int cmp = strcmp(ni->text + ni->starts[a], ni->text + ni->starts[b]);
+        return cmp != 0 ? cmp < 0 : ni->ids[a] < ni->ids[b];
+    }
+    return ni->mtimes[a] != ni->mtimes[b] ? ni->mtimes[a] > ni->mtimes[b] : ni->ids[a] < ni->ids[b];
+}
+
+// Restore the heap (worst row on top) below slot i
+static void _name_heap_down(const name_index *ni, size_t *heap, int n, int i, int sort) {
+    for (;;) {
+        int worst = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < n && _name_row_before(ni, heap[worst], heap[l], sort)) worst = l;
+        if (r < n && _name_row_before(ni, heap[worst], heap[r], sort)) worst = r;
+        if (worst == i) return;
+        size_t tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+// Keep the task's best limit rows in a heap with the worst on top
+static void _name_heap_push(const name_index *ni, const search_task *task, size_t *heap, int *n, size_t row) {
+    if (*n == task->limit) {
+        if (!_name_row_before(ni, row, heap[0], task->sort)) return;
+        heap[0] = row;
+        _name_heap_down(ni, heap, *n, 0, task->sort);
+        return;
+    }
+    int i = (*n)++;
+    while (i > 0 && _name_row_before(ni, heap[(i - 1) / 2], row, task->sort)) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = row;
+}
+
+// Case-insensitive substring scan. The needle is already lowercase; a haystack byte matches
+// a needle letter if OR-ing in 0x20 gives the letter, and any other byte only if equal.
+static inline uint8_t _fold_mask(unsigned char c) {
+    return c >= 'a' && c <= 'z' ? 0x20 : 0;
+}
+
+static int _ci_equal(const char *hay, const char *needle, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)needle[i];
+        if (((unsigned char)hay[i] | _fold_mask(c)) != c) return 0;
+    }
+    return 1;
+}
+
+static const char *_find_ci_scalar(const char *hay, size_t len, const char *needle, size_t nlen) {
+    unsigned char first = (unsigned char)needle[0];
+    uint8_t mask = _fold_mask(first);
+    for (size_t i = 0; i + nlen <= len; i++) {
+        if (((unsigned char)hay[i] | mask) == first && _ci_equal(hay + i + 1, needle + 1, nlen - 1)) return hay + i;
+    }
+    return NULL;
+}
+
+// Vector kernels compare the needle's first and last bytes at every position of a block,
+// then verify the candidates those two agree on
+
+#ifdef WINDEX_HAVE_SSE2
+static const char *_find_ci_sse2(const char *hay, size_t len, const char *needle, size_t nlen) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+    const __m128i first_fold = _mm_set1_epi8((char)_fold_mask((unsigned char)needle[0]));
+    const __m128i last_fold = _mm_set1_epi8((char)_fold_mask((unsigned char)needle[nlen - 1]));
+    size_t i = 0;
+    for (; i + nlen - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i)), first_fold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i + nlen - 1)), last_fold);
+        unsigned bits = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (bits) {
+            int k = __builtin_ctz(bits);
+            if (_ci_equal(hay + i + k + 1, needle + 1, nlen > 2 ? nlen - 2 : 0)) return hay + i + k;
+            bits &= bits - 1;
+        }
+    }
+    return _find_ci_scalar(hay + i, len - i, needle, nlen);
+}
+#endif
+
+#ifdef WINDEX_HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *_find_ci_avx2(const char *hay, size_t len, const char *needle, size_t nlen) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+    const __m256i first_fold = _mm256_set1_epi8((char)_fold_mask((unsigned char)needle[0]));
+    const __m256i last_fold = _mm256_set1_epi8((char)_fold_mask((unsigned char)needle[nlen - 1]));
+    size_t i = 0;
+    for (; i + nlen - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i)), first_fold);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1)), last_fold);
+        unsigned bits = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                        _mm256_cmpeq_epi8(b, last)));
+        while (bits) {
+            int k = __builtin_ctz(bits);
+            if (_ci_equal(hay + i + k + 1, needle + 1, nlen > 2 ? nlen - 2 : 0)) return hay + i + k;
+            bits &= bits - 1;
+        }
+    }
+    return _find_ci_scalar(hay + i, len - i, needle, nlen);
+}
+#endif
+
+#ifdef WINDEX_HAVE_NEON
+static const char *_find_ci_neon(const char *hay, size_t len, const char *needle, size_t nlen) {
+    const uint8x16_t first = vdupq_n_u8((uint8_t)needle[0]);
+    const uint8x16_t last = vdupq_n_u8((uint8_t)needle[nlen - 1]);
+    const uint8x16_t first_fold = vdupq_n_u8(_fold_mask((unsigned char)needle[0]));
+    const uint8x16_t last_fold = vdupq_n_u8(_fold_mask((unsigned char)needle[nlen - 1]));
+    size_t i = 0;
+    for (; i + nlen - 1 + 16 <= len; i += 16) {
+        uint8x16_t a = vorrq_u8(vld1q_u8((const uint8_t *)hay + i), first_fold);
+        uint8x16_t b = vorrq_u8(vld1q_u8((const uint8_t *)hay + i + nlen - 1), last_fold);
+        uint8x16_t eq = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+        // No movemask on NEON: narrowing by 4 leaves one nibble per byte
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (bits) {
+            int k = __builtin_ctzll(bits) / 4;
+            if (_ci_equal(hay + i + k + 1, needle + 1, nlen > 2 ? nlen - 2 : 0)) return hay + i + k;
+            bits &= ~(0xfULL << (k * 4));
+        }
+    }
+    return _find_ci_scalar(hay + i, len - i, needle, nlen);
+}
+#endif
+
+static find_ci_fn find_ci_kernel = _find_ci_scalar;
+static const char *find_ci_kernel_name = "scalar";
+static pthread_once_t find_ci_once = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernel this CPU runs
+static void _find_ci_select(void) {
+#ifdef WINDEX_HAVE_SSE2
+    find_ci_kernel = _find_ci_sse2;
+    find_ci_kernel_name = "sse2";
+#endif
+#ifdef WINDEX_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_ci_kernel = _find_ci_avx2;
+        find_ci_kernel_name = "avx2";
+    }
+#endif
+#ifdef WINDEX_HAVE_NEON
+    find_ci_kernel = _find_ci_neon;
+    find_ci_kernel_name = "neon";
+#endif
+    LOG_INFO("Using %s substring scanner", find_ci_kernel_name);
+}
+
+// First case-insensitive occurrence of a lowercase needle in hay[0..len), or NULL
+const char *_find_ci(const char *hay, size_t len, const char *needle, size_t nlen) {
+    pthread_once(&find_ci_once, _find_ci_select);
+    if (nlen == 0) return hay;
+    if (nlen > len) return NULL;
+    return find_ci_kernel(hay, len, needle, nlen);
+}
+
+// Push every row whose name contains pat by scanning the packed names front to back
+static void _scan_names(const name_index *ni, const search_task *task, size_t m, size_t *heap, int *n) {
+    const char *text = ni->text;
+    const char *end = text + ni->header->text_len;
+    const char *p = text;
+    const char *hit;
+    while (p < end && (hit = _find_ci(p, (size_t)(end - p), task->names_pattern, m))) {
+        size_t row = _name_index_row(ni, (uint32_t)(hit - text));
+        if (!task->names_prefix || ni->starts[row] == (uint32_t)(hit - text)) _name_heap_push(ni, task, heap, n, row);
+        // Names never contain the NUL between them, so the next match is in a later row
+        p = row + 1 < ni->header->nrows ? text + ni->starts[row + 1] : end;
+    }
+}
+
+// ASCII case-insensitive compare, matching how name_lc is folded
+static int _ci_cmp(const char *a, const char *b) {
+    for (;; a++, b++) {
+        int ca = tolower((unsigned char)*a);
+        int cb = tolower((unsigned char)*b);
+        if (ca != cb || !ca) return ca - cb;
+    }
+}
+
+// Does hit a rank before hit b under --sort? Ties go to the older row, as in the name index
+static int _hit_before(const search_hit *a, const search_hit *b, int sort) {
+    if (sort == SORT_SIZE && a->size != b->size) return a->size > b->size;
+    if (sort == SORT_MTIME && a->mtime != b->mtime) return a->mtime > b->mtime;
+    if (sort == SORT_SCORE) {
+        // Equal scores: the shorter path is the closer match, then the newer entry
+        if (a->score != b->score) return a->score > b->score;
+        size_t la = strlen(a->path);
+        size_t lb = strlen(b->path);
+        if (la != lb) return la < lb;
+        if (a->mtime != b->mtime) return a->mtime > b->mtime;
+    }
+    if (sort == SORT_NAME) {
+        const char *na = strrchr(a->path, '/');
+        const char *nb = strrchr(b->path, '/');
+        int cmp = _ci_cmp(na ? na + 1 : a->path, nb ? nb + 1 : b->path);
+        if (cmp != 0) return cmp < 0;
+    }
+    if (a->id != b->id) return a->id < b->id;
+    return strcmp(a->path, b->path) < 0;     // same id in two shards
+}
+
+// Restore the heap of hits (worst on top) below slot i
+static void _hit_heap_down(search_hit *hits, int n, int i, int sort) {
+    for (;;) {
+        int worst = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < n && _hit_before(&hits[worst], &hits[l], sort)) worst = l;
+        if (r < n && _hit_before(&hits[worst], &hits[r], sort)) worst = r;
+        if (worst == i) return;
+        search_hit tmp = hits[i];
+        hits[i] = hits[worst];
+        hits[worst] = tmp;
+        i = worst;
+    }
+}
+
+// Sort hits best first (heap sort: no allocation, bounded by --limit)
+static void _hit_sort(search_hit *hits, int n, int sort) {
+    for (int i = n / 2 - 1; i >= 0; i--) _hit_heap_down(hits, n, i, sort);
+    for (int end = n - 1; end > 0; end--) {
+        search_hit tmp = hits[0];
+        hits[0] = hits[end];
+        hits[end] = tmp;
+        _hit_heap_down(hits, end, 0, sort);
+    }
+}
+
+// Answer a name search from the suffix array, then fetch the winners' metadata
+static int _search_names(search_task *task, const name_index *ni) {
+    const char *pat = task->names_pattern;
+    size_t m = strlen(pat);
+    size_t lo = 0;
+    size_t hi = ni->header->nsuffixes;
+    // First suffix >= pat, then first suffix not starting with pat
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(ni->text + ni->sa[mid], pat, m) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    size_t first = lo;
+    hi = ni->header->nsuffixes;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(ni->text + ni->sa[mid], pat, m) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    size_t *heap = malloc(task->limit * sizeof(size_t));
+    int n = 0;
+    if (!heap) return 1;
+    if ((lo - first) * NAME_SCAN_RATIO > ni->header->text_len) {
+        // Common pattern: one sequential pass beats a random lookup per occurrence
+        _scan_names(ni, task, m, heap, &n);
+    } else {
+        uint8_t *seen = calloc(ni->header->nrows / 8 + 1, 1);
+        if (!seen) {
+            free(heap);
+            return 1;
+        }
+        for (size_t i = first; i < lo; i++) {
+            size_t row = _name_index_row(ni, ni->sa[i]);
+            if (task->names_prefix && ni->starts[row] != ni->sa[i]) continue;
+            if (seen[row / 8] & (1 << (row % 8))) continue;     // pattern occurs twice in one name
+            seen[row / 8] |= (uint8_t)(1 << (row % 8));
+            _name_heap_push(ni, task, heap, &n, row);
+        }
+        free(seen);
+    }
+
+    // Pop the worst to the back until the heap is sorted best first
+    for (int end = n - 1; end > 0; end--) {
+        size_t tmp = heap[0];
+        heap[0] = heap[end];
+        heap[end] = tmp;
+        _name_heap_down(ni, heap, end, 0, task->sort);
+    }
+    for (int i = 0; i < n; i++) {
+        sqlite3_stmt *stmt = _get_stmt(task->db, STMT_SEARCH_ID);
+        if (!stmt) break;
+        sqlite3_bind_int64(stmt, 1, ni->ids[heap[i]]);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            search_hit *hit = &task->hits[task->count];
+            const char *type = (const char *)sqlite3_column_text(stmt, 1);
+            if ((hit->path = strdup((const char *)sqlite3_column_text(stmt, 0)))) {
+                snprintf(hit->type, sizeof(hit->type), "%s", type ? type : "");
+                hit->size = sqlite3_column_int64(stmt, 2);
+                hit->mtime = sqlite3_column_int64(stmt, 3);
+                hit->id = ni->ids[heap[i]];
+                task->count++;
+            }
+        }
+        sqlite3_reset(stmt);
+    }
+    free(heap);
+    return 0;
+}
+
+// Keep row in the task's heap of its best limit hits, copying its path; returns 1 when
+// memory runs out and the search should stop
+static int _hit_offer(search_task *task, search_hit *row, const char *type) {
+    int slot;
+    if (task->count == task->limit) {
+        if (!_hit_before(row, &task->hits[0], task->sort)) return 0;
+        free(task->hits[0].path);
+        slot = 0;
+    } else {
+        slot = task->count++;
+    }
+    if (!(row->path = strdup(row->path))) {
+        // Drop the slot rather than leave a NULL path in the heap
+        task->hits[slot] = task->hits[--task->count];
+        return 1;
+    }
+    snprintf(row->type, sizeof(row->type), "%s", type ? type : "");
+    if (slot == 0 && task->count == task->limit) {
+        task->hits[0] = *row;
+        _hit_heap_down(task->hits, task->count, 0, task->sort);
+    } else {
+        int i = slot;
+        while (i > 0 && _hit_before(&task->hits[(i - 1) / 2], row, task->sort)) {
+            task->hits[i] = task->hits[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        task->hits[i] = *row;
+    }
+    return 0;
+}
+
+// Stream a search statement's rows through the task's heap of its best limit hits;
+// ordered means they arrive best first under task->sort
+static void _search_collect(search_task *task, sqlite3_stmt *stmt, int ordered) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        search_hit row = { (char *)sqlite3_column_text(stmt, 0), "", sqlite3_column_int64(stmt, 2),
+                           sqlite3_column_int64(stmt, 3), sqlite3_column_int64(stmt, 4), 0 };
+        if (!row.path) continue;
+        // Only rows with the top's sort key can still tie their way in
+        if (ordered && task->count == task->limit &&
+            (task->sort == SORT_SIZE ? row.size < task->hits[0].size : row.mtime < task->hits[0].mtime)) break;
+        if (_hit_offer(task, &row, (const char *)sqlite3_column_text(stmt, 1)) != 0) break;
+    }
+}
+
+// Parse a size such as 512, 10m or 1.5gb (binary units); returns 0 on success
+static int _parse_size_value(const char *str, sqlite3_int64 *out) {
+    char *end;
+    double value = strtod(str, &end);
+    if (end == str || value < 0) return 1;
+    const char *units = "kmgt";
+    const char *unit = *end ? strchr(units, *end) : NULL;
+    if (unit) {
+        for (const char *u = units; u <= unit; u++) value *= 1024;
+        end++;
+    }
+    if (*end == 'b') end++;
+    if (*end || value > 9e18) return 1;
+    *out = (sqlite3_int64)value;
+    return 0;
+}
+
+// Parse an mtime operand: an age (30s, 15m, 12h, 7d, 2w, 1y) or a local date (2024-05-31),
+// as the Unix time it stands for; *day_end is the last second of that day for a date
+static int _parse_time_value(const char *str, time_t now, sqlite3_int64 *out, sqlite3_int64 *day_end, int *age) {
+    int year, month, day, used = 0;
+    if (sscanf(str, "%4d-%2d-%2d%n", &year, &month, &day, &used) == 3 && str[used] == '\0') {
+        struct tm tm = {0};
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_isdst = -1;
+        time_t start = mktime(&tm);
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        time_t next = mktime(&tm);
+        if (start == (time_t)-1 || next == (time_t)-1) return 1;
+        *out = start;
+        *day_end = next - 1;
+        *age = 0;
+        return 0;
+    }
+    char *end;
+    long long count = strtoll(str, &end, 10);
+    if (end == str || count < 0 || count > 100000) return 1;
+    static const char units[] = "smhdwy";
+    static const long long seconds[] = { 1, 60, 3600, 86400, 7 * 86400, 365 * 86400 };
+    const char *unit = *end ? strchr(units, *end) : NULL;
+    if (!unit || end[1]) return 1;
+    *out = (sqlite3_int64)now - count * seconds[unit - units];
+    *age = 1;
+    return 0;
+}
+
+// Split a comparison off a filter token: "<", "<=", ">", ">=", "=" or ":" (which means "=")
+static const char *_parse_filter_op(const char *str, char *op) {
+    if (*str == ':' || *str == '=') {
+        *op = '=';
+        return str + 1;
+    }
+    if (*str != '<' && *str != '>') return NULL;
+    *op = *str;
+    if (str[1] == '=') {
+        *op = *str == '<' ? 'l' : 'g';  // <= and >=
+        return str + 2;
+    }
+    return str + 1;
+}
+
+// Narrow [*lo, *hi] to the values op compares true against [first, last], the span
+// one operand stands for
+static void _narrow_range(char op, sqlite3_int64 first, sqlite3_int64 last, sqlite3_int64 *lo, sqlite3_int64 *hi) {
+    sqlite3_int64 new_lo = INT64_MIN;
+    sqlite3_int64 new_hi = INT64_MAX;
+    switch (op) {
+    case '<': new_hi = first - 1; break;
+    case 'l': new_hi = last; break;
+    case '>': new_lo = last + 1; break;
+    case 'g': new_lo = first; break;
+    default: new_lo = first; new_hi = last; break;
+    }
+    if (new_lo > *lo) *lo = new_lo;
+    if (new_hi < *hi) *hi = new_hi;
+}
+
+// Apply one key:value or key<value token; returns 1 if token is not a filter, -1 if malformed
+static int _parse_filter(const char *token, time_t now, search_query *q) {
+    char op;
+    const char *value;
+    if (strncmp(token, "ext:", 4) == 0) {
+        value = token + 4;
+        if (*value == '.') value++;
+        if (!*value || strlen(value) >= sizeof(q->ext)) return -1;
+        snprintf(q->ext, sizeof(q->ext), "%s", value);
+        q->filters |= FILTER_EXT;
+        return 0;
+    }
+    if (strncmp(token, "type:", 5) == 0) {
+        value = token + 5;
+        if (strcmp(value, "file") == 0 || strcmp(value, "f") == 0) {
+            snprintf(q->type, sizeof(q->type), "file");
+        } else if (strcmp(value, "dir") == 0 || strcmp(value, "d") == 0) {
+            snprintf(q->type, sizeof(q->type), "dir");
+        } else {
+            return -1;
+        }
+        q->filters |= FILTER_TYPE;
+        return 0;
+    }
+    if (strncmp(token, "size", 4) == 0 && (value = _parse_filter_op(token + 4, &op))) {
+        sqlite3_int64 size;
+        if (_parse_size_value(value, &size) != 0) return -1;
+        _narrow_range(op, size, size, &q->size_min, &q->size_max);
+        q->filters |= FILTER_SIZE;
+        return 0;
+    }
+    if (strncmp(token, "mtime", 5) == 0 && (value = _parse_filter_op(token + 5, &op))) {
+        sqlite3_int64 when, day_end;
+        int age;
+        if (_parse_time_value(value, now, &when, &day_end, &age) != 0) return -1;
+        if (age) {
+            // An age compares the other way round: mtime<7d is newer than 7 days ago
+            static const char flipped[] = { '<', '>', '>', '<', 'l', 'g', 'g', 'l' };
+            if (op == '=') return -1;
+            for (int i = 0; i < 8; i += 2) {
+                if (op == flipped[i]) {
+                    op = flipped[i + 1];
+                    break;
+                }
+            }
+            day_end = when;
+        }
+        _narrow_range(op, when, day_end, &q->mtime_min, &q->mtime_max);
+        q->filters |= FILTER_MTIME;
+        return 0;
+    }
+    return 1;
+}
+
+// Split a search query into structured filters and the words left to match as a substring.
+// A double-quoted word is always text, and so is a malformed filter. Returns 0 on success;
+// q->filters is 0 for a plain pattern, which the caller matches as it stands, or as q->text
+// when that is set (quotes stripped)
+int _parse_search_query(const char *input, search_query *q) {
+    memset(q, 0, sizeof(*q));
+    q->size_min = q->mtime_min = INT64_MIN;
+    q->size_max = q->mtime_max = INT64_MAX;
+    char *lower = _to_lower(input);
+    if (!lower) return 1;
+    size_t size = strlen(lower) + 1;
+    if (!(q->text = sqlite3_malloc((int)size))) {
+        LOG_ERROR("Failed to allocate memory for search query");
+        free(lower);
+        return 1;
+    }
+    q->text[0] = '\0';
+    size_t text_len = 0;
+    time_t now = time(NULL);
+    int any_quoted = 0;
+    char *p = lower;
+    while (*p) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        char *word = p;
+        int quoted = *p == '"';
+        if (quoted) {
+            any_quoted = 1;
+            word = ++p;
+            while (*p && *p != '"') p++;
+        } else {
+            while (*p && *p != ' ') p++;
+        }
+        char *next = *p ? p + 1 : p;
+        *p = '\0';
+        int rc = quoted ? 1 : _parse_filter(word, now, q);
+        if (rc < 0) {
+            LOG_INFO("'%s' is not a valid filter; matching it as text", word);
+            rc = 1;
+        }
+        if (rc > 0 && *word) {
+            text_len += (size_t)snprintf(q->text + text_len, size - text_len, "%s%s", text_len ? " " : "", word);
+        }
+        p = next;
+    }
+    free(lower);
+    if (!q->filters) {
+        if (!any_quoted) _free_search_query(q);
+        return 0;
+    }
+
+    size_t len = strlen(q->text);
+    if (len == 0) {
+        q->text_mode = QUERY_TEXT_NONE;
+        return 0;
+    }
+    if (len > 1 && q->text[len - 1] == '*' && !memchr(q->text, '*', len - 1)) {
+        q->text_mode = QUERY_TEXT_PREFIX;
+        q->low = sqlite3_mprintf("%.*s", (int)(len - 1), q->text);
+        q->high = sqlite3_malloc((int)len);
+        if (!q->low || !q->high) {
+            LOG_ERROR("Failed to allocate memory for search query");
+            _free_search_query(q);
+            return 1;
+        }
+        if (_prefix_upper_bound(q->low, q->high, len) != 0) {
+            sqlite3_free(q->high);
+            q->high = NULL;
+        }
+        return 0;
+    }
+    q->text_mode = _utf8_len(q->text) >= 3 ? QUERY_TEXT_FTS : QUERY_TEXT_LIKE;
+    if (q->text_mode == QUERY_TEXT_FTS) {
+        if (!(q->match = sqlite3_mprintf("\"%w\"", q->text))) {
+            LOG_ERROR("Failed to allocate memory for search query");
+            _free_search_query(q);
+            return 1;
+        }
+        // Trigrams fold non-ASCII case and LIKE does not, so such text is checked by
+        // rowid against the phrase's matches instead
+        for (const char *c = q->text; *c; c++) {
+            if ((unsigned char)*c >= 0x80) return 0;
+        }
+    }
+    // Checked against rows another index found: escape LIKE's own wildcards
+    if ((q->like = sqlite3_malloc((int)(2 * len + 3)))) {
+        char *out = q->like;
+        *out++ = '%';
+        for (const char *c = q->text; *c; c++) {
+            if (*c == '%' || *c == '_' || *c == '\\') *out++ = '\\';
+            *out++ = *c;
+        }
+        *out++ = '%';
+        *out = '\0';
+    }
+    if (!q->like) {
+        LOG_ERROR("Failed to allocate memory for search query");
+        _free_search_query(q);
+        return 1;
+    }
+    return 0;
+}
+
+void _free_search_query(search_query *q) {
+    sqlite3_free(q->text);
+    sqlite3_free(q->match);
+    sqlite3_free(q->like);
+    sqlite3_free(q->low);
+    sqlite3_free(q->high);
+    sqlite3_free(q->phrase);
+    q->text = q->match = q->like = q->low = q->high = q->phrase = NULL;
+}
+
+// Bind the values a filtered search or probe statement refers to by their QP_* numbers
+static void _bind_search_query(sqlite3_stmt *stmt, const search_query *q) {
+    int n = sqlite3_bind_parameter_count(stmt);
+    for (int i = 1; i <= n; i++) {
+        switch (i) {
+        case QP_MATCH: sqlite3_bind_text(stmt, i, q->match, -1, SQLITE_STATIC); break;
+        case QP_LIKE: sqlite3_bind_text(stmt, i, q->like, -1, SQLITE_STATIC); break;
+        case QP_LOW: sqlite3_bind_text(stmt, i, q->low, -1, SQLITE_STATIC); break;
+        case QP_HIGH: sqlite3_bind_text(stmt, i, q->high, -1, SQLITE_STATIC); break;
+        case QP_EXT: sqlite3_bind_text(stmt, i, q->ext, -1, SQLITE_STATIC); break;
+        case QP_TYPE: sqlite3_bind_text(stmt, i, q->type, -1, SQLITE_STATIC); break;
+        case QP_SIZE_MIN: sqlite3_bind_int64(stmt, i, q->size_min); break;
+        case QP_SIZE_MAX: sqlite3_bind_int64(stmt, i, q->size_max); break;
+        case QP_MTIME_MIN: sqlite3_bind_int64(stmt, i, q->mtime_min); break;
+        case QP_MTIME_MAX: sqlite3_bind_int64(stmt, i, q->mtime_max); break;
+        }
+    }
+}
+
+// The index range a driver scans, as a FROM source and the conditions it is entered by;
+// returns 1 if the query gives that driver nothing to range over
+static int _driver_range(const search_query *q, int driver, const char **from, const char **where) {
+    switch (driver) {
+    case DRIVE_TEXT:
+        if (q->text_mode == QUERY_TEXT_FTS) {
+            *from = "files_fts JOIN files f NOT INDEXED ON f.id = files_fts.rowid";
+            *where = "files_fts MATCH ?1";
+        } else if (q->text_mode == QUERY_TEXT_PREFIX) {
+            *from = "files f INDEXED BY idx_name_lc";
+            *where = q->high ? "f.name_lc >= ?3 AND f.name_lc < ?4" : "f.name_lc >= ?3";
+        } else {
+            return 1;
+        }
+        return 0;
+    case DRIVE_EXT:
+        if (!(q->filters & FILTER_EXT)) return 1;
+        *from = "files f INDEXED BY idx_files_ext";
+        *where = q->filters & FILTER_MTIME ? "f.ext = ?5 AND f.mtime BETWEEN ?9 AND ?10" : "f.ext = ?5";
+        return 0;
+    case DRIVE_SIZE:
+        if (!(q->filters & FILTER_SIZE)) return 1;
+        *from = "files f INDEXED BY idx_files_size";
+        *where = "f.size BETWEEN ?7 AND ?8";
+        return 0;
+    case DRIVE_MTIME:
+        if (!(q->filters & FILTER_MTIME)) return 1;
+        *from = "files f INDEXED BY idx_files_mtime";
+        *where = "f.mtime BETWEEN ?9 AND ?10";
+        return 0;
+    }
+    return 1;
+}
+
+// Count up to QUERY_PROBE_ROWS entries in a driver's index range, as its selectivity
+// estimate; -1 if the driver doesn't apply
+static int _probe_driver(sqlite3 *db, const search_query *q, int driver) {
+    const char *from, *where;
+    if (_driver_range(q, driver, &from, &where) != 0) return -1;
+    if (driver == DRIVE_TEXT && q->text_mode == QUERY_TEXT_FTS) from = "files_fts";
+    char sql[512];
+    snprintf(sql, sizeof(sql), "SELECT count(*) FROM (SELECT 1 FROM %s WHERE %s LIMIT %d);", from, where, QUERY_PROBE_ROWS);
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare search probe: %s", sqlite3_errmsg(db));
+        return -1;
+    }
+    _bind_search_query(stmt, q);
+    int rows = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+// Pick the driver with the narrowest range. When every range is wide, prefer one whose
+// index already yields the sort order, so the scan can stop after limit rows
+static int _plan_search(sqlite3 *db, const search_query *q, int sort) {
+    int best = DRIVE_SCAN;
+    int best_rows = QUERY_PROBE_ROWS;
+    for (int driver = DRIVE_TEXT; driver < DRIVE_SCAN; driver++) {
+        int rows = _probe_driver(db, q, driver);
+        if (rows >= 0 && (rows < best_rows || best == DRIVE_SCAN)) {
+            best = driver;
+            best_rows = rows;
+        }
+    }
+    if (best_rows >= QUERY_PROBE_ROWS && (q->text_mode != QUERY_TEXT_FTS || q->like)) {
+        if (sort == SORT_MTIME) return q->filters & FILTER_EXT ? DRIVE_EXT : DRIVE_MTIME;
+        if (sort == SORT_SIZE) return DRIVE_SIZE;
+    }
+    return best;
+}
+
+static void _sql_where(char *sql, size_t size, int *first, const char *cond) {
+    size_t len = strlen(sql);
+    snprintf(sql + len, size - len, "%s%s", *first ? " WHERE " : " AND ", cond);
+    *first = 0;
+}
+
+// Append the column filters a driver's index range doesn't already apply
+static void _sql_filters(char *sql, size_t size, int *first, const search_query *q, int driver) {
+    if ((q->filters & FILTER_EXT) && driver != DRIVE_EXT) _sql_where(sql, size, first, "f.ext = ?5");
+    if ((q->filters & FILTER_SIZE) && driver != DRIVE_SIZE) _sql_where(sql, size, first, "f.size BETWEEN ?7 AND ?8");
+    if ((q->filters & FILTER_MTIME) && driver != DRIVE_MTIME && driver != DRIVE_EXT) {
+        _sql_where(sql, size, first, "f.mtime BETWEEN ?9 AND ?10");
+    }
+    if (q->filters & FILTER_TYPE) _sql_where(sql, size, first, "f.type = ?6");
+}
+
+// Plan and run a filtered search on one shard: the driver's range first, then the cheap
+// column checks, the substring last
+static void _search_filtered(search_task *task) {
+    const search_query *q = task->filter;
+    int driver = _plan_search(task->db, q, task->sort);
+    const char *from = "files f NOT INDEXED";
+    const char *range = NULL;
+    const char *order = "";
+    int ordered = 0;
+    if (driver == DRIVE_MTIME && !(q->filters & FILTER_MTIME)) {
+        from = "files f INDEXED BY idx_files_mtime";   // no range, only the order
+    } else if (driver == DRIVE_SIZE && !(q->filters & FILTER_SIZE)) {
+        from = "files f INDEXED BY idx_files_size";
+    } else if (driver != DRIVE_SCAN) {
+        _driver_range(q, driver, &from, &range);
+    }
+    if (task->sort == SORT_MTIME && (driver == DRIVE_EXT || driver == DRIVE_MTIME)) {
+        order = " ORDER BY f.mtime DESC";
+        ordered = 1;
+    } else if (task->sort == SORT_SIZE && driver == DRIVE_SIZE) {
+        order = " ORDER BY f.size DESC";
+        ordered = 1;
+    }
+
+    char sql[1024];
+    int first = 1;
+    snprintf(sql, sizeof(sql), "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM %s "
+             "JOIN dirs d ON d.id = f.dir_id", from);
+    if (range) _sql_where(sql, sizeof(sql), &first, range);
+    _sql_filters(sql, sizeof(sql), &first, q, driver);
+    if (driver != DRIVE_TEXT) {
+        if (q->text_mode == QUERY_TEXT_PREFIX) {
+            _sql_where(sql, sizeof(sql), &first, q->high ? "f.name_lc >= ?3 AND f.name_lc < ?4" : "f.name_lc >= ?3");
+        } else if (q->like) {
+            _sql_where(sql, sizeof(sql), &first, "d.path || '/' || f.name LIKE ?2 ESCAPE '\\'");
+        } else if (q->text_mode == QUERY_TEXT_FTS) {
+            _sql_where(sql, sizeof(sql), &first, "f.id IN (SELECT rowid FROM files_fts WHERE files_fts MATCH ?1)");
+        }
+    }
+    size_t len = strlen(sql);
+    snprintf(sql + len, sizeof(sql) - len, "%s;", order);
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(task->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare filtered search: %s", sqlite3_errmsg(task->db));
+        return;
+    }
+    _bind_search_query(stmt, q);
+    _search_collect(task, stmt, ordered);
+    sqlite3_finalize(stmt);
+}
+
+static int _sqlite_int64_cmp(const void *a, const void *b) {
+    sqlite3_int64 x = *(const sqlite3_int64 *)a;
+    sqlite3_int64 y = *(const sqlite3_int64 *)b;
+    return (x > y) - (x < y);
+}
+
+// Word-start bonus for a match at s[i]
+static int _fuzzy_bonus(const char *s, size_t i) {
+    if (i == 0) return FUZZY_BOUNDARY;
+    unsigned char prev = (unsigned char)s[i - 1];
+    unsigned char cur = (unsigned char)s[i];
+    if (strchr("/\\_-. ", prev)) return FUZZY_BOUNDARY;
+    if (islower(prev) && isupper(cur)) return FUZZY_CAMEL;
+    return 0;
+}
+
+// Find pat as a subsequence of s[from, len): the first end forward, then the latest start
+// walking back from it, which gives the tightest window ending there; returns 0 if found
+static int _fuzzy_window(const char *s, size_t from, size_t len, const char *pat, size_t plen, size_t *start, size_t *end) {
+    size_t j = 0;
+    size_t i = from;
+    for (; i < len; i++) {
+        if (tolower((unsigned char)s[i]) == (unsigned char)pat[j] && ++j == plen) break;
+    }
+    if (j < plen) return 1;
+    *end = i;
+    for (j = plen; ; i--) {
+        if (tolower((unsigned char)s[i]) == (unsigned char)pat[j - 1] && --j == 0) break;
+    }
+    *start = i;
+    return 0;
+}
+
+// Score the window: each match earns FUZZY_MATCH plus its boundary bonus (a run keeps the
+// bonus it started with), each skipped character costs a gap penalty
+static int _fuzzy_window_score(const char *s, size_t start, size_t end, const char *pat, size_t plen) {
+    int score = 0;
+    int run_bonus = 0;
+    int in_run = 0;
+    int in_gap = 0;
+    size_t j = 0;
+    for (size_t i = start; i <= end; i++) {
+        if (j < plen && tolower((unsigned char)s[i]) == (unsigned char)pat[j]) {
+            int bonus = _fuzzy_bonus(s, i);
+            if (in_run) {
+                if (bonus < run_bonus) bonus = run_bonus;
+                if (bonus < FUZZY_CONSECUTIVE) bonus = FUZZY_CONSECUTIVE;
+            }
+            run_bonus = bonus;
+            score += FUZZY_MATCH + (j == 0 ? bonus * FUZZY_FIRST_MULT : bonus);
+            j++;
+            in_run = 1;
+            in_gap = 0;
+        } else {
+            score += in_gap ? FUZZY_GAP_EXTEND : FUZZY_GAP_START;
+            in_gap = 1;
+            in_run = 0;
+        }
+    }
+    return score;
+}
+
+// Fuzzy score of pat (lowercased) against path, or -1 if it isn't a subsequence. A match
+// within the name scores over one that needs the directories
+static int _fuzzy_score(const char *path, const char *pat, size_t plen) {
+    size_t len = strlen(path);
+    const char *slash = strrchr(path, '/');
+    size_t base = slash ? (size_t)(slash - path) + 1 : 0;
+    size_t start, end;
+    if (_fuzzy_window(path, base, len, pat, plen, &start, &end) == 0) {
+        return _fuzzy_window_score(path, start, end, pat, plen) + FUZZY_BASENAME * (int)plen;
+    }
+    if (base > 0 && _fuzzy_window(path, 0, len, pat, plen, &start, &end) == 0) {
+        return _fuzzy_window_score(path, start, end, pat, plen);
+    }
+    return -1;
+}
+
+// Turn q into a fuzzy query over text (the pattern when there were no filters): text as a
+// phrase and an OR of its trigrams to find the likeliest candidates, and a LIKE subsequence
+// for the rest
+static int _fuzzy_query(search_query *q, const char *pattern) {
+    sqlite3_free(q->match);
+    sqlite3_free(q->like);
+    q->match = q->like = NULL;
+    if (!q->filters) {
+        sqlite3_free(q->text);
+        if (!(q->text = sqlite3_mprintf("%s", pattern))) {
+            LOG_ERROR("Failed to allocate memory for search query");
+            return 1;
+        }
+    }
+    size_t len = strlen(q->text);
+    if (len == 0) {
+        LOG_ERROR("Fuzzy search needs text to match");
+        return 1;
+    }
+    // Trigrams start on character boundaries, as the tokenizer's do
+    for (const char *p = q->text; *p; p++) {
+        if (((unsigned char)*p & 0xC0) == 0x80) continue;
+        const char *e = p;
+        for (int chars = 0; chars < 3 && *e; chars++) {
+            do e++; while (((unsigned char)*e & 0xC0) == 0x80);
+        }
+        if (_utf8_len(p) < 3) break;
+        char gram[16];
+        snprintf(gram, sizeof(gram), "%.*s", (int)(e - p), p);
+        q->match = q->match ? sqlite3_mprintf("%z OR \"%w\"", q->match, gram) : sqlite3_mprintf("\"%w\"", gram);
+        if (!q->match) {
+            LOG_ERROR("Failed to allocate memory for search query");
+            return 1;
+        }
+    }
+    if (q->match && !(q->phrase = sqlite3_mprintf("\"%w\"", q->text))) {
+        LOG_ERROR("Failed to allocate memory for search query");
+        return 1;
+    }
+    // %c%h%a%r%s%: a '%' before each character, LIKE's own wildcards escaped
+    if (!(q->like = sqlite3_malloc((int)(3 * len + 2)))) {
+        LOG_ERROR("Failed to allocate memory for search query");
+        return 1;
+    }
+    char *out = q->like;
+    for (const char *c = q->text; *c; c++) {
+        if (((unsigned char)*c & 0xC0) != 0x80) *out++ = '%';
+        if (*c == '%' || *c == '_' || *c == '\\') *out++ = '\\';
+        *out++ = *c;
+    }
+    *out++ = '%';
+    *out = '\0';
+    return 0;
+}
+
+// Interrupt a fuzzy slice's statement once its deadline has passed
+static int _fuzzy_progress(void *arg) {
+    search_task *task = arg;
+    if (_now_ms() <= task->deadline) return 0;
+    task->truncated = 1;
+    return 1;
+}
+
+// Score a statement's rows into the task's heap, skipping ids an earlier pass offered
+static void _fuzzy_collect(search_task *task, sqlite3_stmt *stmt, const sqlite3_int64 *seen, int nseen) {
+    const char *pat = task->filter->text;
+    size_t plen = strlen(pat);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        int score = path ? _fuzzy_score(path, pat, plen) : -1;
+        if (score < 0) continue;
+        search_hit row = { (char *)path, "", sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3),
+                           sqlite3_column_int64(stmt, 4), score };
+        if (nseen && bsearch(&row.id, seen, nseen, sizeof(*seen), _sqlite_int64_cmp)) continue;
+        if (_hit_offer(task, &row, (const char *)sqlite3_column_text(stmt, 1)) != 0) break;
+        if (task->truncated) break;
+    }
+}
+
+// Fuzzy search passes, likeliest best matches first: rows containing the text (bound to ?1
+// in place of the trigram OR), rows sharing a trigram with it, subsequence matches within
+// the name (tested on idx_name_lc before the row is read), then those spanning directories
+#define FUZZY_PASSES 4
+static const struct {
+    const char *from;
+    const char *range;
+    const char *match;      // checked after the filters
+} fuzzy_passes[FUZZY_PASSES] = {
+    { "files_fts JOIN files f NOT INDEXED ON f.id = files_fts.rowid",
+      "files_fts MATCH ?1 AND files_fts.rowid BETWEEN ?11 AND ?12", NULL },
+    { "files_fts JOIN files f NOT INDEXED ON f.id = files_fts.rowid",
+      "files_fts MATCH ?1 AND files_fts.rowid BETWEEN ?11 AND ?12", NULL },
+    { "files f INDEXED BY idx_name_lc", "f.id BETWEEN ?11 AND ?12", "f.name_lc LIKE ?2 ESCAPE '\\'" },
+    { "files f", "f.id BETWEEN ?11 AND ?12", "d.path || '/' || f.name LIKE ?2 ESCAPE '\\'" },
+};
+
+// Fuzzy search of one id slice of a shard, pass by pass until the deadline
+static void _search_fuzzy(search_task *task) {
+    const search_query *q = task->filter;
+    sqlite3 *db = task->db;
+    if (task->slice_path) {
+        if (sqlite3_open_v2(task->slice_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to open %s for fuzzy search: %s", task->slice_path, sqlite3_errmsg(db));
+            sqlite3_close(db);
+            return;
+        }
+        sqlite3_busy_timeout(db, 5000);
+    }
+    sqlite3_progress_handler(db, 1000, _fuzzy_progress, task);
+    sqlite3_int64 *seen = NULL;
+    int nseen = 0;
+    for (int pass = 0; pass < FUZZY_PASSES && !task->truncated; pass++) {
+        if (pass < 2 && !q->match) continue;
+        char sql[1024];
+        int first = 1;
+        snprintf(sql, sizeof(sql), "SELECT d.path || '/' || f.name, f.type, f.size, f.mtime, f.id FROM %s "
+                 "JOIN dirs d ON d.id = f.dir_id", fuzzy_passes[pass].from);
+        _sql_where(sql, sizeof(sql), &first, fuzzy_passes[pass].range);
+        _sql_filters(sql, sizeof(sql), &first, q, DRIVE_SCAN);
+        if (fuzzy_passes[pass].match) _sql_where(sql, sizeof(sql), &first, fuzzy_passes[pass].match);
+        size_t len = strlen(sql);
+        snprintf(sql + len, sizeof(sql) - len, ";");
+
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare fuzzy search: %s", sqlite3_errmsg(db));
+            break;
+        }
+        _bind_search_query(stmt, q);
+        if (pass == 0) sqlite3_bind_text(stmt, QP_MATCH, q->phrase, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, QP_ID_MIN, task->id_min);
+        sqlite3_bind_int64(stmt, QP_ID_MAX, task->id_max);
+        _fuzzy_collect(task, stmt, seen, nseen);
+        sqlite3_finalize(stmt);
+        // Rows an earlier pass left out of the heap can't beat it now, so only those in it
+        // need skipping when a later pass meets them again
+        free(seen);
+        nseen = 0;
+        if (task->count > 0 && (seen = malloc(task->count * sizeof(*seen)))) {
+            for (nseen = 0; nseen < task->count; nseen++) seen[nseen] = task->hits[nseen].id;
+            qsort(seen, nseen, sizeof(*seen), _sqlite_int64_cmp);
+        }
+    }
+    free(seen);
+    sqlite3_progress_handler(db, 0, NULL, NULL);
+    if (task->slice_path) sqlite3_close(db);
+}
+
+// Run the search on one shard, streaming rows through a heap of its best limit hits
+static void *_search_shard(void *arg) {
+    search_task *task = arg;
+    name_index *ni;
+    if (task->sort == SORT_SCORE) {
+        _search_fuzzy(task);
+        _hit_sort(task->hits, task->count, task->sort);
+        return NULL;
+    }
+    if (task->filter) {
+        _search_filtered(task);
+        _hit_sort(task->hits, task->count, task->sort);
+        return NULL;
+    }
+    if (task->names_pattern) {
+        if ((ni = _get_name_index(task->db))) {
+            _search_names(task, ni);
+            return NULL;
+        }
+        LOG_INFO("Name index for %s is missing or stale; searching SQLite", sqlite3_db_filename(task->db, "main"));
+    }
+    sqlite3_stmt *stmt = _get_stmt(task->db, task->stmt_id);
+    if (!stmt) return NULL;
+    sqlite3_bind_text(stmt, 1, task->query, -1, SQLITE_STATIC);
+    if (task->upper) sqlite3_bind_text(stmt, 2, task->upper, -1, SQLITE_STATIC);
+    _search_collect(task, stmt, task->stmt_id == STMT_SEARCH_LIKE_MTIME);    // rows arrive newest first
+    sqlite3_reset(stmt);
+    _hit_sort(task->hits, task->count, task->sort);
+    return NULL;
+}
+
+// Restore the heap of shard heads (best on top) below slot i
+static void _search_heap_down(search_task **heap, int n, int i, int sort) {
+    for (;;) {
+        int best = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < n && _hit_before(&heap[l]->hits[heap[l]->next], &heap[best]->hits[heap[best]->next], sort)) best = l;
+        if (r < n && _hit_before(&heap[r]->hits[heap[r]->next], &heap[best]->hits[heap[best]->next], sort)) best = r;
+        if (best == i) return;
+        search_task *tmp = heap[i];
+        heap[i] = heap[best];
+        heap[best] = tmp;
+        i = best;
+    }
+}
+
+// Run a search and hand the best limit hits under sort to emit, in order; returns 0 on success
+int _search_run(sqlite3 *db, const char *pattern, int limit, int sort, search_emit_cb emit, void *ctx) {
+    search_query filter;
+    if (_parse_search_query(pattern, &filter) != 0) return 1;
+    char *lower_pattern = _to_lower(filter.text && !filter.filters ? filter.text : pattern);
+    if (!lower_pattern) {
+        _free_search_query(&filter);
+        return 1;
+    }
+    int fuzzy = sort == SORT_SCORE;
+    if (fuzzy && _fuzzy_query(&filter, lower_pattern) != 0) {
+        free(lower_pattern);
+        _free_search_query(&filter);
+        return 1;
+    }
+
+    int stmt_id = -1;
+    char *query = NULL;
+    char *upper = NULL;
+    size_t len = strlen(lower_pattern);
+    // name is always a suffix of full_path, so matching full_path covers both
+    if (fuzzy || filter.filters) {
+        // Built per shard by _search_fuzzy or _search_filtered
+    } else if (len > 1 && lower_pattern[len - 1] == '*' && !memchr(lower_pattern, '*', len - 1)) {
+        // "prefix*": range scan on the name_lc index
+        lower_pattern[len - 1] = '\0';
+        stmt_id = STMT_SEARCH_PREFIX;
+        query = sqlite3_mprintf("%s", lower_pattern);
+        upper = sqlite3_malloc((int)len);
+        if (upper && _prefix_upper_bound(lower_pattern, upper, len) != 0) {
+            sqlite3_free(upper);
+            upper = NULL;
+            stmt_id = STMT_SEARCH_PREFIX_OPEN;
+        }
+    } else if (_utf8_len(lower_pattern) >= 3) {
+        // A quoted FTS5 phrase over trigrams is an exact case-insensitive substring match
+        stmt_id = STMT_SEARCH_FTS;
+        query = sqlite3_mprintf("\"%w\"", lower_pattern);
+    } else {
+        // Too short for trigrams: fall back to a scan (LIKE already folds ASCII case),
+        // newest first when that is the order wanted so it can stop after limit rows
+        stmt_id = sort == SORT_MTIME ? STMT_SEARCH_LIKE_MTIME : STMT_SEARCH_LIKE;
+        query = sqlite3_mprintf("%%%s%%", lower_pattern);
+    }
+    if (stmt_id >= 0 && !query) {
+        LOG_ERROR("Failed to allocate memory for search query");
+        free(lower_pattern);
+        return 1;
+    }
+    // The name index only holds names and mtimes; SQLite answers anything matching across a
+    // separator, or ranked by size
+    const char *names_pattern = NULL;
+    if (search_engine == ENGINE_NAMES && !filter.filters && sort != SORT_SIZE && sort != SORT_SCORE && *lower_pattern && !strpbrk(lower_pattern, "/\\")) {
+        names_pattern = lower_pattern;
+    }
+
+    // One query per shard, each on its own thread when there are several. A fuzzy search
+    // also splits each shard's ids across --jobs threads, the first on the shard's own
+    // connection and the rest on read-only ones of their own
+    int nshards = _shard_count(db);
+    int slices = 1;
+    if (fuzzy) {
+        slices = search_jobs < MAX_SEARCH_TASKS / nshards ? search_jobs : MAX_SEARCH_TASKS / nshards;
+        if (slices < 1) slices = 1;
+    }
+    int ntasks = nshards * slices;
+    search_task *tasks = calloc(ntasks, sizeof(search_task));
+    pthread_t threads[MAX_SEARCH_TASKS];
+    int threaded[MAX_SEARCH_TASKS] = {0};
+    for (int t = 0; tasks && t < ntasks; t++) {
+        if (!(tasks[t].hits = calloc(limit, sizeof(search_hit)))) {
+            for (int j = 0; j < t; j++) free(tasks[j].hits);
+            free(tasks);
+            tasks = NULL;
+        }
+    }
+    if (!tasks) {
+        LOG_ERROR("Failed to allocate search tasks");
+        sqlite3_free(query);
+        sqlite3_free(upper);
+        free(lower_pattern);
+        _free_search_query(&filter);
+        return 1;
+    }
+    long long deadline = fuzzy_budget_ms > 0 ? _now_ms() + fuzzy_budget_ms : INT64_MAX;
+    sqlite3_int64 max_id = 0;
+    for (int t = 0; t < ntasks; t++) {
+        int k = t / slices;
+        int slice = t % slices;
+        tasks[t].limit = limit;
+        tasks[t].sort = sort;
+        tasks[t].db = _shard_db(db, k);
+        tasks[t].stmt_id = stmt_id;
+        tasks[t].filter = fuzzy || filter.filters ? &filter : NULL;
+        tasks[t].query = query;
+        tasks[t].upper = upper;
+        tasks[t].names_pattern = names_pattern;
+        tasks[t].names_prefix = stmt_id == STMT_SEARCH_PREFIX || stmt_id == STMT_SEARCH_PREFIX_OPEN;
+        if (fuzzy) {
+            if (slice == 0) max_id = slices > 1 ? _pragma_int(tasks[t].db, "SELECT coalesce(max(id), 0) FROM files;") : 0;
+            tasks[t].id_min = slice == 0 ? INT64_MIN : max_id * slice / slices + 1;
+            tasks[t].id_max = slice == slices - 1 ? INT64_MAX : max_id * (slice + 1) / slices;
+            tasks[t].slice_path = slice > 0 ? sqlite3_db_filename(tasks[t].db, "main") : NULL;
+            tasks[t].deadline = deadline;
+        }
+        if (ntasks > 1 && pthread_create(&threads[t], NULL, _search_shard, &tasks[t]) == 0) {
+            threaded[t] = 1;
+        } else {
+            _search_shard(&tasks[t]);
+        }
+    }
+    int truncated = 0;
+    for (int t = 0; t < ntasks; t++) {
+        if (threaded[t]) pthread_join(threads[t], NULL);
+        truncated |= tasks[t].truncated;
+    }
+    if (truncated) {
+        LOG_INFO("Fuzzy search stopped at its %d ms budget; results rank the entries reached", fuzzy_budget_ms);
+    }
+
+    // k-way merge of the per-task lists, each already sorted
+    search_task *heap[MAX_SEARCH_TASKS];
+    int nheap = 0;
+    for (int t = 0; t < ntasks; t++) {
+        if (tasks[t].count > 0) heap[nheap++] = &tasks[t];
+    }
+    for (int i = nheap / 2 - 1; i >= 0; i--) _search_heap_down(heap, nheap, i, sort);
+    for (int shown = 0; nheap > 0 && shown < limit; shown++) {
+        if (emit(&heap[0]->hits[heap[0]->next], ctx) != 0) break;
+        if (++heap[0]->next == heap[0]->count) heap[0] = heap[--nheap];
+        _search_heap_down(heap, nheap, 0, sort);
+    }
+
+    for (int t = 0; t < ntasks; t++) {
+        for (int i = 0; i < tasks[t].count; i++) free(tasks[t].hits[i].path);
+        free(tasks[t].hits);
+    }
+    free(tasks);
+    sqlite3_free(query);
+    sqlite3_free(upper);
+    free(lower_pattern);
+    _free_search_query(&filter);
+    return 0;
+}
+
+// Write out buffered search output; a closed pipe (e.g. into head) stops the search
+static void _print_flush(print_out *out) {
+    if (out->len && !out->failed && fwrite(out->buf, 1, out->len, out->fp) != out->len) out->failed = 1;
+    out->len = 0;
+    if (!out->failed && fflush(out->fp) != 0) out->failed = 1;
+}
+
+static void _print_put(print_out *out, const char *data, size_t len) {
+    if (out->len + len > sizeof(out->buf)) {
+        if (out->len && !out->failed && fwrite(out->buf, 1, out->len, out->fp) != out->len) out->failed = 1;
+        out->len = 0;
+        if (len > sizeof(out->buf)) {
+            if (!out->failed && fwrite(data, 1, len, out->fp) != len) out->failed = 1;
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+static void _print_str(print_out *out, const char *str) {
+    _print_put(out, str, strlen(str));
+}
+
+static void _print_int(print_out *out, sqlite3_int64 value) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    unsigned long long v = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0) *--p = '-';
+    _print_put(out, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+// Seconds east of UTC that tm, the broken-down local time of t, stands for
+static sqlite3_int64 _tm_offset(const struct tm *tm, time_t t) {
+    // Days since 1970-01-01 of a proleptic Gregorian date, years starting in March
+    sqlite3_int64 y = tm->tm_year + 1900 - (tm->tm_mon < 2);
+    sqlite3_int64 era = (y >= 0 ? y : y - 399) / 400;
+    sqlite3_int64 yoe = y - era * 400;
+    int m = tm->tm_mon + 1;
+    sqlite3_int64 doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + tm->tm_mday - 1;
+    sqlite3_int64 days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    return days * 86400 + tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec - (sqlite3_int64)t;
+}
+
+// Format mtime as local "YYYY-MM-DD HH:MM:SS". Zones whose offset is whole minutes change
+// it on minute boundaries, so within one only the seconds differ and localtime() runs once
+// per minute of timestamps; other offsets (historical local mean time) get a call each
+static size_t _format_mtime(sqlite3_int64 mtime, char *buf) {
+    static sqlite3_int64 cached_minute = -1;
+    static char cached[32];
+    static size_t cached_len = 0;
+    sqlite3_int64 secs = ((mtime % 60) + 60) % 60;
+    sqlite3_int64 minute = mtime - secs;
+    if (minute != cached_minute || cached_len == 0) {
+        time_t t = (time_t)mtime;
+        struct tm *tm = localtime(&t);
+        size_t len = tm ? strftime(buf, 32, "%Y-%m-%d %H:%M:%S", tm) : 0;
+        cached_len = 0;
+        if (len < 2) return (size_t)snprintf(buf, 32, "%lld", (long long)mtime);
+        if (_tm_offset(tm, t) % 60 == 0) {
+            memcpy(cached, buf, len);
+            cached_len = len;
+            cached_minute = minute;
+        }
+        return len;
+    }
+    memcpy(buf, cached, cached_len);
+    buf[cached_len - 2] = (char)('0' + secs / 10);
+    buf[cached_len - 1] = (char)('0' + secs % 10);
+    return cached_len;
+}
+
+static void _print_mtime(print_out *out, sqlite3_int64 mtime, int quoted) {
+    if (epoch_times) {
+        _print_int(out, mtime);
+        return;
+    }
+    char buf[34];
+    size_t len = _format_mtime(mtime, buf + 1);
+    if (quoted) {
+        buf[0] = '"';
+        buf[len + 1] = '"';
+        _print_put(out, buf, len + 2);
+    } else {
+        _print_put(out, buf + 1, len);
+    }
+}
+
+// Length of the well-formed UTF-8 sequence at p (overlong forms, surrogates and code points
+// past U+10FFFF are not), or 0
+static int _utf8_seq_len(const unsigned char *p) {
+    if (p[0] < 0x80) return 1;
+    int len = p[0] >= 0xC2 && p[0] <= 0xDF ? 2 : p[0] >= 0xE0 && p[0] <= 0xEF ? 3 : p[0] >= 0xF0 && p[0] <= 0xF4 ? 4 : 0;
+    for (int i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80) return 0;
+    }
+    if ((p[0] == 0xE0 && p[1] < 0xA0) || (p[0] == 0xED && p[1] >= 0xA0) ||
+        (p[0] == 0xF0 && p[1] < 0x90) || (p[0] == 0xF4 && p[1] >= 0x90)) return 0;
+    return len;
+}
+
+// JSON string body: quotes, backslashes and control characters escaped, and each byte that
+// is not part of well-formed UTF-8 replaced by U+FFFD so the output stays valid JSON
+static void _print_json_str(print_out *out, const char *str) {
+    const char *run = str;
+    for (const char *p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x80) {
+            int len = _utf8_seq_len((const unsigned char *)p);
+            if (len) {
+                p += len - 1;
+                continue;
+            }
+            _print_put(out, run, (size_t)(p - run));
+            _print_str(out, "\\ufffd");
+            run = p + 1;
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        _print_put(out, run, (size_t)(p - run));
+        char esc[8];
+        if (c == '"' || c == '\\') snprintf(esc, sizeof(esc), "\\%c", c);
+        else if (c == '\n') snprintf(esc, sizeof(esc), "\\n");
+        else if (c == '\t') snprintf(esc, sizeof(esc), "\\t");
+        else snprintf(esc, sizeof(esc), "\\u%04x", c);
+        _print_str(out, esc);
+        run = p + 1;
+    }
+    _print_str(out, run);
+}
+
+// TSV field: tab, newline, carriage return and backslash as \t \n \r \\ escapes
+static void _print_tsv_str(print_out *out, const char *str) {
+    const char *run = str;
+    for (const char *p = str; *p; p++) {
+        const char *esc = *p == '\t' ? "\\t" : *p == '\n' ? "\\n" : *p == '\r' ? "\\r" : *p == '\\' ? "\\\\" : NULL;
+        if (!esc) continue;
+        _print_put(out, run, (size_t)(p - run));
+        _print_put(out, esc, 2);
+        run = p + 1;
+    }
+    _print_str(out, run);
+}
+
+// Print one search hit in --format; ctx is the print_out
+int _print_hit(const search_hit *hit, void *ctx) {
+    print_out *out = ctx;
+    switch (output_format) {
+        case FORMAT_NULL:
+            _print_put(out, hit->path, strlen(hit->path) + 1);
+            break;
+        case FORMAT_TSV:
+            _print_tsv_str(out, hit->path);
+            _print_put(out, "\t", 1);
+            _print_tsv_str(out, hit->type);
+            _print_put(out, "\t", 1);
+            _print_int(out, hit->size);
+            _print_put(out, "\t", 1);
+            _print_mtime(out, hit->mtime, 0);
+            _print_put(out, "\n", 1);
+            break;
+        case FORMAT_JSON:
+            _print_str(out, "{\"path\":\"");
+            _print_json_str(out, hit->path);
+            _print_str(out, "\",\"type\":\"");
+            _print_json_str(out, hit->type);
+            _print_str(out, "\",\"size\":");
+            _print_int(out, hit->size);
+            _print_str(out, ",\"mtime\":");
+            _print_mtime(out, hit->mtime, 1);
+            _print_str(out, "}\n");
+            break;
+        default:
+            _print_str(out, "Path: ");
+            _print_str(out, hit->path);
+            _print_str(out, "\nType: ");
+            _print_str(out, hit->type);
+            _print_str(out, "\nSize: ");
+            _print_int(out, hit->size);
+            _print_str(out, " bytes\nModified: ");
+            _print_mtime(out, hit->mtime, 0);
+            _print_str(out, "\n\n");
+            break;
+    }
+    return out->failed;
+}
+
+// Search and print the results
+void _search_files(sqlite3 *db, const char *pattern) {
+    static print_out out;
+    out.fp = stdout;
+    _search_run(db, pattern, search_limit, search_sort, _print_hit, &out);
+    _print_flush(&out);
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t _hash_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t _hash_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t _hash_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return _hash_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t _hash_merge(uint64_t acc, uint64_t val) {
+    acc ^= _hash_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Streaming XXH64 (little-endian hosts), so full hashes never hold a whole file
+void _hash_init(hash_state *hs, uint64_t seed) {
+    memset(hs, 0, sizeof(*hs));
+    hs->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    hs->v[1] = seed + XXH_PRIME64_2;
+    hs->v[2] = seed;
+    hs->v[3] = seed - XXH_PRIME64_1;
+}
+
+void _hash_update(hash_state *hs, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    hs->total_len += len;
+    if (hs->memsize + len < 32) {
+        memcpy(hs->mem + hs->memsize, p, len);
+        hs->memsize += len;
+        return;
+    }
+    if (hs->memsize) {
+        size_t fill = 32 - hs->memsize;
+        memcpy(hs->mem + hs->memsize, p, fill);
+        for (int i = 0; i < 4; i++) hs->v[i] = _hash_round(hs->v[i], _hash_read64(hs->mem + i * 8));
+        p += fill;
+        hs->memsize = 0;
+    }
+    for (; end - p >= 32; p += 32) {
+        for (int i = 0; i < 4; i++) hs->v[i] = _hash_round(hs->v[i], _hash_read64(p + i * 8));
+    }
+    memcpy(hs->mem, p, (size_t)(end - p));
+    hs->memsize = (size_t)(end - p);
+}
+
+uint64_t _hash_digest(const hash_state *hs) {
+    uint64_t h;
+    if (hs->total_len >= 32) {
+        h = _hash_rotl(hs->v[0], 1) + _hash_rotl(hs->v[1], 7) + _hash_rotl(hs->v[2], 12) + _hash_rotl(hs->v[3], 18);
+        for (int i = 0; i < 4; i++) h = _hash_merge(h, hs->v[i]);
+    } else {
+        h = hs->v[2] + XXH_PRIME64_5;   // v[2] is still the seed
+    }
+    h += hs->total_len;
+
+    const unsigned char *p = hs->mem;
+    size_t left = hs->memsize;
+    for (; left >= 8; p += 8, left -= 8) {
+        h ^= _hash_round(0, _hash_read64(p));
+        h = _hash_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (left >= 4) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (uint64_t)k * XXH_PRIME64_1;
+        h = _hash_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        h ^= *p * XXH_PRIME64_5;
+        h = _hash_rotl(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+#ifdef _WIN32
+typedef HANDLE hash_fd;
+#define HASH_FD_INVALID INVALID_HANDLE_VALUE
+#else
+typedef int hash_fd;
+#define HASH_FD_INVALID (-1)
+#endif
+
+// Open a file for hashing with a sequential-read hint; fails if its size is no longer size
+static hash_fd _hash_open(const char *path, sqlite3_int64 size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER actual;
+    if (file == INVALID_HANDLE_VALUE) return file;
+    if (!GetFileSizeEx(file, &actual) || actual.QuadPart != size) {
+        CloseHandle(file);
+        return INVALID_HANDLE_VALUE;
+    }
+    return file;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return fd;
+    if (fstat(fd, &st) != 0 || st.st_size != size) {
+        close(fd);
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return fd;
+#endif
+}
+
+static void _hash_close(hash_fd fd) {
+#ifdef _WIN32
+    CloseHandle(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Feed len bytes at offset into the hash; nonzero if the file came up short
+static int _hash_range(hash_fd fd, sqlite3_int64 offset, sqlite3_int64 len, char *buf, hash_state *hs) {
+    while (len > 0) {
+        size_t want = len < HASH_READ_SIZE ? (size_t)len : HASH_READ_SIZE;
+#ifdef _WIN32
+        OVERLAPPED at = {0};
+        DWORD got = 0;
+        at.Offset = (DWORD)(offset & 0xffffffff);
+        at.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+        if (!ReadFile(fd, buf, (DWORD)want, &got, &at) || got == 0) return 1;
+#else
+        ssize_t got = pread(fd, buf, want, (off_t)offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+#endif
+        _hash_update(hs, buf, (size_t)got);
+        offset += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Partial hash from both ends; for files that fit in it, it's also the full hash
+static int _hash_job(hash_job *job, int full, char *buf) {
+    STATS_START(started);
+    hash_fd fd = _hash_open(job->path, job->size);
+    if (fd == HASH_FD_INVALID) {
+        LOG_ERROR("Skipping hash of %s: it changed or can't be read since it was indexed", job->path);
+        return 1;
+    }
+    hash_state hs;
+    int rc;
+    if (full) {
+        _hash_init(&hs, 0);
+        rc = _hash_range(fd, 0, job->size, buf, &hs);
+        if (rc == 0) job->full = _hash_digest(&hs);
+        job->has_full = rc == 0;
+    } else if (job->size <= 2 * HASH_EDGE) {
+        _hash_init(&hs, 0);
+        rc = _hash_range(fd, 0, job->size, buf, &hs);
+        if (rc == 0) job->head = job->full = _hash_digest(&hs);
+        job->has_head = job->has_full = rc == 0;
+    } else {
+        _hash_init(&hs, (uint64_t)job->size);
+        rc = _hash_range(fd, 0, HASH_EDGE, buf, &hs) || _hash_range(fd, job->size - HASH_EDGE, HASH_EDGE, buf, &hs);
+        if (rc == 0) job->head = _hash_digest(&hs);
+        job->has_head = rc == 0;
+    }
+    _hash_close(fd);
+    if (rc != 0) LOG_ERROR("Skipping hash of %s: short read", job->path);
+    // Written to while it was read, or since it was indexed: the hash stands for neither
+    struct stat st;
+    if (rc == 0 && (stat(job->path, &st) != 0 || (sqlite3_int64)st.st_size != job->size ||
+                    (sqlite3_int64)st.st_mtime != job->mtime)) {
+        LOG_ERROR("Skipping hash of %s: it changed while being hashed", job->path);
+        job->has_head = job->has_full = 0;
+        rc = 1;
+    }
+    job->dirty |= rc == 0;
+    STATS_STOP(started, STAT_HASH);
+    return rc;
+}
+
+// Hashing thread: claim listed jobs until none are left
+static void *_hash_worker(void *arg) {
+    hash_pool *pool = arg;
+    char *buf = malloc(HASH_READ_SIZE);
+    if (!buf) {
+        LOG_ERROR("Failed to allocate hash read buffer");
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next < pool->ntodo ? pool->todo[pool->next++] : (size_t)-1;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == (size_t)-1) break;
+        _hash_job(&pool->jobs[i], pool->full, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Run the listed jobs on up to jobs threads; the caller's thread is one of them
+static void _hash_run(hash_job *all, size_t *todo, size_t ntodo, int full, int jobs) {
+    hash_pool pool = { .jobs = all, .todo = todo, .ntodo = ntodo, .full = full, .lock = PTHREAD_MUTEX_INITIALIZER };
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    if ((size_t)jobs > ntodo) jobs = ntodo > 0 ? (int)ntodo : 1;
+    for (; started < jobs - 1; started++) {
+        if (pthread_create(&threads[started], NULL, _hash_worker, &pool) != 0) break;
+    }
+    _hash_worker(&pool);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+// Group jobs by size, then partial hash, then path
+static int _hash_job_cmp(const void *a, const void *b) {
+    const hash_job *x = a;
+    const hash_job *y = b;
+    if (x->size != y->size) return (x->size > y->size) - (x->size < y->size);
+    if (x->has_head != y->has_head) return x->has_head - y->has_head;
+    if (x->head != y->head) return (x->head > y->head) - (x->head < y->head);
+    return strcmp(x->path, y->path);
+}
+
+// Sizes (at least hash_min_size) held by two or more files across all shards, sorted
+static sqlite3_int64 *_colliding_sizes(sqlite3 *db, size_t *count) {
+    sqlite3_int64 *sizes = NULL;
+    sqlite3_int64 *counts = NULL;
+    size_t n = 0, cap = 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(_shard_db(db, k),
+                "SELECT size, count(*) FROM files WHERE type = 'file' AND size >= ? GROUP BY size;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare size query: %s", sqlite3_errmsg(_shard_db(db, k)));
+            free(sizes);
+            free(counts);
+            return NULL;
+        }
+        sqlite3_bind_int64(stmt, 1, hash_min_size);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 1024;
+                sqlite3_int64 *grown_sizes = realloc(sizes, cap * sizeof(*sizes));
+                if (grown_sizes) sizes = grown_sizes;
+                sqlite3_int64 *grown_counts = realloc(counts, cap * 2 * sizeof(*counts));
+                if (grown_counts) counts = grown_counts;
+                if (!grown_sizes || !grown_counts) {
+                    LOG_ERROR("Failed to allocate size list");
+                    sqlite3_finalize(stmt);
+                    free(sizes);
+                    free(counts);
+                    return NULL;
+                }
+            }
+            // (size, count) pairs, so sorting by the first column keeps them together
+            counts[2 * n] = sqlite3_column_int64(stmt, 0);
+            counts[2 * n + 1] = sqlite3_column_int64(stmt, 1);
+            n++;
+        }
+        sqlite3_finalize(stmt);
+    }
+    qsort(counts, n, 2 * sizeof(*counts), _sqlite_int64_cmp);
+    size_t out = 0;
+    for (size_t i = 0; i < n;) {
+        sqlite3_int64 total = 0;
+        size_t j = i;
+        for (; j < n && counts[2 * j] == counts[2 * i]; j++) total += counts[2 * j + 1];
+        if (total >= 2) sizes[out++] = counts[2 * i];
+        i = j;
+    }
+    free(counts);
+    *count = out;
+    return sizes;
+}
+
+// Load every file whose size collides, with any hashes already stored
+static hash_job *_load_hash_jobs(sqlite3 *db, const sqlite3_int64 *sizes, size_t nsizes, size_t *count) {
+    hash_job *jobs = NULL;
+    size_t n = 0, cap = 0;
+    int failed = 0;
+    for (int k = 0; k < _shard_count(db) && !failed; k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(shard,
+                "SELECT f.id, f.size, f.head_hash, f.hash, d.path || '/' || f.name, f.mtime FROM files f "
+                "JOIN dirs d ON d.id = f.dir_id WHERE f.type = 'file' AND f.size >= ?;",
+                -1, &stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare hash candidate query: %s", sqlite3_errmsg(shard));
+            failed = 1;
+            break;
+        }
+        sqlite3_bind_int64(stmt, 1, hash_min_size);
+        while (!failed && sqlite3_step(stmt) == SQLITE_ROW) {
+            sqlite3_int64 size = sqlite3_column_int64(stmt, 1);
+            if (!bsearch(&size, sizes, nsizes, sizeof(*sizes), _sqlite_int64_cmp)) continue;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 1024;
+                hash_job *grown = realloc(jobs, cap * sizeof(*jobs));
+                if (!grown) {
+                    failed = 1;
+                    break;
+                }
+                jobs = grown;
+            }
+            hash_job *job = &jobs[n];
+            memset(job, 0, sizeof(*job));
+            job->shard = shard;
+            job->id = sqlite3_column_int64(stmt, 0);
+            job->size = size;
+            job->mtime = sqlite3_column_int64(stmt, 5);
+            job->has_head = sqlite3_column_type(stmt, 2) != SQLITE_NULL;
+            job->head = (uint64_t)sqlite3_column_int64(stmt, 2);
+            job->has_full = sqlite3_column_type(stmt, 3) != SQLITE_NULL;
+            job->full = (uint64_t)sqlite3_column_int64(stmt, 3);
+            if (!(job->path = strdup((const char *)sqlite3_column_text(stmt, 4)))) {
+                failed = 1;
+                break;
+            }
+            n++;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (failed) {
+        LOG_ERROR("Failed to load files to hash");
+        for (size_t i = 0; i < n; i++) free(jobs[i].path);
+        free(jobs);
+        return NULL;
+    }
+    *count = n;
+    return jobs;
+}
+
+// Store hashes computed by this run, one transaction per shard
+static int _store_hashes(sqlite3 *db, hash_job *jobs, size_t n) {
+    int rc = 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(shard, "UPDATE files SET head_hash = ?, hash = ? WHERE id = ? AND mtime = ? AND size = ?;", -1, &stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare hash update: %s", sqlite3_errmsg(shard));
+            return 1;
+        }
+        sqlite3_exec(shard, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+        for (size_t i = 0; i < n; i++) {
+            hash_job *job = &jobs[i];
+            if (job->shard != shard || !job->dirty) continue;
+            sqlite3_bind_int64(stmt, 1, (sqlite3_int64)job->head);
+            if (job->has_full) {
+                sqlite3_bind_int64(stmt, 2, (sqlite3_int64)job->full);
+            } else {
+                sqlite3_bind_null(stmt, 2);
+            }
+            sqlite3_bind_int64(stmt, 3, job->id);
+            sqlite3_bind_int64(stmt, 4, job->mtime);
+            sqlite3_bind_int64(stmt, 5, job->size);
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                LOG_ERROR("Failed to store hash of %s: %s", job->path, sqlite3_errmsg(shard));
+                rc = 1;
+            }
+            sqlite3_reset(stmt);
+        }
+        sqlite3_exec(shard, "COMMIT;", NULL, NULL, NULL);
+        sqlite3_finalize(stmt);
+    }
+    return rc;
+}
+
+// --hash: partial hashes for files of colliding sizes, full ones where those collide too
+int _hash_files(sqlite3 *db, int jobs) {
+    long long started = _now_ms();
+    size_t nsizes = 0, njobs = 0;
+    sqlite3_int64 *sizes = _colliding_sizes(db, &nsizes);
+    if (!sizes) return 1;
+    hash_job *all = nsizes ? _load_hash_jobs(db, sizes, nsizes, &njobs) : NULL;
+    free(sizes);
+    if (nsizes && !all) return 1;
+    size_t *todo = njobs ? malloc(njobs * sizeof(size_t)) : NULL;
+    if (njobs && !todo) {
+        LOG_ERROR("Failed to allocate hash work list");
+        for (size_t i = 0; i < njobs; i++) free(all[i].path);
+        free(all);
+        return 1;
+    }
+
+    size_t ntodo = 0, nheads = 0, nfull = 0;
+    for (size_t i = 0; i < njobs; i++) {
+        if (!all[i].has_head) todo[ntodo++] = i;
+    }
+    nheads = ntodo;
+    _hash_run(all, todo, ntodo, 0, jobs);
+
+    // Full hashes only inside groups that still agree on size and partial hash
+    qsort(all, njobs, sizeof(*all), _hash_job_cmp);
+    ntodo = 0;
+    for (size_t i = 0; i < njobs;) {
+        size_t j = i + 1;
+        while (j < njobs && all[j].size == all[i].size && all[j].has_head && all[i].has_head && all[j].head == all[i].head) j++;
+        for (size_t m = i; j - i > 1 && m < j; m++) {
+            if (!all[m].has_full) todo[ntodo++] = m;
+        }
+        i = j;
+    }
+    nfull = ntodo;
+    _hash_run(all, todo, ntodo, 1, jobs);
+
+    int rc = _store_hashes(db, all, njobs);
+    LOG_INFO("Hashed %zu of %zu files with colliding sizes (%zu partial, %zu full) in %lld ms",
+             nheads + nfull, njobs, nheads, nfull, _now_ms() - started);
+    for (size_t i = 0; i < njobs; i++) free(all[i].path);
+    free(all);
+    free(todo);
+    return rc;
+}
+
+// Larger files first, then by hash and path, so each group of copies is contiguous
+static int _dupe_cmp(const void *a, const void *b) {
+    const hash_job *x = a;
+    const hash_job *y = b;
+    if (x->size != y->size) return (x->size < y->size) - (x->size > y->size);
+    if (x->full != y->full) return (x->full > y->full) - (x->full < y->full);
+    return strcmp(x->path, y->path);
+}
+
+// Print one group of identical files in --format
+static void _print_dupe_group(print_out *out, const hash_job *group, size_t n) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)group[0].full);
+    switch (output_format) {
+        case FORMAT_NULL:
+            for (size_t i = 0; i < n; i++) _print_put(out, group[i].path, strlen(group[i].path) + 1);
+            _print_put(out, "", 1);     // an empty path ends the group
+            break;
+        case FORMAT_TSV:
+            for (size_t i = 0; i < n; i++) {
+                _print_str(out, hex);
+                _print_put(out, "\t", 1);
+                _print_int(out, group[i].size);
+                _print_put(out, "\t", 1);
+                _print_tsv_str(out, group[i].path);
+                _print_put(out, "\n", 1);
+            }
+            break;
+        case FORMAT_JSON:
+            _print_str(out, "{\"hash\":\"");
+            _print_str(out, hex);
+            _print_str(out, "\",\"size\":");
+            _print_int(out, group[0].size);
+            _print_str(out, ",\"paths\":[");
+            for (size_t i = 0; i < n; i++) {
+                _print_str(out, i ? ",\"" : "\"");
+                _print_json_str(out, group[i].path);
+                _print_str(out, "\"");
+            }
+            _print_str(out, "]}\n");
+            break;
+        default:
+            _print_int(out, (sqlite3_int64)n);
+            _print_str(out, " copies of ");
+            _print_int(out, group[0].size);
+            _print_str(out, " bytes (hash ");
+            _print_str(out, hex);
+            _print_str(out, "):\n");
+            for (size_t i = 0; i < n; i++) {
+                _print_str(out, "  ");
+                _print_str(out, group[i].path);
+                _print_str(out, "\n");
+            }
+            _print_str(out, "\n");
+            break;
+    }
+}
+
+// `windex dupes`: groups of files with equal size and full hash, as of the last index --hash
+int _print_dupes(sqlite3 *db) {
+    hash_job *rows = NULL;
+    size_t n = 0, cap = 0;
+    int failed = 0;
+    for (int k = 0; k < _shard_count(db) && !failed; k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(shard,
+                "SELECT f.size, f.hash, d.path || '/' || f.name FROM files f "
+                "JOIN dirs d ON d.id = f.dir_id WHERE f.hash IS NOT NULL;", -1, &stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare duplicate query: %s", sqlite3_errmsg(shard));
+            failed = 1;
+            break;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 1024;
+                hash_job *grown = realloc(rows, cap * sizeof(*rows));
+                if (!grown) {
+                    failed = 1;
+                    break;
+                }
+                rows = grown;
+            }
+            memset(&rows[n], 0, sizeof(rows[n]));
+            rows[n].size = sqlite3_column_int64(stmt, 0);
+            rows[n].full = (uint64_t)sqlite3_column_int64(stmt, 1);
+            if (!(rows[n].path = strdup((const char *)sqlite3_column_text(stmt, 2)))) {
+                failed = 1;
+                break;
+            }
+            n++;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (failed) {
+        LOG_ERROR("Failed to load file hashes");
+    } else if (n == 0) {
+        fprintf(stderr, "No file hashes in the index; run index --hash first.\n");
+    } else {
+        static print_out out;
+        out.fp = stdout;
+        size_t groups = 0;
+        sqlite3_int64 wasted = 0;
+        qsort(rows, n, sizeof(*rows), _dupe_cmp);
+        for (size_t i = 0; i < n && !out.failed;) {
+            size_t j = i + 1;
+            while (j < n && rows[j].size == rows[i].size && rows[j].full == rows[i].full) j++;
+            if (j - i > 1) {
+                _print_dupe_group(&out, &rows[i], j - i);
+                groups++;
+                wasted += rows[i].size * (sqlite3_int64)(j - i - 1);
+            }
+            i = j;
+        }
+        _print_flush(&out);
+        LOG_INFO("%zu groups of duplicates; %lld bytes in extra copies", groups, (long long)wasted);
+    }
+    for (size_t i = 0; i < n; i++) free(rows[i].path);
+    free(rows);
+    return failed;
+}
+
+// Signed values as varints without ten bytes for small negatives
+static uint64_t _zigzag(sqlite3_int64 value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static sqlite3_int64 _unzigzag(uint64_t value) {
+    return (sqlite3_int64)(value >> 1) ^ -(sqlite3_int64)(value & 1);
+}
+
+// Snapshot writer: buffered, hashing everything written for the trailing checksum
+static void _snap_flush(snapshot_writer *w) {
+    if (w->len && !w->failed) {
+        _hash_update(&w->hs, w->buf, w->len);
+        if (fwrite(w->buf, 1, w->len, w->fp) != w->len) w->failed = 1;
+    }
+    w->len = 0;
+}
+
+static void _snap_put(snapshot_writer *w, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        if (w->len == sizeof(w->buf)) _snap_flush(w);
+        size_t n = sizeof(w->buf) - w->len < len ? sizeof(w->buf) - w->len : len;
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+// LEB128: 7 bits per byte, high bit set on all but the last
+static void _snap_put_varint(snapshot_writer *w, uint64_t value) {
+    unsigned char tmp[10];
+    size_t n = 0;
+    do {
+        tmp[n] = value & 0x7f;
+        value >>= 7;
+        if (value) tmp[n] |= 0x80;
+        n++;
+    } while (value);
+    _snap_put(w, tmp, n);
+}
+
+static void _snap_put_u64(snapshot_writer *w, uint64_t value) {
+    unsigned char tmp[8];
+    for (int i = 0; i < 8; i++) tmp[i] = (unsigned char)(value >> (8 * i));
+    _snap_put(w, tmp, sizeof(tmp));
+}
+
+static void _snap_put_meta(snapshot_writer *w, const char *key, sqlite3_int64 value) {
+    _snap_put_varint(w, strlen(key));
+    _snap_put(w, key, strlen(key));
+    _snap_put_varint(w, _zigzag(value));
+}
+
+// Snapshot reader: bytes are hashed as they're consumed, up to the checksum
+static int _snap_fill(snapshot_reader *r) {
+    _hash_update(&r->hs, r->buf + r->hashed, r->pos - r->hashed);
+    r->len = fread(r->buf, 1, sizeof(r->buf), r->fp);
+    r->pos = r->hashed = 0;
+    return r->len > 0;
+}
+
+static int _snap_get(snapshot_reader *r, void *data, size_t len) {
+    unsigned char *p = data;
+    while (len > 0) {
+        if (r->pos == r->len && !_snap_fill(r)) return r->failed = 1;
+        size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+        memcpy(p, r->buf + r->pos, n);
+        r->pos += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t _snap_get_varint(snapshot_reader *r) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->pos == r->len && !_snap_fill(r)) break;
+        unsigned char byte = r->buf[r->pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    r->failed = 1;
+    return 0;
+}
+
+static uint64_t _snap_get_u64(snapshot_reader *r) {
+    unsigned char tmp[8];
+    uint64_t value = 0;
+    if (_snap_get(r, tmp, sizeof(tmp)) != 0) return 0;
+    for (int i = 0; i < 8; i++) value |= (uint64_t)tmp[i] << (8 * i);
+    return value;
+}
+
+// Per-shard cursor over (dir, name) order for the export merge
+typedef struct {
+    sqlite3_stmt *stmt;
+    int has_row;
+} snapshot_cursor;
+
+static int _snap_cursor_before(snapshot_cursor *a, snapshot_cursor *b) {
+    int c = strcmp((const char *)sqlite3_column_text(a->stmt, 0), (const char *)sqlite3_column_text(b->stmt, 0));
+    if (!c) c = strcmp((const char *)sqlite3_column_text(a->stmt, 1), (const char *)sqlite3_column_text(b->stmt, 1));
+    return c < 0;
+}
+
+// `windex export`: every entry, sorted by directory then name, front-coded against the previous path
+int _export_snapshot(sqlite3 *db, const char *path) {
+    long long started = _now_ms();
+    snapshot_cursor cursors[MAX_SHARDS] = {{0}};
+    int nshards = _shard_count(db);
+    sqlite3_int64 entries = 0;
+    int rc = 0;
+
+    for (int k = 0; k < nshards && rc == 0; k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        entries += _pragma_int(shard, "SELECT count(*) FROM files;");
+        if (sqlite3_prepare_v2(shard,
+                "SELECT d.path, f.name, f.type, f.size, f.mtime, f.head_hash, f.hash FROM files f "
+                "JOIN dirs d ON d.id = f.dir_id ORDER BY d.path, f.name;", -1, &cursors[k].stmt, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare export query: %s", sqlite3_errmsg(shard));
+            rc = 1;
+        }
+    }
+    // Readers see one consistent state throughout
+    if (rc == 0) _exec_shards(db, "BEGIN TRANSACTION;");
+
+    snapshot_writer *w = rc == 0 ? calloc(1, sizeof(snapshot_writer)) : NULL;
+    if (rc == 0 && (!w || !(w->fp = fopen(path, "wb")))) {
+        LOG_ERROR("Cannot create snapshot %s: %s", path, w ? strerror(errno) : "out of memory");
+        rc = 1;
+    }
+    if (rc == 0) {
+        _hash_init(&w->hs, 0);
+        _snap_put(w, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        _snap_put_varint(w, 4);
+        _snap_put_meta(w, "schema", SCHEMA_VERSION);
+        _snap_put_meta(w, "entries", entries);
+        _snap_put_meta(w, "shards", nshards);
+        _snap_put_meta(w, "exported", (sqlite3_int64)time(NULL));
+
+        char prev[MAX_PATH] = "";
+        size_t prev_len = 0;
+        sqlite3_int64 written = 0;
+        for (int k = 0; k < nshards; k++) cursors[k].has_row = sqlite3_step(cursors[k].stmt) == SQLITE_ROW;
+        for (;;) {
+            snapshot_cursor *best = NULL;
+            for (int k = 0; k < nshards; k++) {
+                if (cursors[k].has_row && (!best || _snap_cursor_before(&cursors[k], best))) best = &cursors[k];
+            }
+            if (!best || w->failed) break;
+            sqlite3_stmt *stmt = best->stmt;
+            char full[MAX_PATH];
+            int len = snprintf(full, sizeof(full), "%s/%s", sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1));
+            if (len > 0 && len < (int)sizeof(full)) {
+                size_t shared = 0;
+                while (shared < prev_len && full[shared] == prev[shared]) shared++;
+                int flags = strcmp((const char *)sqlite3_column_text(stmt, 2), "dir") == 0 ? SNAP_DIR : 0;
+                if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) flags |= SNAP_HEAD_HASH;
+                if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) flags |= SNAP_HASH;
+                unsigned char flag_byte = (unsigned char)flags;
+                _snap_put_varint(w, shared);
+                _snap_put_varint(w, (size_t)len - shared);
+                _snap_put(w, full + shared, (size_t)len - shared);
+                _snap_put(w, &flag_byte, 1);
+                _snap_put_varint(w, (uint64_t)sqlite3_column_int64(stmt, 3));
+                _snap_put_varint(w, _zigzag(sqlite3_column_int64(stmt, 4)));
+                if (flags & SNAP_HEAD_HASH) _snap_put_u64(w, (uint64_t)sqlite3_column_int64(stmt, 5));
+                if (flags & SNAP_HASH) _snap_put_u64(w, (uint64_t)sqlite3_column_int64(stmt, 6));
+                memcpy(prev, full, (size_t)len + 1);
+                prev_len = (size_t)len;
+                written++;
+            }
+            best->has_row = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+        _snap_flush(w);
+        if (written != entries) {
+            LOG_ERROR("Snapshot has %lld of %lld entries (paths too long for MAX_PATH are skipped)",
+                      (long long)written, (long long)entries);
+            rc = 1;
+        }
+        uint64_t checksum = _hash_digest(&w->hs);
+        _snap_put_u64(w, checksum);
+        w->failed |= w->len && fwrite(w->buf, 1, w->len, w->fp) != w->len;
+        if (fclose(w->fp) != 0 || w->failed) {
+            LOG_ERROR("Failed to write snapshot %s: %s", path, strerror(errno));
+            rc = 1;
+        }
+        if (rc == 0) {
+            LOG_INFO("Exported %lld entries to %s in %lld ms", (long long)written, path, _now_ms() - started);
+        } else {
+            remove(path);
+        }
+    }
+    free(w);
+    for (int k = 0; k < nshards; k++) sqlite3_finalize(cursors[k].stmt);
+    _exec_shards(db, "COMMIT;");
+    return rc;
+}
+
+// `windex import`: load a snapshot into an empty index, building secondary indexes once at the end
+int _import_snapshot(sqlite3 *db, const char *path) {
+    long long started = _now_ms();
+    int nshards = _shard_count(db);
+    for (int k = 0; k < nshards; k++) {
+        if (_pragma_int(_shard_db(db, k), "SELECT EXISTS (SELECT 1 FROM files);")) {
+            LOG_ERROR("import needs an empty database; %s already has entries", sqlite3_db_filename(db, "main"));
+            return 1;
+        }
+    }
+    snapshot_reader *r = calloc(1, sizeof(snapshot_reader));
+    if (!r || !(r->fp = fopen(path, "rb"))) {
+        LOG_ERROR("Cannot open snapshot %s: %s", path, r ? strerror(errno) : "out of memory");
+        free(r);
+        return 1;
+    }
+    _hash_init(&r->hs, 0);
+
+    int rc = 0;
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    sqlite3_int64 entries = -1;
+    sqlite3_int64 schema = -1;
+    if (_snap_get(r, magic, sizeof(magic)) != 0 || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+        LOG_ERROR("%s is not a windex snapshot", path);
+        rc = 1;
+    }
+    // Unknown keys are skipped so newer exports stay readable
+    uint64_t nmeta = rc == 0 ? _snap_get_varint(r) : 0;
+    for (uint64_t i = 0; i < nmeta && !r->failed; i++) {
+        char key[64] = "";
+        uint64_t key_len = _snap_get_varint(r);
+        if (key_len >= sizeof(key)) {
+            r->failed = 1;
+            break;
+        }
+        _snap_get(r, key, (size_t)key_len);
+        sqlite3_int64 value = _unzigzag(_snap_get_varint(r));
+        if (strcmp(key, "entries") == 0) entries = value;
+        else if (strcmp(key, "schema") == 0) schema = value;
+    }
+    if (rc == 0 && (r->failed || entries < 0 || schema < 0)) {
+        LOG_ERROR("Snapshot %s has a corrupt header", path);
+        rc = 1;
+    } else if (rc == 0 && (schema < SNAPSHOT_MIN_SCHEMA || schema > SCHEMA_VERSION)) {
+        LOG_ERROR("Snapshot %s has schema version %lld; this windex reads %d to %d", path, (long long)schema,
+                  SNAPSHOT_MIN_SCHEMA, SCHEMA_VERSION);
+        rc = 1;
+    }
+
+    sqlite3_stmt *inserts[MAX_SHARDS] = {0};
+    int began = rc == 0;
+    if (rc == 0) {
+        _exec_shards(db, "BEGIN TRANSACTION;");
+        for (int k = 0; k < nshards && rc == 0; k++) {
+            sqlite3 *shard = _shard_db(db, k);
+            char *err_msg = NULL;
+            if (sqlite3_exec(shard, bulk_drop_sql, NULL, NULL, &err_msg) != SQLITE_OK ||
+                sqlite3_prepare_v2(shard,
+                    "INSERT INTO files (dir_id, name, type, size, mtime, name_lc, head_hash, hash) "
+                    "VALUES (?, ?, ?, ?, ?, ?, ?, ?);", -1, &inserts[k], NULL) != SQLITE_OK) {
+                LOG_ERROR("Failed to prepare import: %s", err_msg ? err_msg : sqlite3_errmsg(shard));
+                sqlite3_free(err_msg);
+                rc = 1;
+            }
+        }
+    }
+
+    char full[MAX_PATH] = "";
+    size_t full_len = 0;
+    sqlite3_int64 loaded = 0;
+    int corrupt = 0;
+    for (; rc == 0 && loaded < entries; loaded++) {
+        uint64_t shared = _snap_get_varint(r);
+        uint64_t suffix = _snap_get_varint(r);
+        if (r->failed || shared > full_len || suffix >= sizeof(full) - shared ||
+            _snap_get(r, full + shared, (size_t)suffix) != 0) {
+            rc = corrupt = 1;
+            break;
+        }
+        full_len = (size_t)(shared + suffix);
+        full[full_len] = '\0';
+        unsigned char flags = 0;
+        _snap_get(r, &flags, 1);
+        sqlite3_int64 size = (sqlite3_int64)_snap_get_varint(r);
+        sqlite3_int64 mtime = _unzigzag(_snap_get_varint(r));
+        uint64_t head = flags & SNAP_HEAD_HASH ? _snap_get_u64(r) : 0;
+        uint64_t hash = flags & SNAP_HASH ? _snap_get_u64(r) : 0;
+        if (r->failed) {
+            rc = corrupt = 1;
+            break;
+        }
+
+        char dir[MAX_PATH];
+        char name_lc[MAX_NAME];
+        const char *name = _split_path(full, dir, sizeof(dir));
+        sqlite3 *shard = _shard_for_dir(db, dir);
+        sqlite3_stmt *stmt = NULL;
+        for (int k = 0; k < nshards && !stmt; k++) {
+            if (_shard_db(db, k) == shard) stmt = inserts[k];
+        }
+        sqlite3_int64 dir_id = _resolve_dir_id(shard, dir, 1);
+        if (!dir_id || !stmt) {
+            rc = 1;
+            break;
+        }
+        _lower_copy(name_lc, name, MAX_NAME);
+        sqlite3_bind_int64(stmt, 1, dir_id);
+        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, flags & SNAP_DIR ? "dir" : "file", -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, size);
+        sqlite3_bind_int64(stmt, 5, mtime);
+        sqlite3_bind_text(stmt, 6, name_lc, -1, SQLITE_STATIC);
+        if (flags & SNAP_HEAD_HASH) {
+            sqlite3_bind_int64(stmt, 7, (sqlite3_int64)head);
+        } else {
+            sqlite3_bind_null(stmt, 7);
+        }
+        if (flags & SNAP_HASH) {
+            sqlite3_bind_int64(stmt, 8, (sqlite3_int64)hash);
+        } else {
+            sqlite3_bind_null(stmt, 8);
+        }
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            LOG_ERROR("Failed to import %s: %s", full, sqlite3_errmsg(shard));
+            rc = 1;
+        }
+        sqlite3_reset(stmt);
+    }
+    if (rc == 0) {
+        _hash_update(&r->hs, r->buf + r->hashed, r->pos - r->hashed);
+        r->hashed = r->pos;
+        uint64_t expected = _hash_digest(&r->hs);
+        if (_snap_get_u64(r) != expected || r->failed) rc = corrupt = 1;
+        // The checksum ends the file: anything after it means the count or the file is wrong
+        if (rc == 0 && (r->pos < r->len || _snap_fill(r))) {
+            LOG_ERROR("Snapshot %s has data after its last entry", path);
+            rc = 1;
+        }
+    }
+    if (corrupt) LOG_ERROR("Snapshot %s is truncated or corrupt after %lld entries", path, (long long)loaded);
+
+    for (int k = 0; k < nshards; k++) sqlite3_finalize(inserts[k]);
+    if (rc == 0) rc = _bulk_rebuild(db);
+    if (began) _exec_shards(db, rc == 0 ? "COMMIT;" : "ROLLBACK;");
+    fclose(r->fp);
+    free(r);
+    if (rc == 0) LOG_INFO("Imported %lld entries from %s in %lld ms", (long long)loaded, path, _now_ms() - started);
+    return rc;
+}
+
+// Where the search server for a database listens; returns nonzero if it doesn't fit
+static int _serve_address(const char *db_path, char *addr, size_t size) {
+#ifdef _WIN32
+    return snprintf(addr, size, "\\\\.\\pipe\\windex-%016llx", (unsigned long long)_path_hash(db_path)) >= (int)size;
+#else
+    return snprintf(addr, size, "%s.sock", db_path) >= (int)size;
+#endif
+}
+
+// Connect to the search server for db_path, if one is running
+static serve_fd _serve_connect(const char *db_path) {
+#ifdef _WIN32
+    char addr[MAX_PATH];
+    if (_serve_address(db_path, addr, sizeof(addr)) != 0) return SERVE_FD_INVALID;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        HANDLE pipe = CreateFileA(addr, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE) return pipe;
+        // Busy with another client: it answers quickly, so wait briefly once
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(addr, 200)) break;
+    }
+    return SERVE_FD_INVALID;
+#else
+    struct sockaddr_un sa = {0};
+    sa.sun_family = AF_UNIX;
+    if (_serve_address(db_path, sa.sun_path, sizeof(sa.sun_path)) != 0) return SERVE_FD_INVALID;
+    if (access(sa.sun_path, F_OK) != 0) return SERVE_FD_INVALID;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return SERVE_FD_INVALID;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return SERVE_FD_INVALID;
+    }
+    return fd;
+#endif
+}
+
+static void _serve_close(serve_fd fd) {
+#ifdef _WIN32
+    CloseHandle(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Read whatever is available, waiting at most timeout_ms for it (-1: no limit); 0 at end
+// of stream, -1 on error or timeout
+static long _serve_read(serve_fd fd, char *buf, size_t len, int timeout_ms) {
+#ifdef _WIN32
+    // The pipe is synchronous: wait for data with PeekNamedPipe so ReadFile can't block
+    long long deadline = _now_ms() + timeout_ms;
+    DWORD avail = 0;
+    while (timeout_ms >= 0) {
+        if (!PeekNamedPipe(fd, NULL, 0, NULL, &avail, NULL)) return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+        if (avail > 0) break;
+        if (_now_ms() >= deadline) return -1;
+        Sleep(10);
+    }
+    DWORD n = 0;
+    if (!ReadFile(fd, buf, (DWORD)len, &n, NULL)) return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+    return (long)n;
+#else
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) return -1;
+    ssize_t n;
+    do {
+        n = read(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return (long)n;
+#endif
+}
+
+static int _serve_write_all(serve_fd fd, const char *buf, size_t len) {
+    while (len > 0) {
+#ifdef _WIN32
+        DWORD n = 0;
+        if (!WriteFile(fd, buf, (DWORD)len, &n, NULL)) return 1;
+#else
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+#endif
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void _serve_out_flush(serve_out *out) {
+    if (out->len && !out->failed) out->failed = _serve_write_all(out->fd, out->buf, out->len);
+    out->len = 0;
+}
+
+static void _serve_out_put(serve_out *out, const char *data, size_t len) {
+    while (len > 0 && !out->failed) {
+        if (out->len == SERVE_BUF_SIZE) _serve_out_flush(out);
+        size_t n = SERVE_BUF_SIZE - out->len;
+        if (n > len) n = len;
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Send one hit as "mtime<TAB>size<TAB>type<TAB>path\n"; the path goes last so it may contain tabs
+static int _serve_emit_hit(const search_hit *hit, void *ctx) {
+    serve_out *out = ctx;
+    char head[96];
+    int n = snprintf(head, sizeof(head), "%lld\t%lld\t%s\t", (long long)hit->mtime, (long long)hit->size, hit->type);
+    _serve_out_put(out, head, (size_t)n);
+    // A newline in a name would end the record early
+    for (const char *p = hit->path; *p;) {
+        size_t run = strcspn(p, "\n");
+        _serve_out_put(out, p, run);
+        p += run;
+        if (*p) {
+            _serve_out_put(out, "?", 1);
+            p++;
+        }
+    }
+    _serve_out_put(out, "\n", 1);
+    return out->failed;
+}
+
+// Answer "<pattern>[<TAB>limit<TAB>sort[<TAB>fuzzy budget<TAB>jobs]]"; the defaults keep
+// older clients working
+static void _serve_search(sqlite3 *db, char *args, serve_out *out) {
+    int limit = SEARCH_LIMIT;
+    int sort = SORT_MTIME;
+    long budget = fuzzy_budget_ms;
+    long jobs = search_jobs;
+    char *tab = strchr(args, '\t');
+    if (tab) {
+        *tab = '\0';
+        char *end;
+        long n = strtol(tab + 1, &end, 10);
+        size_t name_len = *end == '\t' ? strcspn(end + 1, "\t") : 0;
+        for (sort = 0; name_len && sort_names[sort]; sort++) {
+            if (strlen(sort_names[sort]) == name_len && strncmp(end + 1, sort_names[sort], name_len) == 0) break;
+        }
+        int ok = n >= 1 && n <= MAX_SEARCH_LIMIT && name_len && sort_names[sort];
+        if (ok && end[1 + name_len] == '\t') {
+            budget = strtol(end + 2 + name_len, &end, 10);
+            if (*end == '\t') jobs = strtol(end + 1, &end, 10);
+            ok = *end == '\0' && budget >= 0 && budget <= 60000 && jobs >= 1 && jobs <= MAX_JOBS;
+        }
+        if (!ok) {
+            _serve_out_put(out, "!bad search options\n", 20);
+            return;
+        }
+        limit = (int)n;
+    }
+    // One client at a time, so the request's settings can stand in for the server's own
+    int saved_budget = fuzzy_budget_ms;
+    int saved_jobs = search_jobs;
+    fuzzy_budget_ms = (int)budget;
+    search_jobs = (int)jobs;
+    if (_search_run(db, args, limit, sort, _serve_emit_hit, out) != 0) {
+        _serve_out_put(out, "!search failed\n", 15);
+    }
+    fuzzy_budget_ms = saved_budget;
+    search_jobs = saved_jobs;
+}
+
+// Answer every request line from one client; each reply ends with an empty line
+static void _serve_client(sqlite3 *db, serve_fd fd) {
+    static serve_out out;
+    char line[MAX_PATH + 64];
+    size_t len = 0;
+    out.fd = fd;
+    out.len = 0;
+    out.failed = 0;
+    for (;;) {
+        long n = _serve_read(fd, line + len, sizeof(line) - 1 - len, SERVE_IDLE_MS);
+        if (n <= 0) return;
+        len += (size_t)n;
+
+        char *start = line;
+        char *nl;
+        while ((nl = memchr(start, '\n', len - (size_t)(start - line)))) {
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+            if (strncmp(start, "search\t", 7) == 0) {
+                _serve_search(db, start + 7, &out);
+            } else if (strcmp(start, "ping") != 0) {
+                _serve_out_put(&out, "!unknown request\n", 17);
+            }
+            _serve_out_put(&out, "\n", 1);
+            _serve_out_flush(&out);
+            if (out.failed) return;
+            start = nl + 1;
+        }
+        len -= (size_t)(start - line);
+        memmove(line, start, len);
+        if (len == sizeof(line) - 1) {
+            _serve_out_put(&out, "!request too long\n\n", 19);
+            _serve_out_flush(&out);
+            return;
+        }
+    }
+}
+
+// Pull the name index, trigram index and directory paths into the page cache
+static void _serve_warm(sqlite3 *db) {
+    static const char *sql =
+        "PRAGMA cache_size = -131072;"
+        "SELECT sum(length(name_lc)) FROM files INDEXED BY idx_name_lc;"
+        "SELECT sum(length(block)) FROM files_fts_data;"
+        "SELECT sum(length(path)) FROM dirs;";
+    long long started = _now_ms();
+    for (int k = 0; k < _shard_count(db); k++) {
+        char *err_msg = NULL;
+        if (sqlite3_exec(_shard_db(db, k), sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+            LOG_ERROR("Failed to warm shard %d: %s", k, err_msg ? err_msg : "unknown error");
+            sqlite3_free(err_msg);
+        }
+    }
+    LOG_INFO("Warmed the page cache in %lld ms", _now_ms() - started);
+}
+
+// Rebuild every shard's name index from fresh read-only connections
+static void *_name_builder_main(void *arg) {
+    name_builder *nb = arg;
+    int rc = 0;
+    for (int k = 0; k < nb->nshards && rc == 0; k++) {
+        char tmp[MAX_PATH + 16];
+        sqlite3 *conn;
+        snprintf(tmp, sizeof(tmp), "%s.names.tmp", nb->paths[k]);
+        if (sqlite3_open_v2(nb->paths[k], &conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+            LOG_ERROR("Failed to open %s for the name index: %s", nb->paths[k], sqlite3_errmsg(conn));
+            rc = 1;
+        } else {
+            sqlite3_busy_timeout(conn, 5000);
+            rc = _write_name_index(conn, tmp);
+        }
+        sqlite3_close(conn);
+    }
+    pthread_mutex_lock(&nb->lock);
+    nb->rc = rc;
+    nb->done = 1;
+    pthread_mutex_unlock(&nb->lock);
+    return NULL;
+}
+
+// Join a finished rebuild and move its files over the mapped ones
+static void _name_builder_swap(sqlite3 *db, name_builder *nb) {
+    pthread_join(nb->thread, NULL);
+    nb->running = 0;
+    nb->finished = _now_ms();
+    for (int k = 0; k < nb->nshards; k++) {
+        char path[MAX_PATH + 8];
+        char tmp[MAX_PATH + 16];
+        snprintf(path, sizeof(path), "%s.names", nb->paths[k]);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        if (nb->rc != 0) {
+            remove(tmp);
+            continue;
+        }
+        _unload_name_index(_shard_db(db, k));
+        if (_replace_file(tmp, path) != 0) LOG_ERROR("Failed to replace name index %s", path);
+    }
+    if (nb->rc == 0) LOG_INFO("Name index rebuilt");
+}
+
+// Swap in a finished rebuild, or start one when a shard's name index is stale
+static void _serve_refresh_names(sqlite3 *db, name_builder *nb) {
+    if (search_engine != ENGINE_NAMES) return;
+    if (nb->running) {
+        pthread_mutex_lock(&nb->lock);
+        int done = nb->done;
+        pthread_mutex_unlock(&nb->lock);
+        if (done) _name_builder_swap(db, nb);
+        return;
+    }
+    if (_now_ms() - nb->finished < NAME_REBUILD_MS) return;
+
+    int stale = 0;
+    nb->nshards = _shard_count(db);
+    for (int k = 0; k < nb->nshards; k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        snprintf(nb->paths[k], sizeof(nb->paths[k]), "%s", sqlite3_db_filename(shard, "main"));
+        if (!_get_name_index(shard)) stale = 1;
+    }
+    if (!stale) return;
+    nb->done = 0;
+    if (pthread_create(&nb->thread, NULL, _name_builder_main, nb) != 0) {
+        LOG_ERROR("Failed to start the name index builder");
+        nb->finished = _now_ms();
+        return;
+    }
+    nb->running = 1;
+    LOG_INFO("Name index is stale; rebuilding in the background");
+}
+
+// Keep the database open and answer searches from local clients until interrupted
+int _serve(sqlite3 *db, const char *db_path, int warm) {
+    char addr[MAX_PATH];
+    name_builder builder = { .lock = PTHREAD_MUTEX_INITIALIZER };
+    serve_fd probe = _serve_connect(db_path);
+    if (probe != SERVE_FD_INVALID) {
+        _serve_close(probe);
+        LOG_ERROR("A search server is already running for %s", db_path);
+        return 1;
+    }
+    if (warm) _serve_warm(db);
+
+#ifdef _WIN32
+    if (_serve_address(db_path, addr, sizeof(addr)) != 0) return 1;
+    HANDLE pipe = CreateNamedPipeA(addr, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                   PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                   1, SERVE_BUF_SIZE, SERVE_BUF_SIZE, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        LOG_ERROR("Failed to create pipe %s: error %lu", addr, GetLastError());
+        return 1;
+    }
+    LOG_INFO("Serving searches on %s", addr);
+    // Ctrl+C ends the process; the pipe goes away with it
+    while (!stop_requested) {
+        if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+            LOG_ERROR("Failed to accept a client: error %lu", GetLastError());
+            break;
+        }
+        _serve_refresh_names(db, &builder);
+        _serve_client(db, pipe);
+        FlushFileBuffers(pipe);
+        DisconnectNamedPipe(pipe);
+    }
+    CloseHandle(pipe);
+#else
+    struct sockaddr_un sa = {0};
+    sa.sun_family = AF_UNIX;
+    if (_serve_address(db_path, sa.sun_path, sizeof(sa.sun_path)) != 0) {
+        LOG_ERROR("Socket path for %s is too long", db_path);
+        return 1;
+    }
+    snprintf(addr, sizeof(addr), "%s", sa.sun_path);
+    unlink(addr);   // left behind by a server that didn't exit cleanly
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG_ERROR("Failed to create socket: %s", strerror(errno));
+        return 1;
+    }
+    mode_t old_mask = umask(077);   // the index lists the user's files: owner only
+    int bound = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    umask(old_mask);
+    if (bound != 0 || listen(fd, 16) != 0) {
+        LOG_ERROR("Failed to listen on %s: %s", addr, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    _catch_stop_signals();
+    signal(SIGPIPE, SIG_IGN);   // a client that hangs up mid-reply mustn't kill the server
+    LOG_INFO("Serving searches on %s", addr);
+    while (!stop_requested) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("Failed to accept a client: %s", strerror(errno));
+            break;
+        }
+        // A client that stops reading its reply mustn't hold up the next one either
+        struct timeval idle = { SERVE_IDLE_MS / 1000, (SERVE_IDLE_MS % 1000) * 1000 };
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+        _serve_refresh_names(db, &builder);
+        _serve_client(db, client);
+        close(client);
+    }
+    close(fd);
+    unlink(addr);
+#endif
+    if (builder.running) _name_builder_swap(db, &builder);
+    LOG_INFO("Search server for %s stopped", db_path);
+    return 0;
+}
+
+// Ask a running server to search; returns 0 if it answered, 1 to search locally instead
+int _search_forward(const char *db_path, const char *pattern, int limit, int sort) {
+    if (strpbrk(pattern, "\t\r\n")) return 1;
+    serve_fd fd = _serve_connect(db_path);
+    if (fd == SERVE_FD_INVALID) return 1;
+
+    // Fuzzy searches also carry this side's budget and scoring threads
+    char request[MAX_PATH + 64];
+    int n = sort == SORT_SCORE
+                ? snprintf(request, sizeof(request), "search\t%s\t%d\t%s\t%d\t%d\n", pattern, limit, sort_names[sort],
+                           fuzzy_budget_ms, search_jobs)
+                : snprintf(request, sizeof(request), "search\t%s\t%d\t%s\n", pattern, limit, sort_names[sort]);
+    if (n >= (int)sizeof(request) || _serve_write_all(fd, request, (size_t)n) != 0) {
+        _serve_close(fd);
+        return 1;
+    }
+
+    // Lines are "mtime<TAB>size<TAB>type<TAB>path", then an empty line
+    static print_out out;
+    out.fp = stdout;
+    char buf[MAX_PATH + 128];
+    size_t len = 0;
+    int shown = 0;
+    int done = 0;
+    while (!done) {
+        long got = _serve_read(fd, buf + len, sizeof(buf) - 1 - len, -1);
+        if (got <= 0) break;
+        len += (size_t)got;
+        char *start = buf;
+        char *nl;
+        while (!done && (nl = memchr(start, '\n', len - (size_t)(start - buf)))) {
+            *nl = '\0';
+            if (*start == '\0') {
+                done = 1;
+            } else if (*start == '!') {
+                LOG_ERROR("Search server: %s", start + 1);
+            } else {
+                search_hit hit = {0};
+                char *p = start;
+                hit.mtime = strtoll(p, &p, 10);
+                if (*p == '\t') hit.size = strtoll(p + 1, &p, 10);
+                char *type = *p == '\t' ? p + 1 : p;
+                char *tab = strchr(type, '\t');
+                if (tab) {
+                    *tab = '\0';
+                    snprintf(hit.type, sizeof(hit.type), "%s", type);
+                    hit.path = tab + 1;
+                    if (_print_hit(&hit, &out) != 0) done = 1;
+                    shown++;
+                }
+            }
+            start = nl + 1;
+        }
+        len -= (size_t)(start - buf);
+        memmove(buf, start, len);
+        if (len == sizeof(buf) - 1) break;
+    }
+    _print_flush(&out);
+    _serve_close(fd);
+    if (!done) {
+        LOG_ERROR("Search server hung up mid-reply");
+        return shown ? 0 : 1;
+    }
+    return 0;
+}
+
+// Free pages as a share of the database file, in percent
+static int _free_percent(sqlite3 *db) {
+    sqlite3_int64 pages = _pragma_int(db, "PRAGMA page_count;");
+    return pages > 0 ? (int)(_pragma_int(db, "PRAGMA freelist_count;") * 100 / pages) : 0;
+}
+
+// Is an automatic maintenance pass due? Only once MAINTAIN_INTERVAL has passed since the
+// last one, and only when enough change batches or free pages have built up since
+int _maintain_due(sqlite3 *db) {
+    if ((sqlite3_int64)time(NULL) - _get_meta_int(db, "maintained_at", 0) < MAINTAIN_INTERVAL) return 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        if (_get_meta_int(shard, "changes", 0) - _get_meta_int(shard, "maintained_changes", 0) >= MAINTAIN_CHANGES ||
+            _free_percent(shard) >= MAINTAIN_FREE_PERCENT) return 1;
+    }
+    return 0;
+}
+
+// Run one maintenance statement; with a server running, pause afterwards so its searches
+// get the disk and the locks back between steps
+static int _maintain_step(sqlite3 *db, const char *sql, int paced) {
+    char *err_msg = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("Maintenance step failed (%s): %s", sql, err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    if (paced) sqlite3_sleep(MAINTAIN_PAUSE_MS);
+    return 0;
+}
+
+// Statistics, FTS segment merges, free page reclaim and a WAL checkpoint for one shard
+static int _maintain_shard(sqlite3 *db, int forced, int paced) {
+    char sql[96];
+    int rc = 0;
+
+    // A full ANALYZE the first time or on request, bounded per index; after that PRAGMA
+    // optimize re-analyzes only the tables that have changed enough to need it
+    if (forced || !_pragma_int(db, "SELECT count(*) FROM sqlite_master WHERE name = 'sqlite_stat1';")) {
+        snprintf(sql, sizeof(sql), "PRAGMA analysis_limit = %d; ANALYZE;", MAINTAIN_ANALYSIS_ROWS);
+        rc |= _maintain_step(db, sql, paced);
+    } else {
+        rc |= _maintain_step(db, "PRAGMA optimize;", paced);
+    }
+
+    // Merge FTS segments a bounded number of pages at a time; a negative count merges
+    // toward a single segment, and a step that writes nothing means it is done
+    int merges = 0;
+    snprintf(sql, sizeof(sql), "INSERT INTO files_fts(files_fts, rank) VALUES ('merge', %d);", -MAINTAIN_STEP_PAGES);
+    for (;;) {
+        int before = sqlite3_total_changes(db);
+        if (_maintain_step(db, sql, paced) != 0) {
+            rc = 1;
+            break;
+        }
+        if (sqlite3_total_changes(db) - before < 2) break;
+        merges++;
+    }
+
+    // Databases created with auto_vacuum=INCREMENTAL give free pages back in steps; older
+    // ones are converted by an explicit maintain, which needs one full VACUUM
+    sqlite3_int64 freed = _pragma_int(db, "PRAGMA freelist_count;");
+    if (_pragma_int(db, "PRAGMA auto_vacuum;") == 2) {
+        snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", MAINTAIN_STEP_PAGES);
+        sqlite3_int64 left = freed;
+        while (left > 0 && rc == 0) {
+            rc |= _maintain_step(db, sql, paced);
+            sqlite3_int64 now = _pragma_int(db, "PRAGMA freelist_count;");
+            if (now >= left) break;
+            left = now;
+        }
+        freed -= left;
+    } else if (forced && _free_percent(db) >= MAINTAIN_FREE_PERCENT) {
+        if (paced) {
+            LOG_INFO("Skipping VACUUM while a search server is running; stop it and run maintain again");
+            freed = 0;
+        } else {
+            rc |= _maintain_step(db, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", 0);
+        }
+    } else {
+        freed = 0;
+    }
+
+    // A running server may hold a read snapshot; TRUNCATE would wait on it, PASSIVE does not
+    rc |= _maintain_step(db, paced ? "PRAGMA wal_checkpoint(PASSIVE);" : "PRAGMA wal_checkpoint(TRUNCATE);", 0);
+    if (rc == 0) rc |= _set_meta_int(db, "maintained_changes", _get_meta_int(db, "changes", 0));
+    LOG_INFO("Maintained %s: %d FTS merge steps, %lld free pages reclaimed", sqlite3_db_filename(db, "main"),
+             merges, (long long)freed);
+    return rc;
+}
+
+// Compact and re-analyze every shard, then rebuild stale sidecar search structures.
+// Yields to a running search server: steps are paced, and VACUUM and the name index
+// rebuild (which the server does itself) are left out
+int _maintain(sqlite3 *db, const char *db_path, int forced) {
+    long long started = _now_ms();
+    serve_fd probe = _serve_connect(db_path);
+    int paced = probe != SERVE_FD_INVALID;
+    if (paced) _serve_close(probe);
+    int rc = 0;
+    int stale = 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        rc |= _maintain_shard(shard, forced, paced);
+        if (!_get_name_index(shard)) stale = 1;
+    }
+    if (stale && !paced && _has_name_index(db)) rc |= _build_name_indexes(db);
+    if (rc == 0) rc |= _set_meta_int(db, "maintained_at", (sqlite3_int64)time(NULL));
+    LOG_INFO("Maintenance finished in %lld ms%s", _now_ms() - started, paced ? " (paced for the search server)" : "");
+    return rc;
+}
+
+// splitmix64: small, seedable and the same on every platform
+static uint64_t _bench_rand(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static const char *bench_exts[] = { ".txt", ".c", ".h", ".jpg", ".pdf", ".log", ".dat", "", NULL };
+
+// Random name, bench_name_min to bench_name_max characters before the extension
+static void _bench_name(uint64_t *rng, char *buf, int is_dir) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+    int len = bench_name_min + (int)(_bench_rand(rng) % (uint64_t)(bench_name_max - bench_name_min + 1));
+    int i = 0;
+    for (; i < len; i++) buf[i] = alphabet[_bench_rand(rng) % (sizeof(alphabet) - 1)];
+    buf[i] = '\0';
+    if (!is_dir) strcat(buf, bench_exts[_bench_rand(rng) % (sizeof(bench_exts) / sizeof(bench_exts[0]) - 1)]);
+}
+
+// Create bench_files files and bench_fanout subdirectories per level, sampling names for queries
+static int _bench_generate(const char *dir, int depth, uint64_t *rng, bench_run *run) {
+    char path[MAX_PATH];
+    char name[MAX_NAME];
+    for (int i = 0; i < bench_files; i++) {
+        _bench_name(rng, name, 0);
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            LOG_ERROR("Failed to create %s: %s", path, strerror(errno));
+            return 1;
+        }
+        fclose(f);
+        // Reservoir sample, so queries come from all over the tree
+        run->files++;
+        uint64_t slot = run->files <= BENCH_SAMPLES ? (uint64_t)run->files - 1 : _bench_rand(rng) % (uint64_t)run->files;
+        if (slot < BENCH_SAMPLES) snprintf(run->samples[slot], MAX_NAME, "%s", name);
+    }
+    if (depth == 0) return 0;
+    for (int i = 0; i < bench_fanout; i++) {
+        _bench_name(rng, name, 1);
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (mkdir(path) != 0) {
+            if (errno == EEXIST) continue;  // same random name twice: the seed decides, so it's still reproducible
+            LOG_ERROR("Failed to create %s: %s", path, strerror(errno));
+            return 1;
+        }
+        run->dirs++;
+        if (_bench_generate(path, depth - 1, rng, run) != 0) return 1;
+    }
+    return 0;
+}
+
+// Delete a generated tree; only ever called on a directory holding BENCH_MARKER
+static int _bench_remove_tree(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return 1;
+    struct dirent *entry;
+    char path[MAX_PATH];
+    int rc = 0;
+    while ((entry = readdir(d))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        struct stat st;
+#ifdef _WIN32
+        int is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#else
+        int is_dir = lstat(path, &st) == 0 && S_ISDIR(st.st_mode);    // never follow a link out of the tree
+#endif
+        if (is_dir) {
+            rc |= _bench_remove_tree(path);
+        } else if (remove(path) != 0) {
+            rc = 1;
+        }
+    }
+    closedir(d);
+    return rc | (rmdir(dir) != 0);
+}
+
+static int _bench_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Touch, delete or add a sibling for about 1% of files
+static int _bench_churn(const char *dir, uint64_t *rng, long *changed) {
+    DIR *d = opendir(dir);
+    if (!d) return 1;
+    // List first: creating and deleting while readdir() runs may skip or repeat entries
+    char **names = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (!grown) break;
+            names = grown;
+        }
+        if (!(names[count] = strdup(entry->d_name))) break;
+        count++;
+    }
+    closedir(d);
+    // readdir() order is filesystem-specific; sort so the same entries churn everywhere
+    qsort(names, count, sizeof(char *), _bench_name_cmp);
+
+    int rc = 0;
+    char path[MAX_PATH];
+    for (size_t i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        struct stat st;
+        if (stat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            rc |= _bench_churn(path, rng, changed);
+        } else if (strcmp(names[i], BENCH_MARKER) != 0 && _bench_rand(rng) % 100 == 0) {
+            switch (_bench_rand(rng) % 3) {
+                case 0: {
+                    struct utimbuf times = { st.st_atime, st.st_mtime - 86400 };
+                    if (utime(path, &times) != 0) rc = 1;
+                    break;
+                }
+                case 1:
+                    if (remove(path) != 0) rc = 1;
+                    break;
+                default: {
+                    char added[MAX_PATH + 8];
+                    snprintf(added, sizeof(added), "%s.new", path);
+                    FILE *f = fopen(added, "wb");
+                    if (f) fclose(f);
+                    else rc = 1;
+                    break;
+                }
+            }
+            (*changed)++;
+        }
+    }
+    for (size_t i = 0; i < count; i++) free(names[i]);
+    free(names);
+    return rc;
+}
+
+// Remove the bench database, its shards, journals and name index sidecars
+static void _bench_remove_db(const char *db_path) {
+    static const char *suffixes[] = { "", "-wal", "-shm", "-journal", ".names", NULL };
+    char path[MAX_PATH + 32];
+    for (int k = 0; k < MAX_SHARDS; k++) {
+        for (int i = 0; suffixes[i]; i++) {
+            if (k == 0) snprintf(path, sizeof(path), "%s%s", db_path, suffixes[i]);
+            else snprintf(path, sizeof(path), "%s.%d%s", db_path, k, suffixes[i]);
+            remove(path);
+        }
+    }
+}
+
+// Bytes on disk for the database, its shards and WAL files
+static long long _bench_db_bytes(const char *db_path) {
+    static const char *suffixes[] = { "", "-wal", NULL };
+    char path[MAX_PATH + 32];
+    long long total = 0;
+    struct stat st;
+    for (int k = 0; k < MAX_SHARDS; k++) {
+        for (int i = 0; suffixes[i]; i++) {
+            if (k == 0) snprintf(path, sizeof(path), "%s%s", db_path, suffixes[i]);
+            else snprintf(path, sizeof(path), "%s.%d%s", db_path, k, suffixes[i]);
+            if (stat(path, &st) == 0) total += (long long)st.st_size;
+        }
+    }
+    return total;
+}
+
+static sqlite3 *_bench_open(const char *db_path) {
+    sqlite3 *db;
+    if (_init_db(db_path, &db) != 0) return NULL;
+    if (_open_shards(db, db_path, shard_request) != 0) {
+        _close_db(db);
+        return NULL;
+    }
+    return db;
+}
+
+// One index run in a fresh connection, like a separate `windex index`
+static int _bench_index(const char *db_path, const char *root, int jobs, bench_phase *phase) {
+    sqlite3 *db = _bench_open(db_path);
+    if (!db) return 1;
+    long long started = _now_us();
+    if (jobs > 1 && dir_mtime_mode == DIR_MTIME_OFF) {
+        _index_files_parallel(db, &root, 1, jobs);
+    } else {
+        _index_files_dynamic(db, &root, 1);
+    }
+    if (search_engine == ENGINE_NAMES) _build_name_indexes(db);
+    phase->us = _now_us() - started;
+    for (int k = 0; k < _shard_count(db); k++) {
+        phase->entries += _pragma_int(_shard_db(db, k), "SELECT count(*) FROM files;");
+    }
+    _close_db(db);
+    return 0;
+}
+
+static int _bench_count_hit(const search_hit *hit, void *ctx) {
+    (void)hit;
+    (*(long *)ctx)++;
+    return 0;
+}
+
+static int _bench_us_cmp(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The fixed query mix: each sampled name as short, trigram, long, prefix and exact patterns
+static int _bench_queries(const bench_run *run, char queries[][MAX_NAME]) {
+    int n = 0;
+    for (int i = 0; i < BENCH_SAMPLES && run->samples[i][0]; i++) {
+        const char *s = run->samples[i];
+        size_t len = strlen(s);
+        snprintf(queries[n++], MAX_NAME, "%.2s", s + len / 2 - (len / 2 ? 1 : 0));
+        snprintf(queries[n++], MAX_NAME, "%.3s", s + (len > 3 ? len / 3 : 0));
+        snprintf(queries[n++], MAX_NAME, "%.6s", s);
+        snprintf(queries[n++], MAX_NAME, "%.3s*", s);
+        snprintf(queries[n++], MAX_NAME, "%s", s);
+    }
+    snprintf(queries[n++], MAX_NAME, ".pdf");
+    snprintf(queries[n++], MAX_NAME, "zzqqzzqq");   // no match
+    return n;
+}
+
+static long long _bench_rate(long long entries, long long us) {
+    return us > 0 ? entries * 1000000 / us : 0;
+}
+
+// `windex bench`: build a synthetic tree under dir and time index and search against it
+int _bench(const char *dir, int jobs) {
+    char tree[MAX_PATH];
+    char marker[MAX_PATH + 32];
+    char db_path[MAX_PATH];
+    char json_path[MAX_PATH];
+    struct stat st;
+    if (snprintf(tree, sizeof(tree), "%s/tree", dir) >= (int)sizeof(tree) ||
+        snprintf(db_path, sizeof(db_path), "%s/bench.db", dir) >= (int)sizeof(db_path) ||
+        snprintf(json_path, sizeof(json_path), "%s/bench.json", dir) >= (int)sizeof(json_path)) {
+        LOG_ERROR("Bench directory path is too long: %s", dir);
+        return 1;
+    }
+    snprintf(marker, sizeof(marker), "%s/%s", tree, BENCH_MARKER);
+    if (stat(dir, &st) != 0 && mkdir(dir) != 0) {
+        LOG_ERROR("Failed to create %s: %s", dir, strerror(errno));
+        return 1;
+    }
+    if (stat(tree, &st) == 0) {
+        if (access(marker, F_OK) != 0) {
+            LOG_ERROR("%s exists and was not made by windex bench; not touching it", tree);
+            return 1;
+        }
+        if (_bench_remove_tree(tree) != 0) {
+            LOG_ERROR("Failed to remove the previous bench tree %s", tree);
+            return 1;
+        }
+    }
+
+    bench_run run;
+    memset(&run, 0, sizeof(run));
+    uint64_t rng = bench_seed;
+    long long started = _now_us();
+    FILE *f;
+    if (mkdir(tree) != 0 || !(f = fopen(marker, "wb"))) {
+        LOG_ERROR("Failed to create %s: %s", tree, strerror(errno));
+        return 1;
+    }
+    fclose(f);
+    if (_bench_generate(tree, bench_depth, &rng, &run) != 0) return 1;
+    long long generate_us = _now_us() - started;
+    LOG_INFO("Bench tree: %ld directories, %ld files in %lld ms", run.dirs, run.files, generate_us / 1000);
+
+    _bench_remove_db(db_path);
+    if (_bench_index(db_path, tree, jobs, &run.cold) != 0 ||
+        _bench_index(db_path, tree, jobs, &run.warm) != 0) {
+        return 1;
+    }
+    long changed = 0;
+    if (_bench_churn(tree, &rng, &changed) != 0) LOG_ERROR("Some churn operations failed");
+    if (_bench_index(db_path, tree, jobs, &run.churn) != 0) return 1;
+
+    // Query latencies, each query bench_rounds times
+    char queries[BENCH_SAMPLES * 5 + 2][MAX_NAME];
+    int nqueries = _bench_queries(&run, queries);
+    int nlat = nqueries * bench_rounds;
+    long long *lat = malloc(nlat * sizeof(long long));
+    sqlite3 *db = _bench_open(db_path);
+    if (!lat || !db) {
+        free(lat);
+        if (db) _close_db(db);
+        return 1;
+    }
+    long hits = 0;
+    for (int r = 0, i = 0; r < bench_rounds; r++) {
+        for (int q = 0; q < nqueries; q++, i++) {
+            long long t = _now_us();
+            _search_run(db, queries[q], search_limit, search_sort, _bench_count_hit, &hits);
+            lat[i] = _now_us() - t;
+        }
+    }
+    _close_db(db);
+    qsort(lat, nlat, sizeof(long long), _bench_us_cmp);
+
+    char json[4096];
+    int len = snprintf(json, sizeof(json),
+        "{\n"
+        "  \"tree\": {\"fanout\": %d, \"depth\": %d, \"files_per_dir\": %d, \"name_len\": [%d, %d], \"seed\": %llu,\n"
+        "           \"dirs\": %ld, \"files\": %ld, \"generate_ms\": %lld},\n"
+        "  \"options\": {\"jobs\": %d, \"shards\": %d, \"engine\": \"%s\", \"io\": \"%s\", \"fast_meta\": %d,\n"
+        "              \"dir_mtime\": %d},\n"
+        "  \"index_cold\": {\"ms\": %lld, \"entries\": %lld, \"entries_per_sec\": %lld},\n"
+        "  \"index_warm\": {\"ms\": %lld, \"entries\": %lld, \"entries_per_sec\": %lld},\n"
+        "  \"index_churn\": {\"ms\": %lld, \"entries\": %lld, \"entries_per_sec\": %lld, \"changed\": %ld},\n"
+        "  \"search\": {\"queries\": %d, \"rounds\": %d, \"limit\": %d, \"hits\": %ld,\n"
+        "             \"p50_us\": %lld, \"p99_us\": %lld, \"max_us\": %lld},\n"
+        "  \"db_bytes\": %lld\n"
+        "}\n",
+        bench_fanout, bench_depth, bench_files, bench_name_min, bench_name_max, (unsigned long long)bench_seed,
+        run.dirs, run.files, generate_us / 1000,
+        jobs, shard_request ? shard_request : 1, engine_names[search_engine], io_names[io_backend], fast_meta, dir_mtime_mode,
+        run.cold.us / 1000, run.cold.entries, _bench_rate(run.cold.entries, run.cold.us),
+        run.warm.us / 1000, run.warm.entries, _bench_rate(run.warm.entries, run.warm.us),
+        run.churn.us / 1000, run.churn.entries, _bench_rate(run.churn.entries, run.churn.us), changed,
+        nqueries, bench_rounds, search_limit, hits,
+        lat[(nlat + 1) / 2 - 1], lat[(99 * nlat + 99) / 100 - 1], lat[nlat - 1],
+        _bench_db_bytes(db_path));
+    free(lat);
+    fwrite(json, 1, (size_t)len, stdout);
+    if ((f = fopen(json_path, "w"))) {
+        fwrite(json, 1, (size_t)len, f);
+        fclose(f);
+    }
+    return 0;
+}
+
+// Parse --commit-interval: "50000" entries, "500ms" or "2s"; 0 commits once at the end
+static int _parse_commit_interval(const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (end == arg || value < 0) return -1;
+    if (*end == '\0') {
+        commit_rows = value;
+        commit_ms = 0;
+    } else if (strcmp(end, "ms") == 0) {
+        commit_ms = value;
+        commit_rows = 0;
+    } else if (strcmp(end, "s") == 0) {
+        commit_ms = value * 1000;
+        commit_rows = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (logger_init("logs/windex.log", LOG_DEBUG, 1) != 0) {
+        fprintf(stderr, "Logger initialization failed. Exiting.\n");
+        return 1;
+    }
+
+    const char *hommy = getenv("HOME") ? getenv("HOME") : ".";
+    const char *root = access("/mnt/", F_OK) == 0 ? "/mnt/" : "C:\\";
+    const char *custom_db = NULL;
+    int jobs = 1;
+    int diff_mode = 0;
+    int local_only = 0;
+    int fuzzy = 0;
+
+    // Parse command-line options
+    struct option long_options[] = {
+        {"root", required_argument, 0, 'r'},
+        {"exclude", required_argument, 0, 'e'},
+        {"db", required_argument, 0, 'd'},
+        {"jobs", required_argument, 0, 'j'},
+        {"diff", no_argument, 0, OPT_DIFF},
+        {"fast-meta", no_argument, 0, OPT_FAST_META},
+        {"no-dir-meta", no_argument, 0, OPT_NO_DIR_META},
+        {"batch-size", required_argument, 0, OPT_BATCH_SIZE},
+        {"commit-interval", required_argument, 0, OPT_COMMIT_INTERVAL},
+        {"profile", required_argument, 0, OPT_PROFILE},
+        {"dir-mtime", no_argument, 0, OPT_DIR_MTIME},
+        {"trust-dir-mtime", no_argument, 0, OPT_TRUST_DIR_MTIME},
+        {"shards", required_argument, 0, OPT_SHARDS},
+        {"warm", no_argument, 0, OPT_WARM},
+        {"local", no_argument, 0, OPT_LOCAL},
+        {"engine", required_argument, 0, OPT_ENGINE},
+        {"io", required_argument, 0, OPT_IO},
+        {"fuzzy", no_argument, 0, OPT_FUZZY},
+        {"fuzzy-budget", required_argument, 0, OPT_FUZZY_BUDGET},
+        {"no-maintain", no_argument, 0, OPT_NO_MAINTAIN},
+        {"limit", required_argument, 0, OPT_LIMIT},
+        {"sort", required_argument, 0, OPT_SORT},
+        {"format", required_argument, 0, OPT_FORMAT},
+        {"epoch", no_argument, 0, OPT_EPOCH},
+        {"fanout", required_argument, 0, OPT_FANOUT},
+        {"depth", required_argument, 0, OPT_DEPTH},
+        {"files", required_argument, 0, OPT_FILES},
+        {"name-len", required_argument, 0, OPT_NAME_LEN},
+        {"seed", required_argument, 0, OPT_SEED},
+        {"rounds", required_argument, 0, OPT_ROUNDS},
+        {"stats", optional_argument, 0, OPT_STATS},
+        {"hash", no_argument, 0, OPT_HASH},
+        {"hash-min", required_argument, 0, OPT_HASH_MIN},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    _init_excluded_dirs();
+    while ((opt = getopt_long(argc, argv, "r:e:d:j:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                if (_add_root(optarg) != 0) {
+                    fprintf(stderr, "Error: at most %d --root options.\n", MAX_ROOTS);
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case 'e':
+                _add_exclude_dir(optarg);
+                break;
+            case 'd':
+                custom_db = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1 || jobs > MAX_JOBS) {
+                    fprintf(stderr, "Error: --jobs must be between 1 and %d.\n", MAX_JOBS);
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_DIFF:
+                diff_mode = 1;
+                break;
+            case OPT_BATCH_SIZE:
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+                    fprintf(stderr, "Error: --batch-size must be between 1 and %d.\n", MAX_BATCH_SIZE);
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_COMMIT_INTERVAL:
+                if (_parse_commit_interval(optarg) != 0) {
+                    fprintf(stderr, "Error: --commit-interval takes a row count, or milliseconds/seconds such as 500ms or 2s.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_PROFILE:
+                for (profile_override = 0; profile_names[profile_override]; profile_override++) {
+                    if (strcmp(optarg, profile_names[profile_override]) == 0) break;
+                }
+                if (!profile_names[profile_override]) {
+                    fprintf(stderr, "Error: --profile must be fast or safe.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_SHARDS:
+                shard_request = atoi(optarg);
+                if (shard_request < 1 || shard_request > MAX_SHARDS) {
+                    fprintf(stderr, "Error: --shards must be between 1 and %d.\n", MAX_SHARDS);
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_WARM:
+                serve_warm = 1;
+                break;
+            case OPT_LOCAL:
+                local_only = 1;
+                break;
+            case OPT_LIMIT:
+                search_limit = atoi(optarg);
+                if (search_limit < 1 || search_limit > MAX_SEARCH_LIMIT) {
+                    fprintf(stderr, "Error: --limit must be between 1 and %d.\n", MAX_SEARCH_LIMIT);
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_SORT:
+                for (search_sort = 0; sort_names[search_sort]; search_sort++) {
+                    if (strcmp(optarg, sort_names[search_sort]) == 0) break;
+                }
+                if (!sort_names[search_sort]) {
+                    fprintf(stderr, "Error: --sort must be mtime, size, name or score.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_FORMAT:
+                for (output_format = 0; format_names[output_format]; output_format++) {
+                    if (strcmp(optarg, format_names[output_format]) == 0) break;
+                }
+                if (!format_names[output_format]) {
+                    fprintf(stderr, "Error: --format must be plain, null, json or tsv.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_EPOCH:
+                epoch_times = 1;
+                break;
+            case OPT_STATS:
+                if (!optarg) {
+                    stats_mode = STATS_TEXT;
+                    break;
+                }
+                for (stats_mode = 0; stats_modes[stats_mode]; stats_mode++) {
+                    if (strcmp(optarg, stats_modes[stats_mode]) == 0) break;
+                }
+                if (!stats_modes[stats_mode]) {
+                    fprintf(stderr, "Error: --stats must be text, json or off.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_HASH:
+                hash_files = 1;
+                break;
+            case OPT_HASH_MIN: {
+                char *end;
+                long long value = strtoll(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || value < 1) {
+                    fprintf(stderr, "Error: --hash-min must be a size in bytes of at least 1.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                hash_min_size = value;
+                break;
+            }
+            case OPT_FUZZY:
+                fuzzy = 1;
+                break;
+            case OPT_NO_MAINTAIN:
+                auto_maintain = 0;
+                break;
+            case OPT_FUZZY_BUDGET:
+                fuzzy_budget_ms = atoi(optarg);
+                if (fuzzy_budget_ms < 0 || fuzzy_budget_ms > 60000) {
+                    fprintf(stderr, "Error: --fuzzy-budget must be between 0 and 60000 ms.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_FANOUT:
+            case OPT_DEPTH:
+            case OPT_FILES:
+            case OPT_ROUNDS: {
+                int value = atoi(optarg);
+                int max = opt == OPT_DEPTH ? 16 : 100000;
+                if (value < (opt == OPT_ROUNDS ? 1 : 0) || value > max) {
+                    fprintf(stderr, "Error: --%s must be between %d and %d.\n",
+                            opt == OPT_FANOUT ? "fanout" : opt == OPT_DEPTH ? "depth" : opt == OPT_FILES ? "files" : "rounds",
+                            opt == OPT_ROUNDS ? 1 : 0, max);
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                if (opt == OPT_FANOUT) bench_fanout = value;
+                else if (opt == OPT_DEPTH) bench_depth = value;
+                else if (opt == OPT_FILES) bench_files = value;
+                else bench_rounds = value;
+                break;
+            }
+            case OPT_NAME_LEN:
+                if (sscanf(optarg, "%d-%d", &bench_name_min, &bench_name_max) != 2 ||
+                    bench_name_min < 1 || bench_name_max < bench_name_min || bench_name_max > MAX_NAME - 16) {
+                    fprintf(stderr, "Error: --name-len takes MIN-MAX, from 1 to %d.\n", MAX_NAME - 16);
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_SEED:
+                bench_seed = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_ENGINE:
+                for (search_engine = 0; engine_names[search_engine]; search_engine++) {
+                    if (strcmp(optarg, engine_names[search_engine]) == 0) break;
+                }
+                if (!engine_names[search_engine]) {
+                    fprintf(stderr, "Error: --engine must be fts or names.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_IO:
+                for (io_backend = 0; io_names[io_backend]; io_backend++) {
+                    if (strcmp(optarg, io_names[io_backend]) == 0) break;
+                }
+                if (!io_names[io_backend]) {
+                    fprintf(stderr, "Error: --io must be auto, posix, uring or find.\n");
+                    _free_excluded_dirs();
+                    return 1;
+                }
+                break;
+            case OPT_DIR_MTIME:
+                if (dir_mtime_mode == DIR_MTIME_OFF) dir_mtime_mode = DIR_MTIME_LIST;
+                break;
+            case OPT_TRUST_DIR_MTIME:
+                dir_mtime_mode = DIR_MTIME_TREE;
+                break;
+            case OPT_NO_DIR_META:
+                skip_dir_meta = 1;
+                /* fall through */
+            case OPT_FAST_META:
+                fast_meta = 1;
+                break;
+            case 'h':
+                printf("Usage: %s [--root <path>] [--exclude <dir>] [--db <path>] [--jobs <n>] [--diff] [--fast-meta] index | watch | search <query> | serve | --help\n", argv[0]);
+                printf("Options:\n");
+                printf("  --root <path>    Set root directory to index (default: %s). Repeat to index several\n", root);
+                printf("                   roots concurrently, each with its own --jobs walkers\n");
+                printf("  --exclude <dir>  Exclude entries with this name (case-insensitive), or everything\n");
+                printf("                   below a path when it contains a separator\n");
+                printf("  --db <path>      Set custom database file path (default: ~/.windex/.winindex.db)\n");
+                printf("  --jobs <n>       Walk directories with n threads while indexing, or score a --fuzzy\n");
+                printf("                   search with n threads per shard (default: 1)\n");
+                printf("  --diff           Load existing entries into memory once and diff the walk against them\n");
+                printf("  --fast-meta      Use readdir's d_type and stat relative to the open directory\n");
+                printf("  --no-dir-meta    With --fast-meta, skip stat for directories (size/mtime stored as 0)\n");
+                printf("  --io <backend>   Directory listing: posix (readdir + stat), uring (Linux: each directory's\n");
+                printf("                   stats in flight together through io_uring), find (Windows:\n");
+                printf("                   FindFirstFileExW, no per-file stat) or auto (default: %s)\n", io_names[IO_DEFAULT]);
+                printf("  --dir-mtime      List directories whose mtime is unchanged from the index instead of\n");
+                printf("                   reading them; their subdirectories are still checked. Edits that\n");
+                printf("                   don't touch the directory (file content, size) are not picked up\n");
+                printf("  --trust-dir-mtime\n");
+                printf("                   Like --dir-mtime, but skip unchanged directories' whole subtrees\n");
+                printf("  --shards <n>     Split a new index over n database files by directory; searches\n");
+                printf("                   query them in parallel, and --jobs writes them in parallel\n");
+                printf("  --profile <fast|safe>\n");
+                printf("                   SQLite tuning, remembered in the database (default: safe)\n");
+                printf("                   fast: WAL, synchronous=NORMAL, large cache and mmap; searches\n");
+                printf("                   don't block while an index run is writing\n");
+                printf("  --batch-size <n> Rows per multi-row insert/upsert (default: %d)\n", DEFAULT_BATCH_SIZE);
+                printf("  --commit-interval <n|Nms|Ns>\n");
+                printf("                   Commit every n entries or N milliseconds/seconds (default: %d entries, 0 = once)\n",
+                       DEFAULT_COMMIT_ROWS);
+                printf("  --warm           With serve, load the search indexes into memory at startup\n");
+                printf("  --local          Search the database directly even if a server is running\n");
+                printf("  --limit <n>      Show at most n search results (default: %d)\n", SEARCH_LIMIT);
+                printf("  --sort <mtime|size|name|score>\n");
+                printf("                   Order search results newest first, largest first, by name, or by\n");
+                printf("                   --fuzzy score (default: mtime); only the best --limit rows are kept\n");
+                printf("                   in memory\n");
+                printf("  --fuzzy          Match the pattern as a subsequence (winh finds windows.h) and rank by\n");
+                printf("                   score: runs, word starts and matches in the name count most. Same as\n");
+                printf("                   --sort score; filters still apply, and --jobs threads score each shard\n");
+                printf("  --fuzzy-budget <ms>\n");
+                printf("                   Stop scoring after ms milliseconds and rank what was reached, names\n");
+                printf("                   sharing a trigram with the pattern first (default: %d; 0 = no limit)\n", FUZZY_BUDGET_MS);
+                printf("  --format <plain|null|json|tsv>\n");
+                printf("                   Search output: plain blocks (default), NUL-terminated paths for\n");
+                printf("                   xargs -0, one JSON object per line, or path/type/size/modified\n");
+                printf("                   columns with \\t \\n \\\\ escapes\n");
+                printf("  --epoch          Print modification times as Unix seconds\n");
+                printf("  --engine <fts|names>\n");
+                printf("                   names: answer searches from a suffix array over file names kept in\n");
+                printf("                   <db>.names (built by index, rebuilt in the background by serve).\n");
+                printf("                   It matches names only, not directories above them; patterns with\n");
+                printf("                   a separator, --sort size, or a stale sidecar fall back to fts (default)\n");
+                printf("  --fanout <n>, --depth <n>, --files <n>, --name-len <min-max>, --seed <n>\n");
+                printf("                   bench tree shape: subdirectories and files per directory, levels,\n");
+                printf("                   name lengths (default: %d, %d, %d, %d-%d, seed %d)\n",
+                       BENCH_FANOUT, BENCH_DEPTH, BENCH_FILES, BENCH_NAME_MIN, BENCH_NAME_MAX, 1);
+                printf("  --rounds <n>     bench: run the query mix n times (default: %d)\n", BENCH_ROUNDS);
+                printf("  --stats[=text|json]\n");
+                printf("                   After index, print calls and time per phase (opendir, readdir, stat,\n");
+                printf("                   exclude, lookup, upsert, stamp, prune, commit) and SQLite statement\n");
+                printf("                   runs and VM steps\n");
+                printf("  --hash           After index, hash files whose size matches another file's: both\n");
+                printf("                   ends first, the whole file only when those agree too. Hashes are\n");
+                printf("                   kept until the file's mtime changes; read with --jobs threads\n");
+                printf("  --hash-min <n>   Only hash files of at least n bytes (default: 1)\n");
+                printf("  --no-maintain    Do not run maintain after index, even when one is due\n");
+                printf("  --help           Show this help message\n");
+                printf("Commands:\n");
+                printf("  index            Index files from the root directories\n");
+                printf("  roots            List indexed roots with their last scan time, duration and entries\n");
+                printf("  watch            Keep the index current from change notifications until interrupted\n");
+                printf("                   (inotify on Linux, ReadDirectoryChangesW on Windows); run index\n");
+                printf("                   first if the tree changed while nothing was watching\n");
+                printf("  search <query>   Search for files matching the query: words matched as a substring,\n");
+                printf("                   plus any of the filters ext:dll, type:file|dir, size>10M (also <, <=,\n");
+                printf("                   >=, =; K/M/G/T are binary units) and mtime<7d (an age in s/m/h/d/w/y,\n");
+                printf("                   so newer than a week) or mtime>2024-01-31 (a local date). Quote the\n");
+                printf("                   query in the shell; a \"quoted\" word is always text, as is a word\n");
+                printf("                   that is not a valid filter\n");
+                printf("  serve            Keep the database open and answer searches over a local socket\n");
+                printf("                   (a named pipe on Windows); search forwards to it when running\n");
+                printf("  dupes            List groups of identical files found by index --hash, largest first\n");
+                printf("  export <file>    Write every entry to a compact snapshot (sorted, prefix-compressed)\n");
+                printf("  import <file>    Load a snapshot into an empty database (--shards applies), building\n");
+                printf("                   its indexes once at the end\n");
+                printf("  maintain         Refresh planner statistics, merge FTS segments, reclaim free pages\n");
+                printf("                   (a VACUUM once for databases made before incremental auto-vacuum),\n");
+                printf("                   checkpoint the WAL and rebuild stale name indexes. index runs it\n");
+                printf("                   itself at most every %d hours, once enough has changed; with a\n", MAINTAIN_INTERVAL / 3600);
+                printf("                   search server running it goes in paced steps and skips VACUUM\n");
+                printf("  bench [dir]      Generate a synthetic tree under dir (default: %s) and report cold,\n", BENCH_DIR);
+                printf("                   unchanged and 1%%-churn index runs plus query latency as JSON; uses\n");
+                printf("                   its own database there, honouring --jobs, --shards, --engine, ...\n");
+                printf("Description:\n");
+                printf("  Indexes files/folders from Windows drives. Stores in SQLite DB at %s\n",
+                       custom_db ? custom_db : "~/.windex/.winindex.db");
+                printf("  Incremental indexing: only new/modified entries are indexed.\n");
+                printf("  Search is case-insensitive with partial matching, limited to --limit results.\n");
+                printf("  Patterns of 3+ characters are answered from a trigram index, not a table scan.\n");
+                printf("  A trailing * (e.g. win*) matches names by prefix using the name index.\n");
+                printf("  Filtered searches start from the narrowest of the matching indexes.\n");
+                _free_excluded_dirs();
+                return 0;
+            default:
+                fprintf(stderr, "Invalid option. Use --help for usage.\n");
+                _free_excluded_dirs();
+                return 1;
+        }
+    }
+
+    if (fuzzy) search_sort = SORT_SCORE;
+    search_jobs = jobs;
+
+    if (_compile_excluded_dirs() != 0) {
+        _free_excluded_dirs();
+        return 1;
+    }
+    if (num_roots == 0) _add_root(root);
+    root = roots[0];
+    if (io_backend == IO_AUTO) io_backend = IO_DEFAULT;
+#ifndef WINDEX_HAVE_IO_URING
+    if (io_backend == IO_URING) {
+        LOG_INFO("--io uring is not supported on this platform; using posix");
+        io_backend = IO_POSIX;
+    }
+#endif
+#ifndef _WIN32
+    if (io_backend == IO_FIND) {
+        LOG_INFO("--io find is Windows-only; using posix");
+        io_backend = IO_POSIX;
+    }
+#endif
+
+    // The benchmark builds its own tree and database; never open the user's index
+    if (optind < argc && strcmp(argv[optind], "bench") == 0) {
+        int rc = _bench(optind + 1 < argc ? argv[optind + 1] : BENCH_DIR, jobs);
+        _free_excluded_dirs();
+        return rc;
+    }
+
+    char db_path[MAX_PATH];
+    if (_dbp(hommy, custom_db, db_path) != 0) {
+        _free_excluded_dirs();
+        return 1;
+    }
+
+    // search takes the rest of the command line as one query, filters and words alike
+    char search_text[MAX_PATH] = "";
+    if (optind + 1 < argc && strcmp(argv[optind], "search") == 0) {
+        size_t used = 0;
+        for (int i = optind + 1; i < argc && used < sizeof(search_text); i++) {
+            used += (size_t)snprintf(search_text + used, sizeof(search_text) - used, "%s%s", used ? " " : "", argv[i]);
+        }
+        if (used >= sizeof(search_text)) {
+            fprintf(stderr, "Error: Search query too long.\n");
+            _free_excluded_dirs();
+            return 1;
+        }
+    }
+
+    // A running server already has the database open and warm
+    if (!local_only && *search_text && _search_forward(db_path, search_text, search_limit, search_sort) == 0) {
+        _free_excluded_dirs();
+        return 0;
+    }
+
+    sqlite3 *db;
+    if (_init_db(db_path, &db)) {
+        _free_excluded_dirs();
+        return 1;
+    }
+    if (_open_shards(db, db_path, shard_request) != 0) {
+        _close_db(db);
+        _free_excluded_dirs();
+        return 1;
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [--root <path>] [--exclude <dir>] [--db <path>] [--jobs <n>] [--diff] [--fast-meta] index | watch | search <query> | serve | --help\n", argv[0]);
+        _close_db(db);
+        _free_excluded_dirs();
+        return 1;
+    }
+
+    int writes = strcmp(argv[optind], "index") == 0 || strcmp(argv[optind], "watch") == 0 ||
+                 strcmp(argv[optind], "import") == 0 || strcmp(argv[optind], "maintain") == 0;
+    for (int k = 0; k < _shard_count(db); k++) {
+        sqlite3 *shard = _shard_db(db, k);
+        if (!_bulk_interrupted(shard)) continue;
+        if (writes) {
+            if (_repair_bulk_load(shard) != 0) {
+                _close_db(db);
+                _free_excluded_dirs();
+                return 1;
+            }
+        } else {
+            LOG_ERROR("%s: an index run stopped during its bulk load; searches may miss entries until index runs again",
+                      sqlite3_db_filename(shard, "main"));
+        }
+    }
+
+    if (strcmp(argv[optind], "index") == 0) {
+#ifndef WINDEX_HAVE_D_TYPE
+        if (fast_meta) LOG_INFO("--fast-meta is not supported on this platform; using stat()");
+#endif
+        if (dir_mtime_mode != DIR_MTIME_OFF && skip_dir_meta) {
+            fprintf(stderr, "Error: --dir-mtime needs directory mtimes; drop --no-dir-meta.\n");
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+        if (dir_mtime_mode != DIR_MTIME_OFF && jobs > 1) {
+            LOG_INFO("--dir-mtime walks serially; ignoring --jobs %d", jobs);
+            jobs = 1;
+        }
+        if (dir_mtime_mode != DIR_MTIME_OFF && num_roots > 1) {
+            LOG_INFO("--dir-mtime walks serially; indexing %d roots one after another", num_roots);
+        }
+        if (diff_mode && _load_path_map(db, roots, num_roots) != 0) {
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+        long long index_started = _now_us();
+        if (jobs > 1 || (num_roots > 1 && dir_mtime_mode == DIR_MTIME_OFF)) {
+            LOG_EXECUTION(_index_files_parallel(db, roots, num_roots, jobs));
+        } else {
+            LOG_EXECUTION(_index_files_dynamic(db, roots, num_roots));
+        }
+        if (hash_files) _hash_files(db, jobs);
+        if (search_engine == ENGINE_NAMES || _has_name_index(db)) _build_name_indexes(db);
+        if (stats_mode) _print_stats(db, _now_us() - index_started);
+        if (auto_maintain && _maintain_due(db)) _maintain(db, db_path, 0);
+    } else if (strcmp(argv[optind], "watch") == 0) {
+        if (num_roots > 1) {
+            fprintf(stderr, "Error: watch follows a single --root.\n");
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+        if (_watch_files(db, root) != 0) {
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+    } else if (strcmp(argv[optind], "serve") == 0) {
+        if (_serve(db, db_path, serve_warm) != 0) {
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+    } else if (strcmp(argv[optind], "search") == 0) {
+        if (optind + 1 >= argc) {
+            fprintf(stderr, "Error: Search pattern required.\n");
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+        _search_files(db, search_text);
+    } else if (strcmp(argv[optind], "export") == 0 || strcmp(argv[optind], "import") == 0) {
+        int exporting = strcmp(argv[optind], "export") == 0;
+        if (optind + 1 >= argc) {
+            fprintf(stderr, "Error: Snapshot file required.\n");
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+        if ((exporting ? _export_snapshot(db, argv[optind + 1]) : _import_snapshot(db, argv[optind + 1])) != 0) {
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+    } else if (strcmp(argv[optind], "dupes") == 0) {
+        if (_print_dupes(db) != 0) {
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+    } else if (strcmp(argv[optind], "roots") == 0) {
+        if (_print_roots(db) != 0) {
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+    } else if (strcmp(argv[optind], "maintain") == 0) {
+        if (_maintain(db, db_path, 1) != 0) {
+            _close_db(db);
+            _free_excluded_dirs();
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "Invalid command. Use --help for usage.\n");
+        _close_db(db);
+        _free_excluded_dirs();
+        return 1;
+    }
+
+    _close_db(db);
     _free_excluded_dirs();
     return 0;
 }
\ No newline at end of file